@@ -0,0 +1,542 @@
+#include <QThread>
+#include <QTime>
+#include <QDebug>
+#include <string.h>
+#include "decoder.h"
+#include "inputfile.h"
+#include "fingerprintcalculator.h"
+#include "pathstore.h"
+#include "resultcache.h"
+#include "spscring.h"
+#include "constants.h"
+#include "analysispipeline.h"
+
+struct LaneFile
+{
+	LaneFile() : file(PathStore::InvalidHandle) {}
+
+	quint32 file;
+	FileState state;
+};
+
+struct PrefetchedFile
+{
+	PrefetchedFile() : result(0), input(0), cached(false), stop(false) {}
+
+	AnalyzeResult *result;
+	// Open, with the part of the file the decoder is going to read in memory
+	InputFile *input;
+	// The result came from the result cache and is complete
+	bool cached;
+	bool stop;
+};
+
+struct PcmBlock
+{
+	enum Type
+	{
+		Start,
+		Samples,
+		End,
+		Stop
+	};
+
+	Type type;
+	AnalyzeResult *result;
+	int sampleRate;
+	int channels;
+	int size;
+	qint16 samples[PIPELINE_PCM_BLOCK_SIZE];
+};
+
+class StageThread : public QThread
+{
+public:
+	enum Stage
+	{
+		Prefetch,
+		Decode,
+		Fingerprint
+	};
+
+	StageThread(AnalysisLane *lane, Stage stage)
+		: m_lane(lane), m_stage(stage)
+	{
+	}
+
+protected:
+	void run();
+
+private:
+	AnalysisLane *m_lane;
+	Stage m_stage;
+};
+
+// Copies the decoded audio into PCM blocks for the fingerprint stage. The
+// blocks come from a fixed set that the fingerprint stage hands back after
+// use, so the decoder waits when it gets too far ahead.
+class PcmWriter : public AudioConsumer
+{
+public:
+	PcmWriter(AnalysisLane *lane) : m_lane(lane), m_block(0), m_blockSize(0) {}
+
+	void start(AnalyzeResult *result, int sampleRate, int channels);
+	void feed(qint16 *data, int size);
+	void finish(AnalyzeResult *result);
+	void stop();
+
+private:
+	PcmBlock *takeBlock(PcmBlock::Type type);
+	void flush();
+
+	AnalysisLane *m_lane;
+	PcmBlock *m_block;
+	// Samples per block, a whole number of frames
+	int m_blockSize;
+};
+
+class AnalysisLane
+{
+public:
+	AnalysisLane(AnalysisPipeline *pipeline);
+	~AnalysisLane();
+
+	void prefetch();
+	void decode();
+	void fingerprint();
+
+	AnalysisPipeline *pipeline;
+	// Files submitted to the lane and not reported yet
+	QAtomicInt pending;
+	SpscRing<LaneFile> files;
+	SpscRing<PrefetchedFile> prefetched;
+	SpscRing<PcmBlock *> pcm;
+	SpscRing<PcmBlock *> freeBlocks;
+	QList<PcmBlock *> blocks;
+	// Inputs handed back by the decode stage after closing them
+	SpscRing<InputFile *> freeInputs;
+	QList<InputFile *> inputs;
+	QList<StageThread *> threads;
+	// Each one is only written by its own stage
+	AnalysisPipeline::StageStats prefetchStats;
+	AnalysisPipeline::StageStats decodeStats;
+	AnalysisPipeline::StageStats fingerprintStats;
+};
+
+void StageThread::run()
+{
+	switch (m_stage) {
+	case Prefetch:
+		m_lane->prefetch();
+		break;
+	case Decode:
+		m_lane->decode();
+		break;
+	case Fingerprint:
+		m_lane->fingerprint();
+		break;
+	}
+}
+
+PcmBlock *PcmWriter::takeBlock(PcmBlock::Type type)
+{
+	PcmBlock *block = m_lane->freeBlocks.pop();
+	block->type = type;
+	block->result = 0;
+	block->size = 0;
+	return block;
+}
+
+void PcmWriter::flush()
+{
+	if (m_block) {
+		m_lane->pcm.push(m_block);
+		m_block = 0;
+	}
+}
+
+void PcmWriter::start(AnalyzeResult *result, int sampleRate, int channels)
+{
+	PcmBlock *block = takeBlock(PcmBlock::Start);
+	block->result = result;
+	block->sampleRate = sampleRate;
+	block->channels = channels;
+	m_lane->pcm.push(block);
+	m_blockSize = PIPELINE_PCM_BLOCK_SIZE - PIPELINE_PCM_BLOCK_SIZE % channels;
+}
+
+void PcmWriter::feed(qint16 *data, int size)
+{
+	while (size > 0) {
+		if (!m_block) {
+			m_block = takeBlock(PcmBlock::Samples);
+		}
+		int count = qMin(size, m_blockSize - m_block->size);
+		memcpy(m_block->samples + m_block->size, data, count * sizeof(qint16));
+		m_block->size += count;
+		data += count;
+		size -= count;
+		if (m_block->size == m_blockSize) {
+			flush();
+		}
+	}
+}
+
+void PcmWriter::finish(AnalyzeResult *result)
+{
+	flush();
+	PcmBlock *block = takeBlock(PcmBlock::End);
+	block->result = result;
+	m_lane->pcm.push(block);
+}
+
+void PcmWriter::stop()
+{
+	m_lane->pcm.push(takeBlock(PcmBlock::Stop));
+}
+
+AnalysisLane::AnalysisLane(AnalysisPipeline *p)
+	: pipeline(p), pending(0), files(PIPELINE_LANE_FILES), prefetched(PIPELINE_PREFETCH_DEPTH),
+	  pcm(PIPELINE_PCM_BLOCKS), freeBlocks(PIPELINE_PCM_BLOCKS), freeInputs(PIPELINE_PREFETCH_DEPTH + 2)
+{
+	// Filled before the threads start, the fingerprint and decode stages
+	// are the producers of the free lists from then on
+	for (int i = 0; i < PIPELINE_PCM_BLOCKS; i++) {
+		PcmBlock *block = new PcmBlock();
+		blocks.append(block);
+		freeBlocks.push(block);
+	}
+	// One being prefetched, one being decoded and the ones in between
+	for (int i = 0; i < PIPELINE_PREFETCH_DEPTH + 2; i++) {
+		InputFile *input = new InputFile();
+		inputs.append(input);
+		freeInputs.push(input);
+	}
+	threads.append(new StageThread(this, StageThread::Prefetch));
+	threads.append(new StageThread(this, StageThread::Decode));
+	threads.append(new StageThread(this, StageThread::Fingerprint));
+	foreach (StageThread *thread, threads) {
+		thread->start();
+	}
+}
+
+AnalysisLane::~AnalysisLane()
+{
+	// The stop marker goes through all the stages after the remaining files
+	files.push(LaneFile());
+	foreach (StageThread *thread, threads) {
+		thread->wait();
+	}
+	qDeleteAll(threads);
+	qDeleteAll(blocks);
+	qDeleteAll(inputs);
+}
+
+void AnalysisLane::prefetch()
+{
+	while (true) {
+		LaneFile next = files.pop();
+		quint32 file = next.file;
+		PrefetchedFile item;
+		if (file == PathStore::InvalidHandle) {
+			item.stop = true;
+			prefetched.push(item);
+			return;
+		}
+
+		// Waiting for an input only happens when the prefetched queue is full
+		// and then the stage would have to wait for the decoder anyway
+		item.input = freeInputs.pop();
+		QTime time;
+		time.start();
+		ResultCache *cache = pipeline->m_options.resultCache;
+		if (pipeline->isCancelled()) {
+			item.result = new AnalyzeResult();
+			item.result->file = file;
+			item.result->error = true;
+			item.result->errorMessage = "Cancelled";
+		}
+		// Files analyzed by a previous run that stopped before submitting
+		// them don't need to be read at all, the result goes through the
+		// other stages untouched
+		else if (cache && (item.result = cache->find(file, next.state))) {
+			item.cached = true;
+		}
+		else if (!item.input->open(PathStore::instance()->encodedPath(file).constData())) {
+			item.result = new AnalyzeResult();
+			item.result->file = file;
+			item.result->fileState = FileState::fromPath(PathStore::instance()->path(file));
+			item.result->error = true;
+			item.result->retry = true;
+			item.result->errorMessage = "Couldn't open the file";
+		}
+		else {
+			item.result = AnalyzeFileTask::readTags(file, item.input);
+		}
+
+		// Read the part of the file the decoder needs into memory, up to a
+		// limit, the decoder reads anything beyond that by itself
+		if (!item.result->error && !item.cached) {
+			qint64 size = qMin(AnalyzeFileTask::readahead(item.result), qint64(INPUT_READAHEAD_SIZE));
+			item.input->setReadahead(size);
+			if (!item.input->prefetch(size)) {
+				item.result->error = true;
+				item.result->retry = true;
+				item.result->errorMessage = "Couldn't read the file";
+			}
+		}
+		prefetchStats.busy += time.elapsed();
+		prefetchStats.files++;
+		prefetched.push(item);
+	}
+}
+
+void AnalysisLane::decode()
+{
+	PcmWriter writer(this);
+	while (true) {
+		PrefetchedFile item = prefetched.pop();
+		if (item.stop) {
+			writer.stop();
+			return;
+		}
+
+		QTime time;
+		time.start();
+		qint64 waited = freeBlocks.stats().consumerWait;
+		AnalyzeResult *result = item.result;
+		if (!result->error && pipeline->isCancelled()) {
+			result->error = true;
+			result->errorMessage = "Cancelled";
+		}
+		if (!result->error && !item.cached) {
+			QByteArray encodedPath = PathStore::instance()->encodedPath(result->file);
+			Decoder decoder(encodedPath.data());
+			AnalyzeFileTask::setupDecoder(&decoder, result, pipeline->m_options);
+			decoder.SetInput(item.input);
+			if (!decoder.Open()) {
+				if (!AnalyzeFileTask::checkLimits(&decoder, result)) {
+					result->error = true;
+					result->errorMessage = QString("Couldn't open the file: ") + QString::fromStdString(decoder.LastError());
+				}
+			}
+			else {
+				writer.start(result, decoder.OutputSampleRate(), decoder.OutputChannels());
+				decoder.Decode(&writer, AUDIO_LENGTH);
+				AnalyzeFileTask::checkLimits(&decoder, result);
+				result->bytesRead = decoder.IoStats().bytesRead;
+				result->readCalls = decoder.IoStats().readCalls;
+				qDebug() << "Read" << result->bytesRead << "bytes in" << result->readCalls << "reads and"
+				         << decoder.IoStats().seeks << "seeks from" << PathStore::decodeName(encodedPath);
+			}
+		}
+		item.input->close();
+		freeInputs.push(item.input);
+		writer.finish(result);
+		decodeStats.busy += time.elapsed() - (freeBlocks.stats().consumerWait - waited);
+		decodeStats.files++;
+	}
+}
+
+void AnalysisLane::fingerprint()
+{
+	ResultCache *cache = pipeline->m_options.resultCache;
+	FingerprintCalculator calculator;
+	bool started = false;
+	QTime time;
+	qint64 waited = 0;
+	while (true) {
+		PcmBlock *block = pcm.pop();
+		PcmBlock::Type type = block->type;
+		AnalyzeResult *result = block->result;
+		switch (type) {
+		case PcmBlock::Start:
+			time.start();
+			waited = pcm.stats().consumerWait;
+			started = calculator.start(block->sampleRate, block->channels);
+			if (!started) {
+				result->error = true;
+				result->errorMessage = "Error while fingerpriting the file";
+			}
+			break;
+		case PcmBlock::Samples:
+			if (started) {
+				calculator.feed(block->samples, block->size);
+			}
+			break;
+		case PcmBlock::End:
+			if (started) {
+				calculator.finish();
+				result->fingerprint = calculator.rawFingerprint();
+				if (cache) {
+					cache->insert(result);
+				}
+				fingerprintStats.busy += time.elapsed() - (pcm.stats().consumerWait - waited);
+				fingerprintStats.files++;
+				started = false;
+			}
+			break;
+		case PcmBlock::Stop:
+			break;
+		}
+		freeBlocks.push(block);
+		if (type == PcmBlock::End) {
+			pending.deref();
+			pipeline->addResult(result);
+		}
+		else if (type == PcmBlock::Stop) {
+			return;
+		}
+	}
+}
+
+AnalysisPipeline::AnalysisPipeline(const AnalyzeOptions &options, int laneCount)
+	: m_options(options), m_cancelled(0)
+{
+	if (laneCount <= 0) {
+		laneCount = qMax(1, QThread::idealThreadCount() / 2);
+	}
+	for (int i = 0; i < laneCount; i++) {
+		m_lanes.append(new AnalysisLane(this));
+	}
+}
+
+AnalysisPipeline::~AnalysisPipeline()
+{
+	cancel();
+	qDeleteAll(m_lanes);
+	qDeleteAll(m_results);
+}
+
+int AnalysisPipeline::capacity() const
+{
+	return m_lanes.size() * PIPELINE_LANE_FILES;
+}
+
+void AnalysisPipeline::submit(quint32 file, const FileState &state)
+{
+	AnalysisLane *lane = 0;
+	foreach (AnalysisLane *candidate, m_lanes) {
+		if (!lane || int(candidate->pending) < int(lane->pending)) {
+			lane = candidate;
+		}
+	}
+	LaneFile item;
+	item.file = file;
+	item.state = state;
+	lane->pending.ref();
+	lane->files.push(item);
+}
+
+void AnalysisPipeline::cancel()
+{
+	m_cancelled = 1;
+}
+
+bool AnalysisPipeline::isCancelled() const
+{
+	return m_cancelled != 0;
+}
+
+void AnalysisPipeline::addResult(AnalyzeResult *result)
+{
+	QMutexLocker locker(&m_resultsMutex);
+	m_results.append(result);
+	m_resultsCondition.wakeAll();
+	if (m_results.size() == 1) {
+		emit resultsAvailable();
+	}
+}
+
+QList<AnalyzeResult *> AnalysisPipeline::takeResults()
+{
+	QMutexLocker locker(&m_resultsMutex);
+	QList<AnalyzeResult *> results = m_results;
+	m_results.clear();
+	return results;
+}
+
+QList<AnalyzeResult *> AnalysisPipeline::waitForResults()
+{
+	QMutexLocker locker(&m_resultsMutex);
+	while (m_results.isEmpty()) {
+		m_resultsCondition.wait(&m_resultsMutex);
+	}
+	QList<AnalyzeResult *> results = m_results;
+	m_results.clear();
+	return results;
+}
+
+static void addStageStats(AnalysisPipeline::StageStats *total, const AnalysisPipeline::StageStats &stats)
+{
+	total->files += stats.files;
+	total->busy += stats.busy;
+}
+
+template <typename T>
+static void addQueueStats(AnalysisPipeline::QueueStats *total, qint64 *pushes, qint64 *occupancy, const SpscRing<T> &ring)
+{
+	typename SpscRing<T>::Stats stats = ring.stats();
+	total->capacity = ring.capacity();
+	total->maxOccupancy = qMax(total->maxOccupancy, stats.maxOccupancy);
+	*pushes += stats.pushes;
+	*occupancy += stats.occupancy;
+	total->occupancy = *pushes ? double(*occupancy) / *pushes : 0.0;
+}
+
+AnalysisPipeline::Stats AnalysisPipeline::stats() const
+{
+	Stats total;
+	total.lanes = m_lanes.size();
+	qint64 pushes[3] = { 0, 0, 0 }, occupancy[3] = { 0, 0, 0 };
+	foreach (AnalysisLane *lane, m_lanes) {
+		addStageStats(&total.prefetch, lane->prefetchStats);
+		addStageStats(&total.decode, lane->decodeStats);
+		addStageStats(&total.fingerprint, lane->fingerprintStats);
+
+		SpscRing<LaneFile>::Stats files = lane->files.stats();
+		SpscRing<PrefetchedFile>::Stats prefetched = lane->prefetched.stats();
+		SpscRing<PcmBlock *>::Stats pcm = lane->pcm.stats();
+		SpscRing<PcmBlock *>::Stats freeBlocks = lane->freeBlocks.stats();
+		// Waiting for files to prefetch is idle time, not a stall
+		total.prefetch.inputStalls += files.consumerStalls;
+		total.prefetch.inputWait += files.consumerWait;
+		total.prefetch.outputStalls += prefetched.producerStalls;
+		total.prefetch.outputWait += prefetched.producerWait;
+		total.decode.inputStalls += prefetched.consumerStalls;
+		total.decode.inputWait += prefetched.consumerWait;
+		total.decode.outputStalls += freeBlocks.consumerStalls;
+		total.decode.outputWait += freeBlocks.consumerWait;
+		total.fingerprint.inputStalls += pcm.consumerStalls;
+		total.fingerprint.inputWait += pcm.consumerWait;
+
+		addQueueStats(&total.files, &pushes[0], &occupancy[0], lane->files);
+		addQueueStats(&total.prefetched, &pushes[1], &occupancy[1], lane->prefetched);
+		addQueueStats(&total.pcm, &pushes[2], &occupancy[2], lane->pcm);
+		foreach (InputFile *input, lane->inputs) {
+			total.inputAllocations += input->allocations();
+		}
+	}
+	return total;
+}
+
+void AnalysisPipeline::logStats() const
+{
+	Stats total = stats();
+	const char *names[] = { "prefetch", "decode", "fingerprint" };
+	const StageStats *stages[] = { &total.prefetch, &total.decode, &total.fingerprint };
+	qDebug() << "Analysis pipeline with" << total.lanes << "lanes";
+	for (int i = 0; i < 3; i++) {
+		const StageStats *stage = stages[i];
+		qDebug() << "  " << names[i] << "stage:" << stage->files << "files," << stage->busy << "ms busy,"
+		         << stage->inputWait << "ms waiting for input in" << stage->inputStalls << "stalls,"
+		         << stage->outputWait << "ms waiting for output in" << stage->outputStalls << "stalls";
+	}
+	const char *queueNames[] = { "files", "prefetched", "pcm" };
+	const QueueStats *queues[] = { &total.files, &total.prefetched, &total.pcm };
+	for (int i = 0; i < 3; i++) {
+		const QueueStats *queue = queues[i];
+		qDebug() << "  " << queueNames[i] << "queue:" << queue->occupancy << "of" << queue->capacity
+		         << "used on average," << queue->maxOccupancy << "at most";
+	}
+}
@@ -0,0 +1,112 @@
+#ifndef FPSUBMIT_ANALYSISPIPELINE_H_
+#define FPSUBMIT_ANALYSISPIPELINE_H_
+
+#include <QObject>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include "analyzefiletask.h"
+
+class AnalysisLane;
+
+// Analyzes files in lanes of three threads, one per stage, connected by
+// bounded single-producer single-consumer queues. The prefetch stage opens
+// the file, reads the tags and the part of the file we are going to decode
+// into memory, the decode stage reads the audio from the same open file
+// and turns it into PCM blocks and the fingerprint stage feeds them to
+// chromaprint. Each stage works on a different file, so the I/O for
+// the next files overlaps with decoding and fingerprinting the current one,
+// and a full queue stops a stage that gets too far ahead instead of letting
+// the data pile up. Finished results are collected in a list, the
+// resultsAvailable() signal is emitted from the lane threads when it stops
+// being empty.
+class AnalysisPipeline : public QObject
+{
+	Q_OBJECT
+
+public:
+	struct StageStats
+	{
+		StageStats() : files(0), busy(0), inputStalls(0), inputWait(0), outputStalls(0), outputWait(0) {}
+
+		int files;
+		// Milliseconds spent working
+		qint64 busy;
+		// Times the stage waited for the previous one and for how long
+		int inputStalls;
+		qint64 inputWait;
+		// Times the stage waited for the next one and for how long
+		int outputStalls;
+		qint64 outputWait;
+	};
+
+	struct QueueStats
+	{
+		QueueStats() : capacity(0), occupancy(0.0), maxOccupancy(0) {}
+
+		int capacity;
+		// Average number of queued items after each push
+		double occupancy;
+		int maxOccupancy;
+	};
+
+	// Summed over all lanes, the queue capacities are per lane.
+	struct Stats
+	{
+		Stats() : lanes(0), inputAllocations(0) {}
+
+		int lanes;
+		// Buffers allocated by the inputs, including the prefetched data
+		int inputAllocations;
+		StageStats prefetch;
+		StageStats decode;
+		StageStats fingerprint;
+		// Files waiting to be prefetched
+		QueueStats files;
+		// Files read into memory, waiting to be decoded
+		QueueStats prefetched;
+		// Blocks of PCM waiting to be fingerprinted
+		QueueStats pcm;
+	};
+
+	// By default there is one lane for every two cores, decoding and
+	// fingerprinting are the stages that need a whole core.
+	AnalysisPipeline(const AnalyzeOptions &options, int laneCount = 0);
+	~AnalysisPipeline();
+
+	// Number of files that can be in the pipeline at the same time.
+	int capacity() const;
+	// Queues the file on the lane with the least work, there must be room for
+	// it. The state is the one the file was queued with, it's used for
+	// looking up the result cache from the options.
+	void submit(quint32 file, const FileState &state = FileState());
+	// Files that are still in the pipeline are reported as failed without
+	// analyzing them.
+	void cancel();
+	bool isCancelled() const;
+
+	QList<AnalyzeResult *> takeResults();
+	// Like takeResults(), but blocks until there is at least one result.
+	QList<AnalyzeResult *> waitForResults();
+
+	Stats stats() const;
+	void logStats() const;
+
+signals:
+	void resultsAvailable();
+
+private:
+	friend class AnalysisLane;
+
+	void addResult(AnalyzeResult *result);
+
+	AnalyzeOptions m_options;
+	QList<AnalysisLane *> m_lanes;
+	QAtomicInt m_cancelled;
+	QMutex m_resultsMutex;
+	QWaitCondition m_resultsCondition;
+	QList<AnalyzeResult *> m_results;
+};
+
+#endif
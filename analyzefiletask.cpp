@@ -1,29 +1,85 @@
 #include <QDebug>
 #include <QFile>
+#include <QSettings>
 #include "decoder.h"
 #include "tagreader.h"
 #include "utils.h"
+#include "pathstore.h"
+#include "resultarena.h"
+#include "resultcache.h"
 #include "analyzefiletask.h"
 #include "constants.h"
 
-AnalyzeFileTask::AnalyzeFileTask(const QString &path)
-	: m_path(path)
+AnalyzeOptions::AnalyzeOptions()
+	: downsample(false), fastProbe(true), maxBytes(MAX_DECODE_BYTES), maxPackets(MAX_DECODE_PACKETS), maxTime(MAX_DECODE_TIME),
+	  resultCache(0)
+{
+}
+
+AnalyzeOptions AnalyzeOptions::fromSettings()
+{
+	QSettings settings;
+	AnalyzeOptions options;
+	options.downsample = settings.value("decoder/downsample", false).toBool();
+	options.fastProbe = settings.value("decoder/fastprobe", true).toBool();
+	options.maxBytes = settings.value("decoder/maxbytes", options.maxBytes).toLongLong();
+	options.maxPackets = settings.value("decoder/maxpackets", options.maxPackets).toInt();
+	options.maxTime = settings.value("decoder/maxtime", options.maxTime).toInt();
+	return options;
+}
+
+void *AnalyzeResult::operator new(size_t size)
+{
+	return ResultArena::instance()->allocate(size);
+}
+
+void AnalyzeResult::operator delete(void *result)
+{
+	// Results still queued at exit can outlive the arena
+	ResultArena *arena = ResultArena::instance();
+	if (arena) {
+		arena->release(result);
+	}
+}
+
+AnalyzeFileTask::AnalyzeFileTask(quint32 file, const FileState &state, const AnalyzeOptions &options)
+	: m_file(file), m_state(state), m_options(options)
 {
 }
 
 void AnalyzeFileTask::run()
 {
-    qDebug() << "Analyzing file" << m_path;
+	ResultCache *cache = m_options.resultCache;
+	AnalyzeResult *result = cache ? cache->find(m_file, m_state) : 0;
+	if (!result) {
+		result = analyze(m_file, m_options);
+		if (cache) {
+			cache->insert(result);
+		}
+	}
+	emit finished(result);
+}
+
+AnalyzeResult *AnalyzeFileTask::readTags(quint32 file, InputFile *input)
+{
+    QString path = PathStore::instance()->path(file);
+    qDebug() << "Analyzing file" << path;
 
     AnalyzeResult *result = new AnalyzeResult();
-    result->fileName = m_path;
+    result->file = file;
+    result->fileState = FileState::fromPath(path);
+    if (!input->isOpen()) {
+        result->error = true;
+        result->retry = true;
+        result->errorMessage = "Couldn't open the file";
+        return result;
+    }
 
-    TagReader tags(m_path);
-    if (!tags.read()) {
+    TagReader tags(path);
+    if (!tags.read(input)) {
         result->error = true;
         result->errorMessage = "Couldn't read metadata";
-		emit finished(result);
-        return;
+        return result;
     }
 
 	qDebug() << "Track:" << tags.track();
@@ -37,9 +93,9 @@ void AnalyzeFileTask::run()
 
 	result->mbid = tags.mbid();
 	result->track = tags.track();
-	result->artist = tags.artist();
-	result->album = tags.album();
-	result->albumArtist = tags.albumArtist();
+	result->artist = ResultArena::intern(tags.artist());
+	result->album = ResultArena::intern(tags.album());
+	result->albumArtist = ResultArena::intern(tags.albumArtist());
 	result->puid = tags.puid();
 	result->trackNo = tags.trackNo();
 	result->discNo = tags.discNo();
@@ -49,40 +105,91 @@ void AnalyzeFileTask::run()
     if (result->length < 10) {
         result->error = true;
         result->errorMessage = "Too short audio stream, should be at least 10 seconds";
-		emit finished(result);
-        return;
+        return result;
     }
 
     if (result->mbid.isEmpty() && result->puid.isEmpty() && (result->track.isEmpty() || result->album.isEmpty() || result->artist.isEmpty())) {
         result->error = true;
         result->errorMessage = "Couldn't find any usable metadata";
-		emit finished(result);
-        return;
+        return result;
     }
+    return result;
+}
+
+qint64 AnalyzeFileTask::readahead(const AnalyzeResult *result)
+{
+    // Enough to cover the part of the audio we fingerprint, plus the headers
+    if (result->bitrate > 0) {
+        return qint64(result->bitrate) * 1000 / 8 * (AUDIO_LENGTH + 10) + INPUT_BLOCK_SIZE;
+    }
+    return INPUT_READAHEAD_SIZE;
+}
+
+void AnalyzeFileTask::setupDecoder(Decoder *decoder, const AnalyzeResult *result, const AnalyzeOptions &options)
+{
+    decoder->SetReadahead(readahead(result));
+    decoder->SetFastProbe(options.fastProbe);
+    if (options.downsample) {
+        decoder->SetTargetSampleRate(FINGERPRINT_SAMPLE_RATE);
+    }
+    Decoder::Limits limits;
+    limits.bytes = options.maxBytes;
+    limits.packets = options.maxPackets;
+    limits.time = options.maxTime;
+    decoder->SetLimits(limits);
+}
+
+bool AnalyzeFileTask::checkLimits(Decoder *decoder, AnalyzeResult *result)
+{
+    Decoder::Limit limit = decoder->LimitReached();
+    if (limit == Decoder::NoLimit) {
+        return false;
+    }
+    // The time limit depends on how busy the disk and the CPU are, but a
+    // file that needs too many bytes or packets needs them every time, it's
+    // recorded as failed so it isn't decoded again on every scan
+    result->error = true;
+    result->retry = limit == Decoder::TimeLimit;
+    result->errorMessage = QString("Gave up on the file: ") + QString::fromStdString(decoder->LastError());
+    return true;
+}
 
-#ifdef Q_OS_WIN32
-    QByteArray encodedPath = m_path.toUtf8();
-#else
-    QByteArray encodedPath = QFile::encodeName(m_path);
-#endif
+AnalyzeResult *AnalyzeFileTask::analyze(quint32 file, const AnalyzeOptions &options)
+{
+    // The tags and the audio are read from the same file, opened only once
+    QByteArray encodedPath = PathStore::instance()->encodedPath(file);
     Decoder decoder(encodedPath.data());
+    decoder.OpenInput();
+    AnalyzeResult *result = readTags(file, decoder.Input());
+    if (result->error) {
+        return result;
+    }
+
+    setupDecoder(&decoder, result, options);
     if (!decoder.Open()) {
+        if (checkLimits(&decoder, result)) {
+            return result;
+        }
         result->error = true;
         result->errorMessage = QString("Couldn't open the file: ") + QString::fromStdString(decoder.LastError());
-		emit finished(result);
-        return;
+        return result;
     }
 
     FingerprintCalculator fpcalculator;
-    if (!fpcalculator.start(decoder.SampleRate(), decoder.Channels())) {
+    if (!fpcalculator.start(decoder.OutputSampleRate(), decoder.OutputChannels())) {
         result->error = true;
         result->errorMessage = "Error while fingerpriting the file";
-		emit finished(result);
-        return;
+        return result;
 	}
     decoder.Decode(&fpcalculator, AUDIO_LENGTH);
-    result->fingerprint = fpcalculator.finish();
-
-	emit finished(result);
+    if (checkLimits(&decoder, result)) {
+        return result;
+    }
+    fpcalculator.finish();
+    result->fingerprint = fpcalculator.rawFingerprint();
+    result->bytesRead = decoder.IoStats().bytesRead;
+    result->readCalls = decoder.IoStats().readCalls;
+    qDebug() << "Read" << result->bytesRead << "bytes in" << result->readCalls << "reads and"
+             << decoder.IoStats().seeks << "seeks from" << PathStore::instance()->path(file);
+    return result;
 }
-
@@ -4,16 +4,30 @@
 #include <QRunnable>
 #include <QObject>
 #include <QStringList>
+#include <QVector>
+#include "filestatecache.h"
 
+class Decoder;
+class InputFile;
+class ResultCache;
+
+// Allocated from ResultArena. Results are handed from the worker to the
+// submit queue by pointer and can't be copied, whoever holds the pointer
+// owns the result.
 struct AnalyzeResult
 {
-    AnalyzeResult() : error(false)
+    AnalyzeResult() : file(0), bytesRead(0), readCalls(0), error(false), retry(false)
     {
     }
 
-    QString fileName;
+	static void *operator new(size_t size);
+	static void operator delete(void *result);
+
+    quint32 file;
+    FileState fileState;
     QString mbid;
-    QString fingerprint;
+    // Raw, it's only encoded when it's submitted
+    QVector<quint32> fingerprint;
 	QString track;
 	QString artist;
 	QString album;
@@ -24,8 +38,38 @@ struct AnalyzeResult
 	int year;
     int length;
     int bitrate;
+    qint64 bytesRead;
+    int readCalls;
     bool error;
+    // The error might not happen next time, the file couldn't be read or
+    // the time limit stopped it, so it's not recorded as failed
+    bool retry;
     QString errorMessage;
+
+private:
+	Q_DISABLE_COPY(AnalyzeResult)
+};
+
+// Settings that affect how files are analyzed, read once per run.
+struct AnalyzeOptions
+{
+	AnalyzeOptions();
+
+	static AnalyzeOptions fromSettings();
+
+	// Mix down to mono and resample to the fingerprint rate while decoding
+	bool downsample;
+	// Try a cheap probe of the container before the full one
+	bool fastProbe;
+	// Give up on files that need more than this to decode, zero means no limit
+	qint64 maxBytes;
+	int maxPackets;
+	// Milliseconds
+	int maxTime;
+	// Results are looked up here before analyzing a file and stored here
+	// afterwards, on the analysis threads. None by default, the caller
+	// decides whether to use one.
+	ResultCache *resultCache;
 };
 
 class AnalyzeFileTask : public QObject, public QRunnable
@@ -33,14 +77,32 @@ class AnalyzeFileTask : public QObject, public QRunnable
 	Q_OBJECT
 
 public:
-	AnalyzeFileTask(const QString &path);
+	AnalyzeFileTask(quint32 file, const FileState &state, const AnalyzeOptions &options = AnalyzeOptions());
 	void run();
 
+	// Analyzes the file from start to end on the calling thread.
+	static AnalyzeResult *analyze(quint32 file, const AnalyzeOptions &options);
+
+	// The steps of analyze(), AnalysisPipeline runs them on separate threads.
+	// readTags() reads the metadata through the input the file is going to
+	// be decoded from and marks the result as failed if the file can't be
+	// opened or is not worth decoding.
+	static AnalyzeResult *readTags(quint32 file, InputFile *input);
+	// Number of bytes from the start of the file the decoder is going to read.
+	static qint64 readahead(const AnalyzeResult *result);
+	static void setupDecoder(Decoder *decoder, const AnalyzeResult *result, const AnalyzeOptions &options);
+	// Marks the result as failed if the decoder gave up on the file because
+	// of one of the limits.
+	static bool checkLimits(Decoder *decoder, AnalyzeResult *result);
+
 signals:
 	void finished(AnalyzeResult *result);
 
 private:
-	QString m_path;
+	quint32 m_file;
+	// As seen when the file was queued
+	FileState m_state;
+	AnalyzeOptions m_options;
 };
 
 #endif
@@ -0,0 +1,15 @@
+#ifndef FPSUBMIT_AUDIOCONSUMER_H_
+#define FPSUBMIT_AUDIOCONSUMER_H_
+
+#include <QtGlobal>
+
+// Receives the decoded audio from a Decoder, as interleaved 16-bit samples.
+// The size is the number of samples, always a whole number of frames.
+class AudioConsumer
+{
+public:
+	virtual ~AudioConsumer() {}
+	virtual void feed(qint16 *data, int size) = 0;
+};
+
+#endif
@@ -0,0 +1,1254 @@
+#include <QCoreApplication>
+#include <QStringList>
+#include <QTime>
+#include <QTextStream>
+#include <QFile>
+#include <QDir>
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QHash>
+#include <QSet>
+#include <QPair>
+#include <QtAlgorithms>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "directoryscanner.h"
+#include "pathstore.h"
+#include "filequeue.h"
+#include "filestatecache.h"
+#include "sampleconverter.h"
+#include "decoder.h"
+#include "decoderresources.h"
+#include "fingerprintcalculator.h"
+#include "analyzefiletask.h"
+#include "analysispipeline.h"
+#include "resultcache.h"
+#include "duplicateindex.h"
+#include "resultarena.h"
+#include "constants.h"
+#include "benchmark.h"
+
+static QTextStream out(stdout);
+
+static qint64 residentMemory()
+{
+#ifdef Q_OS_LINUX
+	QFile file("/proc/self/statm");
+	if (file.open(QIODevice::ReadOnly)) {
+		QList<QByteArray> fields = file.readAll().split(' ');
+		return fields.value(1).toLongLong() * sysconf(_SC_PAGESIZE);
+	}
+#endif
+	return -1;
+}
+
+static int benchmarkScan(const QStringList &directories)
+{
+	if (directories.isEmpty()) {
+		out << "Usage: --benchmark-scan DIRECTORY...\n";
+		return 1;
+	}
+	// The first pass warms up the dentry cache, so that all measured passes
+	// see the same state of the filesystem
+	int threadCounts[] = { 1, 1, 2, 4, 8, 16 };
+	for (size_t i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++) {
+		DirectoryScanner scanner(directories, threadCounts[i]);
+		QTime time;
+		time.start();
+		scanner.scan();
+		int elapsed = qMax(1, time.elapsed());
+		out << (i == 0 ? "warmup" : "scan") << " threads=" << threadCounts[i]
+		    << " directories=" << scanner.directoryCount()
+		    << " files=" << scanner.fileCount()
+		    << " time=" << elapsed << "ms"
+		    << " throughput=" << qint64(scanner.directoryCount()) * 1000 / elapsed << " directories/s\n";
+		out.flush();
+	}
+	return 0;
+}
+
+static int benchmarkPaths(const QStringList &directories)
+{
+	if (directories.isEmpty()) {
+		out << "Usage: --benchmark-paths DIRECTORY...\n";
+		return 1;
+	}
+	PathStore *paths = PathStore::instance();
+	qint64 initialMemory = residentMemory();
+	DirectoryScanner scanner(directories);
+	scanner.scan();
+	qint64 storeMemory = residentMemory();
+	out << "store files=" << paths->fileCount()
+	    << " directories=" << paths->directoryCount()
+	    << " size=" << paths->memoryUsage() / 1024 << "KB"
+	    << " rss=" << (storeMemory - initialMemory) / 1024 << "KB\n";
+	out.flush();
+
+	// The same paths the way they used to be kept, one QString each
+	QStringList strings;
+	for (int i = 0; i < paths->fileCount(); i++) {
+		strings.append(paths->path(i));
+	}
+	qint64 stringMemory = residentMemory();
+	out << "strings files=" << strings.size()
+	    << " size=" << paths->stringMemoryUsage() / 1024 << "KB"
+	    << " rss=" << (stringMemory - storeMemory) / 1024 << "KB\n";
+	return 0;
+}
+
+class ReadWorker : public QThread
+{
+public:
+	ReadWorker(FileQueue *queue) : m_queue(queue), m_bytes(0) {}
+
+	qint64 bytes() const { return m_bytes; }
+
+protected:
+	void run()
+	{
+		QByteArray buffer(256 * 1024, 0);
+		quint32 handle;
+		while (m_queue->take(&handle)) {
+			QFile file(PathStore::instance()->path(handle));
+			if (!file.open(QIODevice::ReadOnly)) {
+				m_queue->release(handle);
+				continue;
+			}
+			qint64 size;
+			while ((size = file.read(buffer.data(), buffer.size())) > 0) {
+				m_bytes += size;
+			}
+			m_queue->release(handle);
+		}
+	}
+
+private:
+	FileQueue *m_queue;
+	qint64 m_bytes;
+};
+
+static void dropPageCache(const QList<QByteArray> &encodedPaths)
+{
+#ifdef Q_OS_LINUX
+	// Dropping the whole page cache needs root, evicting the files one by
+	// one works for anybody as long as they are not dirty
+	sync();
+	QFile dropCaches("/proc/sys/vm/drop_caches");
+	if (dropCaches.open(QIODevice::WriteOnly)) {
+		dropCaches.write("1\n");
+		dropCaches.close();
+	}
+	foreach (const QByteArray &encodedPath, encodedPaths) {
+		int fd = open(encodedPath.constData(), O_RDONLY | O_CLOEXEC);
+		if (fd != -1) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+	}
+#else
+	Q_UNUSED(encodedPaths);
+#endif
+}
+
+static int benchmarkOrder(const QStringList &directories)
+{
+	if (directories.isEmpty()) {
+		out << "Usage: --benchmark-order DIRECTORY...\n";
+		return 1;
+	}
+	DirectoryScanner scanner(directories);
+	scanner.scan();
+	PathStore *paths = PathStore::instance();
+	QList<quint32> files;
+	QList<QByteArray> encodedPaths;
+	QList<FileState> states;
+	for (int i = 0; i < paths->fileCount(); i++) {
+		files.append(i);
+		encodedPaths.append(paths->encodedPath(i));
+		states.append(FileState::fromPath(paths->path(i)));
+	}
+
+	FileQueue::Order orders[] = { FileQueue::ListingOrder, FileQueue::InodeOrder, FileQueue::ExtentOrder };
+	for (size_t i = 0; i < sizeof(orders) / sizeof(orders[0]); i++) {
+		FileQueue queue(files.size() + 1, orders[i]);
+		queue.setDeviceConcurrency(MAX_ACTIVE_FILES);
+		QList<FileQueue::Entry> entries;
+		for (int j = 0; j < files.size(); j++) {
+			FileQueue::Entry entry;
+			entry.file = files.at(j);
+			entry.state = states.at(j);
+			entry.key = FileQueue::sortKey(encodedPaths.at(j), states.at(j), orders[i]);
+			entries.append(entry);
+		}
+		queue.push(entries);
+		dropPageCache(encodedPaths);
+
+		QTime time;
+		time.start();
+		QList<ReadWorker *> workers;
+		for (int j = 0; j < MAX_ACTIVE_FILES; j++) {
+			ReadWorker *worker = new ReadWorker(&queue);
+			worker->start();
+			workers.append(worker);
+		}
+		qint64 bytes = 0;
+		foreach (ReadWorker *worker, workers) {
+			worker->wait();
+			bytes += worker->bytes();
+			delete worker;
+		}
+		int elapsed = qMax(1, time.elapsed());
+		out << "read order=" << FileQueue::orderName(orders[i])
+		    << " readers=" << MAX_ACTIVE_FILES
+		    << " files=" << files.size()
+		    << " size=" << bytes / (1024 * 1024) << "MB"
+		    << " time=" << elapsed << "ms"
+		    << " throughput=" << bytes * 1000 / elapsed / (1024 * 1024) << " MB/s\n";
+		out.flush();
+	}
+	return 0;
+}
+
+static void fillRandomSamples(SampleConverter::Format format, QByteArray *buffer, int count)
+{
+	for (int i = 0; i < count; i++) {
+		double value = rand() * 2.2 / RAND_MAX - 1.1;
+		switch (format) {
+		case SampleConverter::U8:
+			reinterpret_cast<uint8_t *>(buffer->data())[i] = rand();
+			break;
+		case SampleConverter::S16:
+			reinterpret_cast<int16_t *>(buffer->data())[i] = rand();
+			break;
+		case SampleConverter::S32:
+			reinterpret_cast<int32_t *>(buffer->data())[i] = (rand() << 16) ^ rand();
+			break;
+		case SampleConverter::Float:
+			reinterpret_cast<float *>(buffer->data())[i] = float(value);
+			break;
+		case SampleConverter::Double:
+			reinterpret_cast<double *>(buffer->data())[i] = value;
+			break;
+		}
+	}
+}
+
+// Checks every kernel the CPU supports against the scalar reference and
+// measures how fast they are. Odd lengths make sure the tails are covered.
+static int benchmarkConvert()
+{
+	const char *formatNames[] = { "u8", "s16", "s32", "float", "double" };
+	const int sampleSizes[] = { 1, 2, 4, 4, 8 };
+	const int frames = 1024 * 1024 + 13;
+	const int iterations = 20;
+	int failures = 0;
+	for (int format = SampleConverter::U8; format <= SampleConverter::Double; format++) {
+		for (int planar = 0; planar < 2; planar++) {
+			for (int channels = 1; channels <= 3; channels++) {
+				int planeCount = planar ? channels : 1;
+				int planeSamples = planar ? frames : frames * channels;
+				QList<QByteArray> buffers;
+				const uint8_t *planes[8];
+				for (int i = 0; i < planeCount; i++) {
+					buffers.append(QByteArray(planeSamples * sampleSizes[format], 0));
+					fillRandomSamples(SampleConverter::Format(format), &buffers[i], planeSamples);
+					planes[i] = reinterpret_cast<const uint8_t *>(buffers[i].constData());
+				}
+				QVector<int16_t> reference(frames * channels);
+				SampleConverter::convertReference(SampleConverter::Format(format), planar, planes, channels, frames, reference.data());
+
+				for (int kernel = SampleConverter::Scalar; kernel <= SampleConverter::bestKernel(); kernel++) {
+					SampleConverter converter;
+					converter.setFormat(SampleConverter::Format(format), planar, channels, SampleConverter::Kernel(kernel));
+					if (converter.kernel() != kernel) {
+						continue;
+					}
+					const int16_t *output = converter.convert(planes, frames);
+					bool exact = memcmp(output, reference.constData(), frames * channels * sizeof(int16_t)) == 0;
+					if (!exact) {
+						failures++;
+					}
+					QTime time;
+					time.start();
+					for (int i = 0; i < iterations; i++) {
+						converter.convert(planes, frames);
+					}
+					int elapsed = qMax(1, time.elapsed());
+					out << "convert format=" << formatNames[format]
+					    << " layout=" << (planar ? "planar" : "interleaved")
+					    << " channels=" << channels
+					    << " kernel=" << SampleConverter::kernelName(converter.kernel())
+					    << " throughput=" << qint64(frames) * channels * iterations / elapsed / 1000 << " Msamples/s"
+					    << " exact=" << (exact ? "yes" : "NO") << "\n";
+					out.flush();
+				}
+			}
+		}
+	}
+	if (failures) {
+		out << failures << " kernels don't match the reference\n";
+		return 1;
+	}
+	return 0;
+}
+
+class OpenWorker : public QThread
+{
+public:
+	OpenWorker(const QList<QByteArray> &files, QAtomicInt *next, QMutex *serialize)
+		: m_files(files), m_next(next), m_serialize(serialize), m_opened(0)
+	{
+	}
+
+	int opened() const { return m_opened; }
+
+protected:
+	void run()
+	{
+		while (true) {
+			int index = m_next->fetchAndAddRelaxed(1);
+			if (index >= m_files.size()) {
+				break;
+			}
+			Decoder decoder(m_files.at(index).constData());
+			if (m_serialize) {
+				m_serialize->lock();
+			}
+			bool ok = decoder.Open();
+			if (m_serialize) {
+				m_serialize->unlock();
+			}
+			if (ok) {
+				m_opened++;
+			}
+		}
+	}
+
+private:
+	QList<QByteArray> m_files;
+	QAtomicInt *m_next;
+	QMutex *m_serialize;
+	int m_opened;
+};
+
+// Opens and probes all files with increasing numbers of threads. The
+// serialized runs hold a global lock around Decoder::Open(), the way it
+// used to work, for comparison.
+static int benchmarkOpen(const QStringList &directories)
+{
+	if (directories.isEmpty()) {
+		out << "Usage: --benchmark-open DIRECTORY...\n";
+		return 1;
+	}
+	DirectoryScanner scanner(directories);
+	scanner.scan();
+	PathStore *paths = PathStore::instance();
+	QList<QByteArray> files;
+	for (int i = 0; i < paths->fileCount(); i++) {
+		files.append(paths->encodedPath(i));
+	}
+
+	int threadCounts[] = { 1, 2, 4, 8, 16 };
+	for (int serialized = 1; serialized >= 0; serialized--) {
+		for (size_t i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++) {
+			dropPageCache(files);
+			QMutex mutex;
+			QAtomicInt next(0);
+			QTime time;
+			time.start();
+			QList<OpenWorker *> workers;
+			for (int j = 0; j < threadCounts[i]; j++) {
+				OpenWorker *worker = new OpenWorker(files, &next, serialized ? &mutex : 0);
+				worker->start();
+				workers.append(worker);
+			}
+			int opened = 0;
+			foreach (OpenWorker *worker, workers) {
+				worker->wait();
+				opened += worker->opened();
+				delete worker;
+			}
+			int elapsed = qMax(1, time.elapsed());
+			out << "open mode=" << (serialized ? "serialized" : "concurrent")
+			    << " threads=" << threadCounts[i]
+			    << " files=" << opened << "/" << files.size()
+			    << " time=" << elapsed << "ms"
+			    << " throughput=" << qint64(files.size()) * 1000 / elapsed << " files/s\n";
+			out.flush();
+		}
+	}
+	return 0;
+}
+
+static bool calculateFingerprint(const QString &path, bool downsample, bool native, QVector<quint32> *fingerprint, bool *usedNative = 0)
+{
+	QByteArray encodedPath = PathStore::encodeName(path);
+	Decoder decoder(encodedPath.data());
+	if (downsample) {
+		decoder.SetTargetSampleRate(FINGERPRINT_SAMPLE_RATE);
+	}
+	decoder.SetNativeDecoding(native);
+	if (!decoder.Open()) {
+		return false;
+	}
+	if (usedNative) {
+		*usedNative = decoder.IsNative();
+	}
+	FingerprintCalculator calculator;
+	if (!calculator.start(decoder.OutputSampleRate(), decoder.OutputChannels())) {
+		return false;
+	}
+	decoder.Decode(&calculator, AUDIO_LENGTH);
+	calculator.finish();
+	*fingerprint = calculator.rawFingerprint();
+	return true;
+}
+
+static int popCount(quint32 x)
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	return (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+// Compares fingerprints calculated with and without downsampling in the
+// decoder. The fingerprints are not bit-identical, chromaprint's own
+// resampler is different, but they must stay close enough to match.
+static int benchmarkDownsample(const QStringList &files)
+{
+	if (files.isEmpty()) {
+		out << "Usage: --benchmark-downsample FILE...\n";
+		return 1;
+	}
+	const double maxBitErrorRate = 0.05;
+	int failures = 0;
+	qint64 totalBits = 0, totalErrors = 0;
+	int originalTime = 0, downsampledTime = 0;
+	foreach (const QString &file, files) {
+		QVector<quint32> original, downsampled;
+		QTime time;
+		time.start();
+		bool ok = calculateFingerprint(file, false, true, &original);
+		int elapsed = time.restart();
+		ok = ok && calculateFingerprint(file, true, true, &downsampled);
+		originalTime += elapsed;
+		downsampledTime += time.elapsed();
+		if (!ok) {
+			out << "skipped file=" << file << "\n";
+			continue;
+		}
+		int size = qMin(original.size(), downsampled.size());
+		int errors = 0;
+		for (int i = 0; i < size; i++) {
+			errors += popCount(original.at(i) ^ downsampled.at(i));
+		}
+		// Missing items at the end count as completely different
+		int bits = 32 * qMax(original.size(), downsampled.size());
+		errors += 32 * (qMax(original.size(), downsampled.size()) - size);
+		double bitErrorRate = bits ? double(errors) / bits : 0.0;
+		if (bitErrorRate > maxBitErrorRate) {
+			failures++;
+		}
+		totalBits += bits;
+		totalErrors += errors;
+		out << "fingerprint file=" << file
+		    << " length=" << original.size() << "/" << downsampled.size()
+		    << " ber=" << bitErrorRate
+		    << (bitErrorRate > maxBitErrorRate ? " FAILED" : "") << "\n";
+		out.flush();
+	}
+	out << "total ber=" << (totalBits ? double(totalErrors) / totalBits : 0.0)
+	    << " max=" << maxBitErrorRate
+	    << " time=" << originalTime << "ms downsampled=" << downsampledTime << "ms\n";
+	return failures ? 1 : 0;
+}
+
+// Opens the files with FFmpeg's full probing and with the fast probe, and
+// reports how much each had to read and how often the fast probe had to
+// fall back to the full one.
+static int benchmarkProbe(const QStringList &files)
+{
+	if (files.isEmpty()) {
+		out << "Usage: --benchmark-probe FILE...\n";
+		return 1;
+	}
+	QList<QByteArray> encodedPaths;
+	foreach (const QString &file, files) {
+		encodedPaths.append(PathStore::encodeName(file));
+	}
+	for (int fast = 0; fast <= 1; fast++) {
+		Decoder::ProbeStats before = Decoder::GetProbeStats();
+		qint64 bytesRead = 0;
+		int readCalls = 0, opened = 0;
+		QTime time;
+		time.start();
+		foreach (const QByteArray &encodedPath, encodedPaths) {
+			Decoder decoder(encodedPath.data());
+			decoder.SetNativeDecoding(false);
+			decoder.SetFastProbe(fast);
+			if (decoder.Open()) {
+				opened++;
+			}
+			bytesRead += decoder.IoStats().bytesRead;
+			readCalls += decoder.IoStats().readCalls;
+		}
+		int elapsed = qMax(1, time.elapsed());
+		Decoder::ProbeStats after = Decoder::GetProbeStats();
+		out << "probe mode=" << (fast ? "fast" : "full")
+		    << " files=" << opened << "/" << files.size()
+		    << " time=" << elapsed << "ms"
+		    << " bytes=" << bytesRead
+		    << " reads=" << readCalls
+		    << " fast=" << after.fast - before.fast
+		    << " fallback=" << after.fallback - before.fallback
+		    << " full=" << after.full - before.full << "\n";
+		out.flush();
+	}
+	return 0;
+}
+
+// Decodes the files once with a fresh set of decoder resources for each
+// file, the way it used to work, and twice reusing the thread's set. The
+// last pass is expected to make no allocations at all.
+static int benchmarkDecode(const QStringList &files)
+{
+	if (files.isEmpty()) {
+		out << "Usage: --benchmark-decode FILE...\n";
+		return 1;
+	}
+	QList<QByteArray> encodedPaths;
+	foreach (const QString &file, files) {
+		encodedPaths.append(PathStore::encodeName(file));
+	}
+	const char *modes[] = { "fresh", "pooled", "pooled" };
+	for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		DecoderResources::Stats before = DecoderResources::stats();
+		int decoded = 0;
+		QTime time;
+		time.start();
+		foreach (const QByteArray &encodedPath, encodedPaths) {
+			if (i == 0) {
+				DecoderResources::freeLocal();
+			}
+			Decoder decoder(encodedPath.data());
+			decoder.SetTargetSampleRate(FINGERPRINT_SAMPLE_RATE);
+			if (!decoder.Open()) {
+				continue;
+			}
+			FingerprintCalculator calculator;
+			if (calculator.start(decoder.OutputSampleRate(), decoder.OutputChannels())) {
+				decoder.Decode(&calculator, AUDIO_LENGTH);
+				calculator.finish();
+				decoded++;
+			}
+		}
+		int elapsed = qMax(1, time.elapsed());
+		DecoderResources::Stats after = DecoderResources::stats();
+		out << "decode mode=" << modes[i]
+		    << " files=" << decoded << "/" << files.size()
+		    << " time=" << elapsed << "ms"
+		    << " frames=" << after.frames - before.frames
+		    << " io_buffers=" << after.ioBuffers - before.ioBuffers
+		    << " buffers=" << after.buffers - before.buffers << "\n";
+		out.flush();
+	}
+	return 0;
+}
+
+// Fingerprints the files with FFmpeg and with the in-tree WAV and FLAC
+// decoders. The fingerprints must be identical, any difference fails.
+static int benchmarkNative(const QStringList &files)
+{
+	if (files.isEmpty()) {
+		out << "Usage: --benchmark-native FILE...\n";
+		return 1;
+	}
+	int failures = 0, nativeFiles = 0;
+	int ffmpegTime = 0, nativeTime = 0;
+	foreach (const QString &file, files) {
+		QVector<quint32> reference, fingerprint;
+		bool usedNative = false;
+		QTime time;
+		time.start();
+		bool ok = calculateFingerprint(file, false, false, &reference);
+		int elapsed = time.restart();
+		ok = ok && calculateFingerprint(file, false, true, &fingerprint, &usedNative);
+		if (!ok) {
+			out << "skipped file=" << file << "\n";
+			continue;
+		}
+		if (!usedNative) {
+			out << "fallback file=" << file << "\n";
+			continue;
+		}
+		nativeFiles++;
+		ffmpegTime += elapsed;
+		nativeTime += time.elapsed();
+		bool identical = reference == fingerprint;
+		if (!identical) {
+			failures++;
+		}
+		out << "fingerprint file=" << file
+		    << " length=" << reference.size() << "/" << fingerprint.size()
+		    << (identical ? " identical" : " FAILED") << "\n";
+		out.flush();
+	}
+	out << "total files=" << nativeFiles << "/" << files.size()
+	    << " failed=" << failures
+	    << " time=" << ffmpegTime << "ms native=" << nativeTime << "ms\n";
+	return failures ? 1 : 0;
+}
+
+class AnalyzeWorker : public QThread
+{
+public:
+	AnalyzeWorker(const QList<quint32> &files, const AnalyzeOptions &options, QAtomicInt *next, QMutex *mutex, QList<AnalyzeResult *> *results)
+		: m_files(files), m_options(options), m_next(next), m_mutex(mutex), m_results(results)
+	{
+	}
+
+protected:
+	void run()
+	{
+		int i;
+		while ((i = m_next->fetchAndAddRelaxed(1)) < m_files.size()) {
+			AnalyzeResult *result = AnalyzeFileTask::analyze(m_files.at(i), m_options);
+			QMutexLocker locker(m_mutex);
+			m_results->append(result);
+		}
+	}
+
+private:
+	QList<quint32> m_files;
+	AnalyzeOptions m_options;
+	QAtomicInt *m_next;
+	QMutex *m_mutex;
+	QList<AnalyzeResult *> *m_results;
+};
+
+static void printStageStats(const char *name, const AnalysisPipeline::StageStats &stats)
+{
+	out << "stage name=" << name
+	    << " files=" << stats.files
+	    << " busy=" << stats.busy << "ms"
+	    << " input_wait=" << stats.inputWait << "ms/" << stats.inputStalls
+	    << " output_wait=" << stats.outputWait << "ms/" << stats.outputStalls << "\n";
+}
+
+static void printQueueStats(const char *name, const AnalysisPipeline::QueueStats &stats)
+{
+	out << "queue name=" << name
+	    << " capacity=" << stats.capacity
+	    << " occupancy=" << stats.occupancy
+	    << " max=" << stats.maxOccupancy << "\n";
+}
+
+// Analyzes the files with one task per file on as many threads as there
+// are cores, the way it used to work, and with the pipeline, starting with
+// a cold page cache both times. The fingerprints must be identical.
+static int benchmarkPipeline(const QStringList &paths)
+{
+	if (paths.isEmpty()) {
+		out << "Usage: --benchmark-pipeline FILE...\n";
+		return 1;
+	}
+	QList<quint32> files;
+	QList<QByteArray> encodedPaths;
+	foreach (const QString &path, paths) {
+		files.append(PathStore::instance()->addFile(path));
+		encodedPaths.append(PathStore::encodeName(path));
+	}
+	AnalyzeOptions options = AnalyzeOptions::fromSettings();
+
+	dropPageCache(encodedPaths);
+	QTime time;
+	time.start();
+	QAtomicInt next(0);
+	QMutex mutex;
+	QList<AnalyzeResult *> results;
+	QList<AnalyzeWorker *> workers;
+	int threadCount = QThread::idealThreadCount();
+	for (int i = 0; i < threadCount; i++) {
+		AnalyzeWorker *worker = new AnalyzeWorker(files, options, &next, &mutex, &results);
+		worker->start();
+		workers.append(worker);
+	}
+	foreach (AnalyzeWorker *worker, workers) {
+		worker->wait();
+		delete worker;
+	}
+	int elapsed = qMax(1, time.elapsed());
+	QHash<quint32, QVector<quint32> > fingerprints;
+	int fingerprinted = 0;
+	foreach (AnalyzeResult *result, results) {
+		if (!result->error) {
+			fingerprints.insert(result->file, result->fingerprint);
+			fingerprinted++;
+		}
+	}
+	qDeleteAll(results);
+	out << "analyze mode=tasks threads=" << threadCount
+	    << " files=" << fingerprinted << "/" << files.size()
+	    << " time=" << elapsed << "ms"
+	    << " throughput=" << files.size() * 1000.0 / elapsed << " files/s\n";
+	out.flush();
+
+	dropPageCache(encodedPaths);
+	time.start();
+	AnalysisPipeline pipeline(options);
+	int submitted = 0, finished = 0, mismatched = 0;
+	fingerprinted = 0;
+	while (finished < files.size()) {
+		while (submitted < files.size() && submitted - finished < pipeline.capacity()) {
+			pipeline.submit(files.at(submitted++));
+		}
+		foreach (AnalyzeResult *result, pipeline.waitForResults()) {
+			finished++;
+			if (!result->error) {
+				fingerprinted++;
+				if (fingerprints.value(result->file) != result->fingerprint) {
+					mismatched++;
+				}
+			}
+			delete result;
+		}
+	}
+	elapsed = qMax(1, time.elapsed());
+	AnalysisPipeline::Stats stats = pipeline.stats();
+	out << "analyze mode=pipeline lanes=" << stats.lanes
+	    << " files=" << fingerprinted << "/" << files.size()
+	    << " time=" << elapsed << "ms"
+	    << " throughput=" << files.size() * 1000.0 / elapsed << " files/s"
+	    << " input_allocations=" << stats.inputAllocations
+	    << " mismatched=" << mismatched << "\n";
+	printStageStats("prefetch", stats.prefetch);
+	printStageStats("decode", stats.decode);
+	printStageStats("fingerprint", stats.fingerprint);
+	printQueueStats("files", stats.files);
+	printQueueStats("prefetched", stats.prefetched);
+	printQueueStats("pcm", stats.pcm);
+	return mismatched ? 1 : 0;
+}
+
+// Analyzes the files one by one with the limits from the settings and
+// prints the slowest ones, with the reason if a limit stopped them.
+static int benchmarkLimits(const QStringList &paths)
+{
+	if (paths.isEmpty()) {
+		out << "Usage: --benchmark-limits FILE...\n";
+		return 1;
+	}
+	AnalyzeOptions options = AnalyzeOptions::fromSettings();
+	QList<QPair<int, QString> > times;
+	int limited = 0, failed = 0, total = 0;
+	foreach (const QString &path, paths) {
+		QTime time;
+		time.start();
+		AnalyzeResult *result = AnalyzeFileTask::analyze(PathStore::instance()->addFile(path), options);
+		int elapsed = time.elapsed();
+		total += elapsed;
+		QString status = "ok";
+		if (result->error) {
+			status = result->errorMessage;
+			if (status.startsWith("Gave up")) {
+				limited++;
+			}
+			else {
+				failed++;
+			}
+		}
+		times.append(qMakePair(elapsed, path + " " + status));
+		delete result;
+	}
+	qSort(times.begin(), times.end(), qGreater<QPair<int, QString> >());
+	for (int i = 0; i < qMin(10, times.size()); i++) {
+		out << "slowest time=" << times.at(i).first << "ms file=" << times.at(i).second << "\n";
+	}
+	out << "total files=" << paths.size()
+	    << " limited=" << limited
+	    << " failed=" << failed
+	    << " time=" << total << "ms"
+	    << " max=" << times.first().first << "ms"
+	    << " limits=" << options.maxBytes << "bytes/" << options.maxPackets << "packets/" << options.maxTime << "ms\n";
+	return 0;
+}
+
+class SampleBuffer : public AudioConsumer
+{
+public:
+	void feed(qint16 *data, int size)
+	{
+		int offset = samples.size();
+		samples.resize(offset + size);
+		memcpy(samples.data() + offset, data, size * sizeof(qint16));
+	}
+
+	QVector<qint16> samples;
+};
+
+// Fingerprints audio decoded into memory beforehand, once with a new
+// chromaprint context for each file, the way it used to work, and twice
+// reusing the thread's context. With short tracks most of the difference
+// is the cost of creating a context.
+static int benchmarkFingerprint(const QStringList &files)
+{
+	if (files.isEmpty()) {
+		out << "Usage: --benchmark-fingerprint FILE...\n";
+		return 1;
+	}
+	QList<SampleBuffer *> buffers;
+	QList<int> sampleRates, channels;
+	foreach (const QString &file, files) {
+		QByteArray encodedPath = PathStore::encodeName(file);
+		Decoder decoder(encodedPath.data());
+		if (!decoder.Open()) {
+			continue;
+		}
+		SampleBuffer *buffer = new SampleBuffer();
+		decoder.Decode(buffer, AUDIO_LENGTH);
+		buffers.append(buffer);
+		sampleRates.append(decoder.OutputSampleRate());
+		channels.append(decoder.OutputChannels());
+	}
+	const char *modes[] = { "fresh", "pooled", "pooled" };
+	for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		int before = FingerprintCalculator::contextCount();
+		QTime time;
+		time.start();
+		for (int j = 0; j < buffers.size(); j++) {
+			if (i == 0) {
+				FingerprintCalculator::freeLocal();
+			}
+			FingerprintCalculator calculator;
+			if (calculator.start(sampleRates.at(j), channels.at(j))) {
+				calculator.feed(buffers.at(j)->samples.data(), buffers.at(j)->samples.size());
+				calculator.finish();
+			}
+		}
+		int elapsed = qMax(1, time.elapsed());
+		out << "fingerprint mode=" << modes[i]
+		    << " files=" << buffers.size() << "/" << files.size()
+		    << " time=" << elapsed << "ms"
+		    << " per_file=" << double(elapsed) / qMax(1, buffers.size()) << "ms"
+		    << " contexts=" << FingerprintCalculator::contextCount() - before << "\n";
+		out.flush();
+	}
+	qDeleteAll(buffers);
+	return 0;
+}
+
+// Analyzes the files with a cold page cache and stores the results in a
+// scratch result cache, then reopens it and looks up every file, which is
+// what a second run does instead of decoding. The cached results must be
+// identical to the analyzed ones.
+static int benchmarkResultCache(const QStringList &paths)
+{
+	if (paths.isEmpty()) {
+		out << "Usage: --benchmark-resultcache FILE...\n";
+		return 1;
+	}
+	QString directory = QDir::tempPath() + "/fpsubmit-benchmark-results";
+	QDir dir(directory);
+	foreach (const QString &name, dir.entryList(QDir::Files)) {
+		dir.remove(name);
+	}
+	QList<quint32> files;
+	QList<QByteArray> encodedPaths;
+	foreach (const QString &path, paths) {
+		files.append(PathStore::instance()->addFile(path));
+		encodedPaths.append(PathStore::encodeName(path));
+	}
+	AnalyzeOptions options = AnalyzeOptions::fromSettings();
+
+	dropPageCache(encodedPaths);
+	QTime time;
+	time.start();
+	QList<AnalyzeResult *> results;
+	{
+		ResultCache cache(directory);
+		foreach (quint32 file, files) {
+			AnalyzeResult *result = AnalyzeFileTask::analyze(file, options);
+			cache.insert(result);
+			results.append(result);
+		}
+	}
+	int elapsed = qMax(1, time.elapsed());
+	out << "resultcache mode=analyze files=" << files.size()
+	    << " time=" << elapsed << "ms"
+	    << " per_file=" << double(elapsed) / files.size() << "ms\n";
+	out.flush();
+
+	dropPageCache(encodedPaths);
+	time.start();
+	int hits = 0, mismatched = 0;
+	{
+		ResultCache cache(directory);
+		for (int i = 0; i < results.size(); i++) {
+			AnalyzeResult *result = results.at(i);
+			AnalyzeResult *cached = cache.find(result->file, FileState::fromPath(paths.at(i)));
+			if (cached) {
+				hits++;
+				if (result->error || cached->fingerprint != result->fingerprint || cached->track != result->track ||
+				    cached->artist != result->artist || cached->album != result->album || cached->mbid != result->mbid ||
+				    cached->length != result->length || cached->bitrate != result->bitrate) {
+					mismatched++;
+				}
+				delete cached;
+			}
+		}
+	}
+	elapsed = qMax(1, time.elapsed());
+	int expected = 0;
+	foreach (AnalyzeResult *result, results) {
+		if (!result->error) {
+			expected++;
+		}
+	}
+	out << "resultcache mode=lookup files=" << files.size()
+	    << " hits=" << hits << "/" << expected
+	    << " time=" << elapsed << "ms"
+	    << " per_file=" << double(elapsed) / files.size() << "ms"
+	    << " mismatched=" << mismatched << "\n";
+	qDeleteAll(results);
+	return (mismatched || hits != expected) ? 1 : 0;
+}
+
+static quint32 syntheticItem(quint64 seed)
+{
+	quint64 x = seed * 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return quint32(x ^ (x >> 31));
+}
+
+// Measures the comparison kernels on their own, then groups either the
+// given files or a synthetic library where every tenth track is a copy of
+// an earlier one, shifted by a few items and with about 3% of the bits
+// flipped, which is what a transcode looks like.
+static int benchmarkDuplicates(const QStringList &args)
+{
+	// A number of tracks, by default a million, or files
+	bool synthetic;
+	int trackCount = args.value(0, "1000000").toInt(&synthetic);
+	int failures = 0;
+
+	const int pairCount = 4096;
+	const int iterations = 200;
+	QVector<quint32> a(pairCount * DUPLICATE_COMPARE_ITEMS), b(pairCount * DUPLICATE_COMPARE_ITEMS);
+	for (int i = 0; i < a.size(); i++) {
+		a[i] = syntheticItem(2 * i);
+		b[i] = syntheticItem(2 * i + 1);
+	}
+	qint64 reference = 0;
+	for (int i = 0; i < pairCount; i++) {
+		reference += DuplicateIndex::bitErrors(a.constData() + i * DUPLICATE_COMPARE_ITEMS, b.constData() + i * DUPLICATE_COMPARE_ITEMS, DUPLICATE_COMPARE_ITEMS, SampleConverter::Scalar);
+	}
+	for (int kernel = SampleConverter::Scalar; kernel <= SampleConverter::bestKernel(); kernel++) {
+		qint64 errors = 0;
+		QTime time;
+		time.start();
+		for (int j = 0; j < iterations; j++) {
+			for (int i = 0; i < pairCount; i++) {
+				errors += DuplicateIndex::bitErrors(a.constData() + i * DUPLICATE_COMPARE_ITEMS, b.constData() + i * DUPLICATE_COMPARE_ITEMS, DUPLICATE_COMPARE_ITEMS, SampleConverter::Kernel(kernel));
+			}
+		}
+		int elapsed = qMax(1, time.elapsed());
+		bool exact = errors == reference * iterations;
+		if (!exact) {
+			failures++;
+		}
+		out << "compare kernel=" << SampleConverter::kernelName(SampleConverter::Kernel(kernel))
+		    << " items=" << DUPLICATE_COMPARE_ITEMS
+		    << " throughput=" << qint64(pairCount) * iterations * 1000 / elapsed << " comparisons/s"
+		    << " exact=" << (exact ? "yes" : "NO") << "\n";
+		out.flush();
+	}
+
+	DuplicateIndex index;
+	QVector<int> expected;
+	QStringList paths;
+	QTime time;
+	time.start();
+	if (synthetic) {
+		srand(1);
+		QVector<int> lengths;
+		QVector<int> shifts;
+		QVector<int> sources;
+		for (int track = 0; track < trackCount; track++) {
+			int source = track, shift = 0;
+			if (track % 10 == 9) {
+				source = expected.at(rand() % track);
+				shift = rand() % 8;
+			}
+			QVector<quint32> fingerprint(DUPLICATE_COMPARE_ITEMS);
+			for (int i = 0; i < fingerprint.size(); i++) {
+				quint64 seed = (quint64(source) << 16 | quint64(i + shift)) * 7;
+				fingerprint[i] = syntheticItem(seed);
+				if (source != track) {
+					seed = (quint64(track) << 16 | quint64(i)) * 7;
+					fingerprint[i] ^= syntheticItem(seed + 1) & syntheticItem(seed + 2) & syntheticItem(seed + 3) &
+					                  syntheticItem(seed + 4) & syntheticItem(seed + 5);
+				}
+			}
+			int length = source == track ? 120 + track % 300 : 120 + source % 300 + rand() % 3;
+			index.add(fingerprint, length);
+			expected.append(source);
+		}
+	}
+	else {
+		AnalyzeOptions options = AnalyzeOptions::fromSettings();
+		foreach (const QString &path, args) {
+			AnalyzeResult *result = AnalyzeFileTask::analyze(PathStore::instance()->addFile(path), options);
+			if (!result->error) {
+				index.add(result->fingerprint, result->length);
+				paths.append(path);
+			}
+			delete result;
+		}
+	}
+	int elapsed = qMax(1, time.elapsed());
+	out << "index tracks=" << index.size()
+	    << " time=" << elapsed << "ms"
+	    << " memory=" << residentMemory() / (1024 * 1024) << "MB\n";
+	out.flush();
+
+	DuplicateIndex::Stats stats;
+	time.start();
+	QVector<int> groups = index.group(0, &stats);
+	elapsed = qMax(1, time.elapsed());
+	int groupCount = 0, wrong = 0;
+	for (int track = 0; track < groups.size(); track++) {
+		if (groups.at(track) == track) {
+			groupCount++;
+		}
+		if (synthetic && groups.at(track) != expected.at(track)) {
+			wrong++;
+		}
+	}
+	out << "group tracks=" << index.size()
+	    << " kernel=" << SampleConverter::kernelName(index.kernel())
+	    << " time=" << elapsed << "ms"
+	    << " queries=" << stats.queries * 1000 / elapsed << "/s"
+	    << " postings=" << stats.postings * 1000 / elapsed << "/s"
+	    << " comparisons=" << stats.comparisons << " (" << stats.comparisons * 1000 / elapsed << "/s)"
+	    << " pairs_covered=" << qint64(index.size()) * (index.size() - 1) / 2 * 1000 / elapsed << "/s"
+	    << " groups=" << groupCount;
+	if (synthetic) {
+		out << " wrong=" << wrong;
+		if (wrong) {
+			failures++;
+		}
+	}
+	out << "\n";
+	for (int track = 0; track < paths.size(); track++) {
+		if (groups.at(track) != track) {
+			out << "duplicate file=" << paths.at(track) << " of=" << paths.at(groups.at(track)) << "\n";
+		}
+	}
+	return failures ? 1 : 0;
+}
+
+// Twelve tracks per album, with the tags read afresh for every track, the
+// way the workers produce them.
+static AnalyzeResult *syntheticResult(int i, bool intern)
+{
+	int album = i / 12;
+	AnalyzeResult *result = new AnalyzeResult();
+	result->file = i;
+	result->track = QString("Track %1").arg(i % 12 + 1);
+	result->artist = QString("Artist %1").arg(album / 3);
+	result->album = QString("Album %1").arg(album);
+	result->albumArtist = QString("Artist %1").arg(album / 3);
+	if (intern) {
+		result->artist = ResultArena::intern(result->artist);
+		result->album = ResultArena::intern(result->album);
+		result->albumArtist = ResultArena::intern(result->albumArtist);
+	}
+	result->trackNo = i % 12 + 1;
+	result->length = 120 + i % 300;
+	result->fingerprint.resize(950);
+	for (int j = 0; j < result->fingerprint.size(); j++) {
+		result->fingerprint[j] = syntheticItem(quint64(i) << 16 | j);
+	}
+	return result;
+}
+
+// Fills the submit queue with a backlog of synthetic results and then
+// submits it batch by batch. Compares results allocated one by one on the
+// heap with the arena and interned tags. Then does the same with some
+// failed files and a cancel in the middle, the way the fingerprinter
+// handles them, which must not leave any block behind either.
+static int benchmarkBacklog(const QStringList &args)
+{
+	QString mode = args.value(0);
+	if (mode != "heap" && mode != "arena") {
+		out << "Usage: --benchmark-backlog heap|arena [RESULTS]\n";
+		return 1;
+	}
+	bool arena = mode == "arena";
+	int count = args.value(1, QString::number(MAX_QUEUED_FILES)).toInt();
+	ResultArena::instance()->setEnabled(arena);
+	ResultArena::Stats before = ResultArena::instance()->stats();
+
+	qint64 memory = residentMemory();
+	QTime time;
+	time.start();
+	QList<AnalyzeResult *> queue;
+	for (int i = 0; i < count; i++) {
+		queue.append(syntheticResult(i, arena));
+	}
+	int elapsed = qMax(1, time.elapsed());
+	qint64 queued = residentMemory() - memory;
+
+	QSet<const void *> strings;
+	foreach (AnalyzeResult *result, queue) {
+		strings.insert(result->artist.constData());
+		strings.insert(result->album.constData());
+		strings.insert(result->albumArtist.constData());
+	}
+	ResultArena::Stats stats = ResultArena::instance()->stats();
+	qint64 records = stats.records - before.records;
+	// Without the arena every record is an allocation of its own
+	qint64 allocations = arena ? stats.blocks - before.blocks : records;
+	out << "backlog mode=" << mode
+	    << " results=" << count
+	    << " time=" << elapsed << "ms"
+	    << " record_allocations=" << allocations
+	    << " tag_strings=" << strings.size()
+	    << " queue_memory=" << queued / (1024 * 1024) << "MB"
+	    << " per_result=" << queued / qMax(1, count) << "B\n";
+	out.flush();
+
+	time.start();
+	int batches = 0;
+	while (!queue.isEmpty()) {
+		QList<AnalyzeResult *> batch;
+		while (!queue.isEmpty() && batch.size() < MAX_BATCH_SIZE) {
+			batch.append(queue.takeFirst());
+		}
+		qDeleteAll(batch);
+		batches++;
+	}
+	elapsed = qMax(1, time.elapsed());
+	stats = ResultArena::instance()->stats();
+	out << "submit mode=" << mode
+	    << " batches=" << batches
+	    << " time=" << elapsed << "ms"
+	    << " live_records=" << stats.liveRecords
+	    << " live_blocks=" << stats.liveBlocks
+	    << " memory_after=" << (residentMemory() - memory) / (1024 * 1024) << "MB\n";
+	out.flush();
+	int failures = (stats.liveRecords || stats.liveBlocks) ? 1 : 0;
+
+	// Every seventh file fails and is dropped right away, the rest is
+	// queued and submitted until the run is cancelled half way through,
+	// after which the results still coming in are dropped as well
+	bool cancelled = false;
+	int failed = 0, dropped = 0;
+	for (int i = 0; i < count; i++) {
+		AnalyzeResult *result = syntheticResult(i, arena);
+		if (i % 7 == 3) {
+			result->error = true;
+		}
+		if (result->error) {
+			failed++;
+			delete result;
+		}
+		else if (cancelled) {
+			dropped++;
+			delete result;
+		}
+		else {
+			queue.append(result);
+		}
+		if (queue.size() == MAX_BATCH_SIZE) {
+			qDeleteAll(queue);
+			queue.clear();
+		}
+		if (i == count / 2) {
+			cancelled = true;
+			dropped += queue.size();
+			qDeleteAll(queue);
+			queue.clear();
+		}
+	}
+	stats = ResultArena::instance()->stats();
+	out << "cancel mode=" << mode
+	    << " failed=" << failed
+	    << " dropped=" << dropped
+	    << " live_records=" << stats.liveRecords
+	    << " live_blocks=" << stats.liveBlocks << "\n";
+	if (stats.liveRecords || stats.liveBlocks) {
+		failures++;
+	}
+	return failures ? 1 : 0;
+}
+
+bool isBenchmarkCommand(int argc, char **argv)
+{
+	return argc > 1 && QString(argv[1]).startsWith("--benchmark-");
+}
+
+int runBenchmark(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	app.setOrganizationName("Acoustid");
+	app.setOrganizationDomain("acoustid.org");
+	app.setApplicationName("Fingerprinter");
+	QStringList args = app.arguments();
+	QString command = args.value(1);
+	args = args.mid(2);
+	if (command == "--benchmark-scan") {
+		return benchmarkScan(args);
+	}
+	if (command == "--benchmark-paths") {
+		return benchmarkPaths(args);
+	}
+	if (command == "--benchmark-order") {
+		return benchmarkOrder(args);
+	}
+	if (command == "--benchmark-convert") {
+		return benchmarkConvert();
+	}
+	if (command == "--benchmark-open") {
+		return benchmarkOpen(args);
+	}
+	if (command == "--benchmark-probe") {
+		return benchmarkProbe(args);
+	}
+	if (command == "--benchmark-decode") {
+		return benchmarkDecode(args);
+	}
+	if (command == "--benchmark-native") {
+		return benchmarkNative(args);
+	}
+	if (command == "--benchmark-pipeline") {
+		return benchmarkPipeline(args);
+	}
+	if (command == "--benchmark-fingerprint") {
+		return benchmarkFingerprint(args);
+	}
+	if (command == "--benchmark-resultcache") {
+		return benchmarkResultCache(args);
+	}
+	if (command == "--benchmark-duplicates") {
+		return benchmarkDuplicates(args);
+	}
+	if (command == "--benchmark-backlog") {
+		return benchmarkBacklog(args);
+	}
+	if (command == "--benchmark-limits") {
+		return benchmarkLimits(args);
+	}
+	if (command == "--benchmark-downsample") {
+		return benchmarkDownsample(args);
+	}
+	out << "Unknown benchmark " << command << "\n";
+	return 1;
+}
@@ -0,0 +1,11 @@
+#ifndef FPSUBMIT_BENCHMARK_H_
+#define FPSUBMIT_BENCHMARK_H_
+
+#include <QStringList>
+
+// Command line entry point for the performance benchmarks, used as
+// "acoustid-fingerprinter --benchmark-<name> [arguments...]".
+bool isBenchmarkCommand(int argc, char **argv);
+int runBenchmark(int argc, char **argv);
+
+#endif
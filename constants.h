@@ -6,9 +6,44 @@ static const char *SUBMIT_URL = "http://api.acoustid.org/v2/submit";
 //static const char *SUBMIT_URL = "http://127.0.0.1:8080/ws/submit";
 static const char *CLIENT_API_KEY = "cvJ31mD0"; 
 static const int AUDIO_LENGTH = 120;
+static const int FINGERPRINT_SAMPLE_RATE = 11025;
 static const int MAX_ACTIVE_FILES = 3;
+static const int MAX_ACTIVE_FILES_ROTATIONAL = 2;
+static const int MAX_ACTIVE_FILES_SOLID_STATE = 4;
+static const int MAX_ACTIVE_FILES_NETWORK = 2;
+static const int MAX_SCAN_THREADS = 8;
+static const int INPUT_BLOCK_SIZE = 256 * 1024;
+static const int INPUT_READAHEAD_SIZE = 8 * 1024 * 1024;
+static const int FAST_PROBE_SIZE = 32 * 1024;
+static const int FAST_ANALYZE_DURATION = 500000;
+static const int MAX_DECODE_BYTES = 256 * 1024 * 1024;
+static const int MAX_DECODE_PACKETS = 100000;
+static const int MAX_DECODE_TIME = 60000;
+static const int MAX_QUEUED_FILES = 50000;
+static const int PIPELINE_LANE_FILES = 4;
+static const int PIPELINE_PREFETCH_DEPTH = 2;
+static const int PIPELINE_PCM_BLOCKS = 16;
+static const int PIPELINE_PCM_BLOCK_SIZE = 16 * 1024;
+
+static const int WATCH_DEBOUNCE_TIME = 2000;
+static const int WATCH_RESCAN_INTERVAL = 15 * 60 * 1000;
+
+static const int LOG_SYNC_INTERVAL = 5000;
+
+static const int RESULT_CACHE_SEGMENT_SIZE = 64 * 1024 * 1024;
+
+static const int DUPLICATE_INDEX_ITEMS = 64;
+static const int DUPLICATE_COMPARE_ITEMS = 128;
+static const int DUPLICATE_MIN_HITS = 3;
+static const int DUPLICATE_MIN_OVERLAP = 64;
+static const int DUPLICATE_MAX_POSTINGS = 1024;
+static const int DUPLICATE_MAX_LENGTH_DIFFERENCE = 7;
+static const double DUPLICATE_MAX_BIT_ERROR_RATE = 0.15;
 
 static const int MAX_BATCH_SIZE = 100;
 static const int MIN_BATCH_SIZE = 50;
 
+static const int RESULT_ARENA_BLOCK_SIZE = MAX_BATCH_SIZE;
+static const int RESULT_STRING_POOL_SIZE = 16;
+
 #endif
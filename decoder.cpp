@@ -1,3 +1,47 @@
+#include <QMutex>
 #include "decoder.h"
 
-QMutex Decoder::m_mutex;
+QAtomicInt Decoder::s_native_opens;
+QAtomicInt Decoder::s_fast_probes;
+QAtomicInt Decoder::s_fallback_probes;
+QAtomicInt Decoder::s_full_probes;
+
+// FFmpeg serializes the few calls that are not thread-safe, like opening
+// codecs, through the registered lock manager. Everything else, including
+// opening and probing the files, can run in parallel.
+static int lockManager(void **mutex, enum AVLockOp op)
+{
+	switch (op) {
+	case AV_LOCK_CREATE:
+		*mutex = new QMutex();
+		return 0;
+	case AV_LOCK_OBTAIN:
+		static_cast<QMutex *>(*mutex)->lock();
+		return 0;
+	case AV_LOCK_RELEASE:
+		static_cast<QMutex *>(*mutex)->unlock();
+		return 0;
+	case AV_LOCK_DESTROY:
+		delete static_cast<QMutex *>(*mutex);
+		*mutex = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void Decoder::initialize()
+{
+	av_register_all();
+	av_log_set_level(AV_LOG_ERROR);
+	av_lockmgr_register(&lockManager);
+}
+
+Decoder::ProbeStats Decoder::GetProbeStats()
+{
+	ProbeStats stats;
+	stats.native = s_native_opens;
+	stats.fast = s_fast_probes;
+	stats.fallback = s_fallback_probes;
+	stats.full = s_full_probes;
+	return stats;
+}
@@ -21,10 +21,14 @@
 #ifndef FPSUBMIT_DECODER_H_
 #define FPSUBMIT_DECODER_H_
 
-#include <QMutex>
 #include <string>
 #include <algorithm>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <QAtomicInt>
+#include <QTime>
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -33,13 +37,11 @@ extern "C" {
 #if NEW_AVFRAME_API
 #include <libavutil/frame.h>
 #endif
-
-#ifdef HAVE_AV_AUDIO_CONVERT
-#include "ffmpeg/audioconvert.h"
-#include "ffmpeg/samplefmt.h"
-#endif
 }
+#include "audioconsumer.h"
 #include "fingerprintcalculator.h"
+#include "decoderresources.h"
+#include "constants.h"
 
 class Decoder
 {
@@ -47,135 +49,326 @@ public:
 	Decoder(const std::string &fileName);
 	~Decoder();
 
+	// Number of bytes from the start of the file we expect to read.
+	void SetReadahead(int64_t length)
+	{
+		m_readahead = length;
+	}
+
+	// Reads from a file that was already opened by the caller, instead of
+	// opening it again. The file is left open.
+	void SetInput(InputFile *input)
+	{
+		m_input = input;
+	}
+
+	// The file the decoder reads from, it can be used to read other things
+	// like the tags before the file is probed by Open().
+	InputFile *Input()
+	{
+		return m_input;
+	}
+
+	// Mixes the audio down to mono and resamples it to the given rate
+	// before passing it to the consumer.
+	void SetTargetSampleRate(int rate)
+	{
+		m_target_sample_rate = rate;
+	}
+
+	// Probes the file with a small budget and the format guessed from its
+	// first bytes or its extension, and only probes it fully if that
+	// doesn't turn up a usable audio stream. Enabled by default.
+	void SetFastProbe(bool enabled)
+	{
+		m_fast_probe = enabled;
+	}
+
+	// Decodes PCM WAV and FLAC files with the in-tree decoders instead of
+	// FFmpeg, if they support everything in the file. Enabled by default.
+	void SetNativeDecoding(bool enabled)
+	{
+		m_native_decoding = enabled;
+	}
+
+	// Work allowed on a single file, so that a corrupt or huge file can't
+	// keep a thread busy for minutes. Zero means no limit.
+	struct Limits
+	{
+		Limits() : bytes(0), packets(0), time(0) {}
+
+		// Bytes read from the file, including the ones read before Open()
+		int64_t bytes;
+		// Packets read by the demuxer or blocks decoded by the in-tree decoders
+		int packets;
+		// Milliseconds since Open() was called
+		int time;
+	};
+
+	enum Limit
+	{
+		NoLimit,
+		BytesLimit,
+		PacketsLimit,
+		TimeLimit
+	};
+
+	// Checked while probing and decoding, reaching one of the limits makes
+	// Open() fail or Decode() stop early. LastError() describes the limit.
+	void SetLimits(const Limits &limits)
+	{
+		m_limits = limits;
+	}
+
+	// The limit that made the decoder give up on the file, if any.
+	Limit LimitReached() const
+	{
+		return m_limit_reached;
+	}
+
+	// Whether the file is decoded by one of the in-tree decoders.
+	bool IsNative() const
+	{
+		return m_native != 0;
+	}
+
+	// How often each way of opening files was used, by all decoders.
+	struct ProbeStats
+	{
+		ProbeStats() : native(0), fast(0), fallback(0), full(0) {}
+
+		// Decoded without FFmpeg
+		int native;
+		// Fast probe succeeded
+		int fast;
+		// Fast probe failed and the file was probed again
+		int fallback;
+		// Fast probe disabled
+		int full;
+	};
+
+	static ProbeStats GetProbeStats();
+
+	// Opens the file if it's not open yet.
+	bool OpenInput();
 	bool Open();
-	void Decode(FingerprintCalculator *consumer, int maxLength = 0);
+	void Decode(AudioConsumer *consumer, int maxLength = 0);
+
+	const InputFile::Stats &IoStats() const
+	{
+		return m_input->stats();
+	}
 
 	int Channels()
 	{
-		return m_codec_ctx->channels;
+		return m_native ? m_native->channels() : m_codec_ctx->channels;
 	}
 
 	int SampleRate()
 	{
-		return m_codec_ctx->sample_rate;
+		return m_native ? m_native->sampleRate() : m_codec_ctx->sample_rate;
+	}
+
+	// Format of the audio passed to the consumer.
+	int OutputChannels()
+	{
+		return m_target_sample_rate ? 1 : Channels();
+	}
+
+	int OutputSampleRate()
+	{
+		return m_target_sample_rate ? m_downsampler.outputSampleRate() : SampleRate();
 	}
 
 	std::string LastError()
 	{
-		return m_error;
+		return m_limit_reached != NoLimit ? m_limit_error : m_error;
 	}
 
-    //static void lock_manager();
-    static void initialize();
+	// Sets up FFmpeg, must be called before any decoder is used.
+	static void initialize();
 
 private:
-	uint8_t *m_buffer2;
+	static int ReadPacket(void *opaque, uint8_t *buf, int size);
+	static int64_t Seek(void *opaque, int64_t offset, int whence);
+	static int Interrupt(void *opaque);
+	bool CheckLimits();
+	bool SetupConverter();
+	bool OpenNative();
+	void DecodeNative(AudioConsumer *consumer, int max_length);
+	bool OpenFormat(AVInputFormat *format, bool fast);
+	void CloseFormat();
+	AVInputFormat *GuessFormat();
+
 	std::string m_file_name;
 	std::string m_error;
+	// Frame and buffers reused from the previous file on this thread
+	DecoderResources *m_resources;
+	InputFile *m_input;
+	int64_t m_readahead;
+	bool m_fast_probe;
+	bool m_native_decoding;
+	NativeDecoder *m_native;
+	AVIOContext *m_avio_ctx;
 	AVFormatContext *m_format_ctx;
 	AVCodecContext *m_codec_ctx;
 	bool m_codec_open;
 	AVStream *m_stream;
-    static QMutex m_mutex;
-    AVFrame *m_frame;
-#ifdef HAVE_AV_AUDIO_CONVERT
-	AVAudioConvert *m_convert_ctx;
-#endif
+	AVFrame *m_frame;
+	SampleConverter &m_converter;
+	int m_target_sample_rate;
+	Downsampler &m_downsampler;
+	Limits m_limits;
+	Limit m_limit_reached;
+	std::string m_limit_error;
+	int m_packets;
+	QTime m_timer;
+
+	static QAtomicInt s_native_opens;
+	static QAtomicInt s_fast_probes;
+	static QAtomicInt s_fallback_probes;
+	static QAtomicInt s_full_probes;
 };
 
-/*inline static void Decoder::lock_manager(void **mutex, enum AVLockOp op)
-{
-    switch (op) {
-    case AV_LOCK_CREATE:
-        *mutex = new QMutex();
-        return 1;
-    case AV_LOCK_DESTROY:
-        delete (QMutex *)(*mutex);
-        return 1;
-    case AV_LOCK_ACQUIRE:
-        ((QMutex *)(*mutex))->lock();
-        return 1;
-    case AV_LOCK_RELEASE:
-        ((QMutex *)(*mutex))->unlock();
-        return 1;
-    }
-    return 0;
-}*/
-
-inline void Decoder::initialize()
-{
-	av_register_all();
-	av_log_set_level(AV_LOG_ERROR);
-    //av_lockmgr_register(&Decoder::lock_manager)
-}
-
 inline Decoder::Decoder(const std::string &file_name)
-	: m_file_name(file_name), m_format_ctx(0), m_codec_ctx(0), m_stream(0), m_codec_open(false)
-#ifdef HAVE_AV_AUDIO_CONVERT
-	, m_convert_ctx(0)
-#endif
+	: m_file_name(file_name), m_resources(DecoderResources::acquire()), m_input(&m_resources->input()),
+	  m_readahead(0), m_fast_probe(true), m_native_decoding(true), m_native(0), m_avio_ctx(0), m_format_ctx(0), m_codec_ctx(0), m_codec_open(false), m_stream(0),
+	  m_frame(m_resources->frame()), m_converter(m_resources->converter()), m_target_sample_rate(0),
+	  m_downsampler(m_resources->downsampler()), m_limit_reached(NoLimit), m_packets(0)
 {
-#ifdef HAVE_AV_AUDIO_CONVERT
-	m_buffer2 = (uint8_t *)av_malloc(192000 * 2 + 16);
-#endif
-
-#if NEW_AVFRAME_API
-    m_frame = av_frame_alloc();
-#else
-    m_frame = avcodec_alloc_frame();
-#endif
 }
 
 inline Decoder::~Decoder()
 {
+	m_resources->resetFrame();
 	if (m_codec_ctx && m_codec_open) {
-        QMutexLocker locker(&m_mutex); 
 		avcodec_close(m_codec_ctx);
 	}
+	CloseFormat();
+	DecoderResources::release(m_resources);
+}
+
+inline void Decoder::CloseFormat()
+{
 	if (m_format_ctx) {
 		avformat_close_input(&m_format_ctx);
 	}
-#ifdef HAVE_AV_AUDIO_CONVERT
-	if (m_convert_ctx) {
-		av_audio_convert_free(m_convert_ctx);
+	if (m_avio_ctx) {
+		m_resources->returnIOBuffer(m_avio_ctx->buffer, m_avio_ctx->buffer_size);
+		m_avio_ctx->buffer = 0;
+		av_freep(&m_avio_ctx);
 	}
-	av_free(m_buffer2);
-#endif
+	m_stream = 0;
+	m_codec_ctx = 0;
+}
 
-#if NEW_AVFRAME_API
-    av_frame_free(&m_frame);
-#else
-    av_freep(&m_frame);
-#endif
+inline int Decoder::ReadPacket(void *opaque, uint8_t *buf, int size)
+{
+	Decoder *decoder = static_cast<Decoder *>(opaque);
+	if (decoder->CheckLimits()) {
+		return AVERROR_EXIT;
+	}
+	InputFile *input = decoder->m_input;
+	int64_t result = input->read(reinterpret_cast<char *>(buf), size);
+	if (result < 0) {
+		return AVERROR(EIO);
+	}
+	return result == 0 ? AVERROR_EOF : int(result);
 }
 
-inline bool Decoder::Open()
+inline int64_t Decoder::Seek(void *opaque, int64_t offset, int whence)
 {
-    QMutexLocker locker(&m_mutex); 
+	InputFile *input = static_cast<Decoder *>(opaque)->m_input;
+	whence &= ~AVSEEK_FORCE;
+	switch (whence) {
+	case AVSEEK_SIZE:
+		return input->size();
+	case SEEK_CUR:
+		offset += input->position();
+		break;
+	case SEEK_END:
+		offset += input->size();
+		break;
+	case SEEK_SET:
+		break;
+	default:
+		return -1;
+	}
+	return input->seek(offset) ? offset : -1;
+}
 
-	if (avformat_open_input(&m_format_ctx, m_file_name.c_str(), NULL, NULL) != 0) {
+inline int Decoder::Interrupt(void *opaque)
+{
+	return static_cast<Decoder *>(opaque)->CheckLimits() ? 1 : 0;
+}
+
+inline bool Decoder::CheckLimits()
+{
+	if (m_limit_reached != NoLimit) {
+		return true;
+	}
+	char message[128];
+	if (m_limits.bytes > 0 && m_input->stats().bytesRead >= m_limits.bytes) {
+		m_limit_reached = BytesLimit;
+		snprintf(message, sizeof(message), "Read the maximum of %lld bytes.", (long long)m_limits.bytes);
+	}
+	else if (m_limits.packets > 0 && m_packets >= m_limits.packets) {
+		m_limit_reached = PacketsLimit;
+		snprintf(message, sizeof(message), "Read the maximum of %d packets.", m_limits.packets);
+	}
+	else if (m_limits.time > 0 && m_timer.elapsed() >= m_limits.time) {
+		m_limit_reached = TimeLimit;
+		snprintf(message, sizeof(message), "Took longer than the maximum of %d ms.", m_limits.time);
+	}
+	else {
+		return false;
+	}
+	m_limit_error = message;
+	return true;
+}
+
+inline bool Decoder::OpenInput()
+{
+	// Read through our own I/O layer instead of FFmpeg's file protocol,
+	// which reads the file in tiny pieces
+	if (!m_input->isOpen() && !m_input->open(m_file_name.c_str())) {
 		m_error = "Couldn't open the file." + m_file_name;
 		return false;
 	}
+	return true;
+}
 
-	if (avformat_find_stream_info(m_format_ctx, NULL) < 0) {
-		m_error = "Couldn't find stream information in the file.";
+inline bool Decoder::Open()
+{
+	m_timer.start();
+	if (!OpenInput() || !m_input->seek(0)) {
 		return false;
 	}
+	m_input->setReadahead(m_readahead > 0 ? m_readahead : m_input->size());
 
-	//dump_format(m_format_ctx, 0, m_file_name.c_str(), 0);
+	if (m_native_decoding && OpenNative()) {
+		s_native_opens.ref();
+		if (m_target_sample_rate) {
+			m_downsampler.setup(SampleRate(), Channels(), m_target_sample_rate);
+		}
+		return true;
+	}
 
-	for (int i = 0; i < m_format_ctx->nb_streams; i++) {
-		AVCodecContext *avctx = m_format_ctx->streams[i]->codec;
-                if (avctx && avctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-			m_stream = m_format_ctx->streams[i];
-			m_codec_ctx = avctx;
-			break;
+	if (!m_fast_probe) {
+		s_full_probes.ref();
+		if (!OpenFormat(NULL, false)) {
+			return false;
 		}
 	}
-	if (!m_codec_ctx) {
-		m_error = "Couldn't find any audio stream in the file.";
-		return false;
+	else if (OpenFormat(GuessFormat(), true)) {
+		s_fast_probes.ref();
+	}
+	else {
+		s_fallback_probes.ref();
+		CloseFormat();
+		if (!m_input->seek(0) || !OpenFormat(NULL, false)) {
+			return false;
+		}
 	}
 
 	AVCodec *codec = avcodec_find_decoder(m_codec_ctx->codec_id);
@@ -190,22 +383,13 @@ inline bool Decoder::Open()
     }
 	m_codec_open = true;
 
-	if (m_codec_ctx->sample_fmt != AV_SAMPLE_FMT_S16) {
-#ifdef HAVE_AV_AUDIO_CONVERT
-		m_convert_ctx = av_audio_convert_alloc(AV_SAMPLE_FMT_S16, m_codec_ctx->channels,
-		                                       (AVSampleFormat)m_codec_ctx->sample_fmt, m_codec_ctx->channels, NULL, 0);
-		if (!m_convert_ctx) {
-			m_error = "Couldn't create sample format converter.";
-			return false;
-		}
-#else
-		m_error = "Unsupported sample format.";
+	if (Channels() <= 0) {
+		m_error = "Invalid audio stream (no channels).";
 		return false;
-#endif
 	}
 
-	if (Channels() <= 0) {
-		m_error = "Invalid audio stream (no channels).";
+	if (!SetupConverter()) {
+		m_error = "Unsupported sample format.";
 		return false;
 	}
 
@@ -214,13 +398,254 @@ inline bool Decoder::Open()
 		return false;
 	}
 
+	if (m_target_sample_rate) {
+		m_downsampler.setup(SampleRate(), Channels(), m_target_sample_rate);
+	}
+
 	return true;
 }
 
-#include <stdio.h>
+inline bool Decoder::OpenNative()
+{
+	// Each decoder checks the signature of the file first, so trying them
+	// costs next to nothing for other formats
+	if (m_resources->wavDecoder().open(m_input)) {
+		m_native = &m_resources->wavDecoder();
+	}
+	else if (m_resources->flacDecoder().open(m_input)) {
+		m_native = &m_resources->flacDecoder();
+	}
+	else {
+		m_input->seek(0);
+		return false;
+	}
+	return true;
+}
+
+inline AVInputFormat *Decoder::GuessFormat()
+{
+	// The magic bytes are more reliable than the extension, but files with
+	// junk at the start have to be recognized by the extension
+	unsigned char header[16];
+	memset(header, 0, sizeof(header));
+	int64_t size = m_input->read(reinterpret_cast<char *>(header), sizeof(header));
+	m_input->seek(0);
+	const char *name = NULL;
+	if (size >= 12) {
+		if (!memcmp(header, "fLaC", 4)) {
+			name = "flac";
+		}
+		else if (!memcmp(header, "OggS", 4)) {
+			name = "ogg";
+		}
+		else if (!memcmp(header, "RIFF", 4) && !memcmp(header + 8, "WAVE", 4)) {
+			name = "wav";
+		}
+		else if (!memcmp(header + 4, "ftyp", 4)) {
+			name = "mov";
+		}
+		else if (!memcmp(header, "\x1a\x45\xdf\xa3", 4)) {
+			name = "matroska";
+		}
+		else if (!memcmp(header, "\x30\x26\xb2\x75", 4)) {
+			name = "asf";
+		}
+		else if (!memcmp(header, "MAC ", 4)) {
+			name = "ape";
+		}
+		else if (!memcmp(header, "TTA1", 4)) {
+			name = "tta";
+		}
+		else if (!memcmp(header, "wvpk", 4)) {
+			name = "wv";
+		}
+		else if (!memcmp(header, "MPCK", 4)) {
+			name = "mpc8";
+		}
+		else if (!memcmp(header, "MP+", 3)) {
+			name = "mpc";
+		}
+		else if (!memcmp(header, "ID3", 3) || (header[0] == 0xff && (header[1] & 0xe0) == 0xe0)) {
+			name = "mp3";
+		}
+	}
+	if (!name) {
+		static const char *extensions[][2] = {
+			{ "mp3", "mp3" },
+			{ "flac", "flac" },
+			{ "ogg", "ogg" },
+			{ "oga", "ogg" },
+			{ "oggflac", "ogg" },
+			{ "mp4", "mov" },
+			{ "m4a", "mov" },
+			{ "wma", "asf" },
+			{ "wav", "wav" },
+			{ "ape", "ape" },
+			{ "tta", "tta" },
+			{ "wv", "wv" },
+			{ "mpc", "mpc" }
+		};
+		std::string::size_type pos = m_file_name.rfind('.');
+		if (pos != std::string::npos) {
+			std::string extension = m_file_name.substr(pos + 1);
+			std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+			for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+				if (extension == extensions[i][0]) {
+					name = extensions[i][1];
+					break;
+				}
+			}
+		}
+	}
+	return name ? av_find_input_format(name) : NULL;
+}
+
+inline bool Decoder::OpenFormat(AVInputFormat *format, bool fast)
+{
+	uint8_t *buffer = m_resources->takeIOBuffer();
+	if (buffer) {
+		m_avio_ctx = avio_alloc_context(buffer, DecoderResources::IO_BUFFER_SIZE, 0, this, &Decoder::ReadPacket, NULL, &Decoder::Seek);
+	}
+	if (!m_avio_ctx) {
+		m_resources->returnIOBuffer(buffer, DecoderResources::IO_BUFFER_SIZE);
+		m_error = "Couldn't allocate I/O context.";
+		return false;
+	}
+	m_format_ctx = avformat_alloc_context();
+	if (!m_format_ctx) {
+		m_error = "Couldn't allocate format context.";
+		return false;
+	}
+	m_format_ctx->pb = m_avio_ctx;
+	m_format_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+	// Stops probing that takes too long without reading anything
+	m_format_ctx->interrupt_callback.callback = &Decoder::Interrupt;
+	m_format_ctx->interrupt_callback.opaque = this;
+
+	AVDictionary *options = NULL;
+	if (fast) {
+		char value[32];
+		snprintf(value, sizeof(value), "%d", FAST_PROBE_SIZE);
+		av_dict_set(&options, "probesize", value, 0);
+		snprintf(value, sizeof(value), "%d", FAST_ANALYZE_DURATION);
+		av_dict_set(&options, "analyzeduration", value, 0);
+	}
+
+	// Without a format, the file name is still used to guess it from the extension
+	int result = avformat_open_input(&m_format_ctx, m_file_name.c_str(), format, &options);
+	av_dict_free(&options);
+	if (result != 0) {
+		m_error = "Couldn't open the file." + m_file_name;
+		return false;
+	}
+
+	if (avformat_find_stream_info(m_format_ctx, NULL) < 0) {
+		m_error = "Couldn't find stream information in the file.";
+		return false;
+	}
 
-inline void Decoder::Decode(FingerprintCalculator *consumer, int max_length)
+	//dump_format(m_format_ctx, 0, m_file_name.c_str(), 0);
+
+	for (int i = 0; i < m_format_ctx->nb_streams; i++) {
+		AVCodecContext *avctx = m_format_ctx->streams[i]->codec;
+                if (avctx && avctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+			m_stream = m_format_ctx->streams[i];
+			m_codec_ctx = avctx;
+			break;
+		}
+	}
+	if (!m_codec_ctx) {
+		m_error = "Couldn't find any audio stream in the file.";
+		return false;
+	}
+
+	// A short analysis can leave the stream parameters incomplete, it's
+	// cheaper to probe again than to fail later
+	if (fast && (!avcodec_find_decoder(m_codec_ctx->codec_id) || m_codec_ctx->channels <= 0 || m_codec_ctx->sample_rate <= 0)) {
+		m_error = "Incomplete stream information.";
+		return false;
+	}
+
+	return true;
+}
+
+inline bool Decoder::SetupConverter()
 {
+	SampleConverter::Format format;
+	bool planar = false;
+	switch (m_codec_ctx->sample_fmt) {
+	case AV_SAMPLE_FMT_U8P:
+		planar = true;
+		// fall through
+	case AV_SAMPLE_FMT_U8:
+		format = SampleConverter::U8;
+		break;
+	case AV_SAMPLE_FMT_S16P:
+		planar = true;
+		// fall through
+	case AV_SAMPLE_FMT_S16:
+		format = SampleConverter::S16;
+		break;
+	case AV_SAMPLE_FMT_S32P:
+		planar = true;
+		// fall through
+	case AV_SAMPLE_FMT_S32:
+		format = SampleConverter::S32;
+		break;
+	case AV_SAMPLE_FMT_FLTP:
+		planar = true;
+		// fall through
+	case AV_SAMPLE_FMT_FLT:
+		format = SampleConverter::Float;
+		break;
+	case AV_SAMPLE_FMT_DBLP:
+		planar = true;
+		// fall through
+	case AV_SAMPLE_FMT_DBL:
+		format = SampleConverter::Double;
+		break;
+	default:
+		return false;
+	}
+	return m_converter.setFormat(format, planar, Channels());
+}
+
+inline void Decoder::DecodeNative(AudioConsumer *consumer, int max_length)
+{
+	int remaining = max_length * SampleRate() * Channels();
+	const int16_t *samples;
+	int frames;
+	while (!CheckLimits() && (frames = m_native->decode(&samples)) > 0) {
+		m_packets++;
+		int length = frames * Channels();
+		if (max_length) {
+			length = std::min(remaining, length);
+		}
+
+		if (m_target_sample_rate) {
+			int count = m_downsampler.process(samples, length / Channels());
+			consumer->feed(const_cast<int16_t *>(m_downsampler.output()), count);
+		}
+		else {
+			consumer->feed(const_cast<int16_t *>(samples), length);
+		}
+
+		if (max_length) {
+			remaining -= length;
+			if (remaining <= 0) {
+				break;
+			}
+		}
+	}
+}
+
+inline void Decoder::Decode(AudioConsumer *consumer, int max_length)
+{
+	if (m_native) {
+		DecodeNative(consumer, max_length);
+		return;
+	}
+
 	AVPacket packet, packet_temp;
 
 	int remaining = max_length * SampleRate() * Channels();
@@ -228,11 +653,12 @@ inline void Decoder::Decode(FingerprintCalculator *consumer, int max_length)
 
 	av_init_packet(&packet);
 	av_init_packet(&packet_temp);
-	while (!stop) {
+	while (!stop && !CheckLimits()) {
 		if (av_read_frame(m_format_ctx, &packet) < 0) {
 	//		consumer->Flush();	
 			break;
 		}
+		m_packets++;
 
 		packet_temp.data = packet.data;
 		packet_temp.size = packet.size;
@@ -251,32 +677,21 @@ inline void Decoder::Decode(FingerprintCalculator *consumer, int max_length)
 				continue;
 			}
 
-			int16_t *audio_buffer;
-#ifdef HAVE_AV_AUDIO_CONVERT
-			if (m_convert_ctx) {
-				const void *ibuf[6] = { m_frame->data[0] };
-				void *obuf[6] = { m_buffer2 };
-				int istride[6] = { av_get_bytes_per_sample(m_codec_ctx->sample_fmt) };
-				int ostride[6] = { 2 };
-				int len = m_frame->nb_samples;
-				if (av_audio_convert(m_convert_ctx, obuf, ostride, ibuf, istride, len) < 0) {
-					break;
-				}
-				audio_buffer = (int16_t *)m_buffer2;
-			}
-			else {
-				audio_buffer = (int16_t *)m_frame->data[0];
-			}
-#else
-			audio_buffer = (int16_t *)m_frame->data[0];
-#endif
+			const int16_t *audio_buffer = m_converter.convert(m_frame->extended_data, m_frame->nb_samples);
 
-			int length = m_frame->nb_samples;
+			// The consumer takes the number of interleaved samples, not frames
+			int length = m_frame->nb_samples * Channels();
 			if (max_length) {
 				length = std::min(remaining, length);
 			}
 
-			consumer->feed(audio_buffer, length);
+			if (m_target_sample_rate) {
+				int count = m_downsampler.process(audio_buffer, length / Channels());
+				consumer->feed(const_cast<int16_t *>(m_downsampler.output()), count);
+			}
+			else {
+				consumer->feed(const_cast<int16_t *>(audio_buffer), length);
+			}
 
 			if (max_length) {
 				remaining -= length;
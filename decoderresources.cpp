@@ -0,0 +1,116 @@
+#include <QThreadStorage>
+#include "decoder.h"
+#include "decoderresources.h"
+
+QAtomicInt DecoderResources::s_files;
+QAtomicInt DecoderResources::s_frames;
+QAtomicInt DecoderResources::s_ioBuffers;
+QAtomicInt DecoderResources::s_buffers;
+
+// The analysis runs on the global thread pool, whose threads live long
+// enough for the sets to be reused many times
+Q_GLOBAL_STATIC(QThreadStorage<DecoderResources *>, localResources)
+
+DecoderResources::DecoderResources()
+	: m_frame(0), m_ioBuffer(0), m_busy(false), m_temporary(false), m_reportedAllocations(0)
+{
+#if NEW_AVFRAME_API
+	m_frame = av_frame_alloc();
+#else
+	m_frame = avcodec_alloc_frame();
+#endif
+	s_frames.ref();
+}
+
+DecoderResources::~DecoderResources()
+{
+	av_free(m_ioBuffer);
+#if NEW_AVFRAME_API
+	av_frame_free(&m_frame);
+#else
+	av_freep(&m_frame);
+#endif
+}
+
+DecoderResources *DecoderResources::acquire()
+{
+	QThreadStorage<DecoderResources *> *storage = localResources();
+	if (!storage->hasLocalData()) {
+		storage->setLocalData(new DecoderResources());
+	}
+	DecoderResources *resources = storage->localData();
+	if (resources->m_busy) {
+		resources = new DecoderResources();
+		resources->m_temporary = true;
+	}
+	resources->m_busy = true;
+	s_files.ref();
+	return resources;
+}
+
+void DecoderResources::release(DecoderResources *resources)
+{
+	resources->resetFrame();
+	resources->m_input.close();
+	int allocations = resources->bufferAllocations();
+	s_buffers.fetchAndAddRelaxed(allocations - resources->m_reportedAllocations);
+	resources->m_reportedAllocations = allocations;
+	resources->m_busy = false;
+	if (resources->m_temporary) {
+		delete resources;
+	}
+}
+
+void DecoderResources::freeLocal()
+{
+	QThreadStorage<DecoderResources *> *storage = localResources();
+	if (storage->hasLocalData() && !storage->localData()->m_busy) {
+		// Deletes the old set
+		storage->setLocalData(0);
+	}
+}
+
+DecoderResources::Stats DecoderResources::stats()
+{
+	Stats stats;
+	stats.files = s_files;
+	stats.frames = s_frames;
+	stats.ioBuffers = s_ioBuffers;
+	stats.buffers = s_buffers;
+	return stats;
+}
+
+uint8_t *DecoderResources::takeIOBuffer()
+{
+	uint8_t *buffer = m_ioBuffer;
+	m_ioBuffer = 0;
+	if (!buffer) {
+		buffer = static_cast<uint8_t *>(av_malloc(IO_BUFFER_SIZE));
+		s_ioBuffers.ref();
+	}
+	return buffer;
+}
+
+void DecoderResources::returnIOBuffer(uint8_t *buffer, int size)
+{
+	if (m_ioBuffer || size < IO_BUFFER_SIZE) {
+		av_free(buffer);
+		return;
+	}
+	m_ioBuffer = buffer;
+}
+
+void DecoderResources::resetFrame()
+{
+#if NEW_AVFRAME_API
+	av_frame_unref(m_frame);
+#else
+	avcodec_get_frame_defaults(m_frame);
+#endif
+}
+
+int DecoderResources::bufferAllocations() const
+{
+	return m_input.allocations() + m_converter.allocations() + m_downsampler.allocations() +
+	       m_wavDecoder.allocations() + m_flacDecoder.allocations();
+}
@@ -0,0 +1,88 @@
+#ifndef FPSUBMIT_DECODERRESOURCES_H_
+#define FPSUBMIT_DECODERRESOURCES_H_
+
+#include <QAtomicInt>
+#include <stdint.h>
+#include "inputfile.h"
+#include "sampleconverter.h"
+#include "downsampler.h"
+#include "wavdecoder.h"
+#include "flacdecoder.h"
+
+struct AVFrame;
+
+// Everything a Decoder allocates for itself, kept per thread and reused for
+// the next file. Analyzing a collection of short tracks used to spend a good
+// part of the time allocating and freeing the same frame and buffers over
+// and over. The format and codec contexts belong to FFmpeg and are still
+// created for each file.
+class DecoderResources
+{
+public:
+	// Allocations made by all decoders so far, for checking that the
+	// steady state doesn't allocate.
+	struct Stats
+	{
+		Stats() : files(0), frames(0), ioBuffers(0), buffers(0) {}
+
+		int files;
+		int frames;
+		int ioBuffers;
+		// Input, sample conversion, resampling and native decoder buffers
+		int buffers;
+	};
+
+	enum
+	{
+		IO_BUFFER_SIZE = 64 * 1024
+	};
+
+	DecoderResources();
+	~DecoderResources();
+
+	// Returns the calling thread's set, or a temporary one if it's already
+	// used by another decoder on the same thread.
+	static DecoderResources *acquire();
+	static void release(DecoderResources *resources);
+
+	// Frees the calling thread's set, the next decoder starts from scratch.
+	static void freeLocal();
+
+	static Stats stats();
+
+	AVFrame *frame() const { return m_frame; }
+	InputFile &input() { return m_input; }
+	SampleConverter &converter() { return m_converter; }
+	Downsampler &downsampler() { return m_downsampler; }
+	WavDecoder &wavDecoder() { return m_wavDecoder; }
+	FlacDecoder &flacDecoder() { return m_flacDecoder; }
+
+	// The buffer for FFmpeg's I/O context. FFmpeg can replace it with one of
+	// its own while probing, whatever the context ends up with is given back.
+	uint8_t *takeIOBuffer();
+	void returnIOBuffer(uint8_t *buffer, int size);
+
+	// Drops the references the frame holds to the last decoded audio.
+	void resetFrame();
+
+private:
+	int bufferAllocations() const;
+
+	AVFrame *m_frame;
+	uint8_t *m_ioBuffer;
+	InputFile m_input;
+	SampleConverter m_converter;
+	Downsampler m_downsampler;
+	WavDecoder m_wavDecoder;
+	FlacDecoder m_flacDecoder;
+	bool m_busy;
+	bool m_temporary;
+	int m_reportedAllocations;
+
+	static QAtomicInt s_files;
+	static QAtomicInt s_frames;
+	static QAtomicInt s_ioBuffers;
+	static QAtomicInt s_buffers;
+};
+
+#endif
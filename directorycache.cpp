@@ -0,0 +1,115 @@
+#include <QDir>
+#include <QFile>
+#include <QDataStream>
+#include <QDebug>
+#ifdef Q_OS_LINUX
+#include <sys/vfs.h>
+#endif
+#include "utils.h"
+#include "directorycache.h"
+
+static const quint32 DIRECTORY_CACHE_MAGIC = 0x41494444;
+static const quint32 DIRECTORY_CACHE_VERSION = 2;
+
+inline QDataStream &operator<<(QDataStream &stream, const DirectoryCache::Entry &entry)
+{
+	return stream << entry.mtime << entry.directories << entry.files;
+}
+
+inline QDataStream &operator>>(QDataStream &stream, DirectoryCache::Entry &entry)
+{
+	return stream >> entry.mtime >> entry.directories >> entry.files;
+}
+
+DirectoryCache::DirectoryCache()
+	: m_fileName(QDir::cleanPath(cacheFileName() + "/../directories.cache"))
+{
+}
+
+bool DirectoryCache::load()
+{
+	QFile file(m_fileName);
+	if (!file.open(QIODevice::ReadOnly)) {
+		return false;
+	}
+	QDataStream stream(&file);
+	stream.setVersion(QDataStream::Qt_4_6);
+	quint32 magic, version;
+	stream >> magic >> version;
+	if (magic != DIRECTORY_CACHE_MAGIC || version != DIRECTORY_CACHE_VERSION) {
+		qWarning() << "Ignoring invalid directory cache" << m_fileName;
+		return false;
+	}
+	stream >> m_oldEntries;
+	if (stream.status() != QDataStream::Ok) {
+		qWarning() << "Ignoring corrupted directory cache" << m_fileName;
+		m_oldEntries.clear();
+		return false;
+	}
+	qDebug() << "Loaded" << m_oldEntries.size() << "directories from" << m_fileName;
+	return true;
+}
+
+bool DirectoryCache::save()
+{
+	QMutexLocker locker(&m_mutex);
+	QDir().mkpath(QDir::cleanPath(m_fileName + "/.."));
+	QString tmpFileName = m_fileName + ".tmp";
+	QFile file(tmpFileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qWarning() << "Couldn't open directory cache" << tmpFileName << "for writing";
+		return false;
+	}
+	QDataStream stream(&file);
+	stream.setVersion(QDataStream::Qt_4_6);
+	stream << DIRECTORY_CACHE_MAGIC << DIRECTORY_CACHE_VERSION << m_newEntries;
+	file.close();
+	if (stream.status() != QDataStream::Ok || file.error() != QFile::NoError) {
+		QFile::remove(tmpFileName);
+		return false;
+	}
+	QFile::remove(m_fileName);
+	return QFile::rename(tmpFileName, m_fileName);
+}
+
+bool DirectoryCache::find(const QByteArray &path, qint64 mtime, Entry *entry) const
+{
+	QHash<QByteArray, Entry>::const_iterator it = m_oldEntries.constFind(path);
+	if (it == m_oldEntries.constEnd() || it->mtime != mtime) {
+		return false;
+	}
+	*entry = *it;
+	return true;
+}
+
+void DirectoryCache::insert(const QByteArray &path, const Entry &entry)
+{
+	QMutexLocker locker(&m_mutex);
+	m_newEntries.insert(path, entry);
+}
+
+bool DirectoryCache::isReliableFilesystem(const QString &path)
+{
+#ifdef Q_OS_LINUX
+	struct statfs st;
+	if (statfs(QFile::encodeName(path).constData(), &st) != 0) {
+		return false;
+	}
+	// Local filesystems with proper directory mtimes. Network filesystems
+	// can serve stale attributes from the client cache, FAT and friends have
+	// coarse or unreliable timestamps, FUSE can be anything.
+	switch (static_cast<quint32>(st.f_type)) {
+	case 0xEF53:     // ext2/3/4
+	case 0x58465342: // XFS
+	case 0x9123683E: // Btrfs
+	case 0x01021994: // tmpfs
+	case 0xF2F52010: // F2FS
+	case 0x2FC12FC1: // ZFS
+	case 0x3153464A: // JFS
+	case 0x52654973: // ReiserFS
+		return true;
+	}
+#endif
+	Q_UNUSED(path);
+	return false;
+}
@@ -0,0 +1,46 @@
+#ifndef FPSUBMIT_DIRECTORYCACHE_H_
+#define FPSUBMIT_DIRECTORYCACHE_H_
+
+#include <QHash>
+#include <QMutex>
+#include <QList>
+#include <QByteArray>
+#include <QString>
+
+// Contents of each directory seen during the last scan, together with the
+// directory's modification time. Adding, removing or renaming an entry
+// always updates the mtime of the directory, so on filesystems that keep
+// this guarantee an unchanged directory doesn't need to be listed again.
+// Paths and names are kept in the filesystem encoding.
+class DirectoryCache
+{
+public:
+	struct Entry
+	{
+		qint64 mtime;
+		QList<QByteArray> directories;
+		QList<QByteArray> files;
+	};
+
+	DirectoryCache();
+
+	bool load();
+	bool save();
+
+	// Looks up the contents recorded by the previous scan. Thread-safe.
+	bool find(const QByteArray &path, qint64 mtime, Entry *entry) const;
+	// Records the contents seen by the current scan. Thread-safe.
+	void insert(const QByteArray &path, const Entry &entry);
+
+	// Whether directory mtimes on the filesystem of the given path can be
+	// trusted to change whenever the directory's contents change.
+	static bool isReliableFilesystem(const QString &path);
+
+private:
+	QString m_fileName;
+	QHash<QByteArray, Entry> m_oldEntries;
+	QHash<QByteArray, Entry> m_newEntries;
+	QMutex m_mutex;
+};
+
+#endif
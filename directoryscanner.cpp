@@ -0,0 +1,360 @@
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include <QThread>
+#include <QTime>
+#include <QDebug>
+#ifdef Q_OS_LINUX
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+#include "utils.h"
+#include "constants.h"
+#include "directorycache.h"
+#include "pathstore.h"
+#include "directoryscanner.h"
+
+static const char *audioExtensions[] = {
+	"MP3", "MP4", "M4A", "FLAC", "OGG", "OGA", "APE", "OGGFLAC", "TTA", "WV", "MPC", "WMA", "WAV"
+};
+
+static QSet<QByteArray> makeAllowedExtensions()
+{
+	QSet<QByteArray> result;
+	for (size_t i = 0; i < sizeof(audioExtensions) / sizeof(audioExtensions[0]); i++) {
+		result.insert(audioExtensions[i]);
+	}
+	return result;
+}
+
+static QSet<QByteArray> allowedExtensions = makeAllowedExtensions();
+
+class ScanWorker : public QThread
+{
+public:
+	ScanWorker(DirectoryScanner *scanner, int index)
+		: m_scanner(scanner), m_index(index)
+	{
+	}
+
+protected:
+	void run()
+	{
+		m_scanner->work(m_index);
+	}
+
+private:
+	DirectoryScanner *m_scanner;
+	int m_index;
+};
+
+DirectoryScanner::DirectoryScanner(const QStringList &directories, int threadCount)
+	: m_directories(directories), m_paths(PathStore::instance()), m_directoryCache(0), m_startTime(0), m_pending(0), m_cancelled(0),
+	  m_directoryCount(0), m_fileCount(0), m_cachedDirectoryCount(0)
+{
+	if (threadCount <= 0) {
+		threadCount = MAX_SCAN_THREADS;
+	}
+	for (int i = 0; i < threadCount; i++) {
+		m_queues.append(new WorkQueue());
+	}
+}
+
+DirectoryScanner::~DirectoryScanner()
+{
+	qDeleteAll(m_queues);
+}
+
+bool DirectoryScanner::isAudioFile(const QString &fileName)
+{
+	return allowedExtensions.contains(extractExtension(fileName).toLatin1());
+}
+
+bool DirectoryScanner::isAudioFile(const QByteArray &encodedName)
+{
+	int pos = encodedName.lastIndexOf('.');
+	return pos != -1 && allowedExtensions.contains(encodedName.mid(pos + 1).toUpper());
+}
+
+void DirectoryScanner::setDirectoryCache(DirectoryCache *cache)
+{
+	m_directoryCache = cache;
+}
+
+void DirectoryScanner::cancel()
+{
+	m_cancelled = 1;
+}
+
+bool DirectoryScanner::isCancelled() const
+{
+	return m_cancelled != 0;
+}
+
+int DirectoryScanner::directoryCount() const
+{
+	return m_directoryCount;
+}
+
+int DirectoryScanner::fileCount() const
+{
+	return m_fileCount;
+}
+
+void DirectoryScanner::scan()
+{
+	QTime time;
+	time.start();
+#ifdef Q_OS_LINUX
+	m_startTime = qint64(::time(0)) * 1000000000;
+#endif
+
+	for (int i = 0; i < m_directories.size(); i++) {
+		addDirectory(i % m_queues.size(), m_paths->addDirectory(m_directories.at(i)));
+	}
+
+	// The calling thread acts as the first worker
+	QList<ScanWorker *> workers;
+	for (int i = 1; i < m_queues.size(); i++) {
+		ScanWorker *worker = new ScanWorker(this, i);
+		worker->start();
+		workers.append(worker);
+	}
+	work(0);
+	foreach (ScanWorker *worker, workers) {
+		worker->wait();
+		delete worker;
+	}
+
+	int elapsed = qMax(1, time.elapsed());
+	qDebug() << "Scanned" << directoryCount() << "directories with" << fileCount() << "audio files in"
+	         << elapsed << "ms using" << m_queues.size() << "threads ("
+	         << directoryCount() * 1000.0 / elapsed << "directories/s," << int(m_cachedDirectoryCount)
+	         << "directories unchanged)";
+}
+
+void DirectoryScanner::addDirectory(int worker, quint32 directory)
+{
+	m_pending.ref();
+	WorkQueue *queue = m_queues.at(worker);
+	queue->mutex.lock();
+	queue->directories.append(directory);
+	queue->mutex.unlock();
+	m_idleCondition.wakeOne();
+}
+
+bool DirectoryScanner::takeDirectory(int worker, quint32 *directory)
+{
+	// Take the most recently added directory from our own queue, so that
+	// each worker goes depth-first and keeps its listings local
+	WorkQueue *queue = m_queues.at(worker);
+	queue->mutex.lock();
+	if (!queue->directories.isEmpty()) {
+		*directory = queue->directories.takeLast();
+		queue->mutex.unlock();
+		return true;
+	}
+	queue->mutex.unlock();
+
+	// Steal the oldest directory from somebody else, it's the one most likely
+	// to have a large subtree under it
+	for (int i = 1; i < m_queues.size(); i++) {
+		WorkQueue *victim = m_queues.at((worker + i) % m_queues.size());
+		QMutexLocker locker(&victim->mutex);
+		if (!victim->directories.isEmpty()) {
+			*directory = victim->directories.takeFirst();
+			return true;
+		}
+	}
+	return false;
+}
+
+void DirectoryScanner::finishDirectory()
+{
+	if (!m_pending.deref()) {
+		QMutexLocker locker(&m_idleMutex);
+		m_idleCondition.wakeAll();
+	}
+}
+
+void DirectoryScanner::work(int worker)
+{
+	quint32 directory;
+	while (true) {
+		if (takeDirectory(worker, &directory)) {
+			if (!isCancelled()) {
+				processDirectory(worker, directory);
+			}
+			finishDirectory();
+			continue;
+		}
+		QMutexLocker locker(&m_idleMutex);
+		if (m_pending == 0) {
+			break;
+		}
+		m_idleCondition.wait(&m_idleMutex, 10);
+	}
+}
+
+bool DirectoryScanner::isReliableDevice(quint64 device, const QByteArray &encodedPath)
+{
+	QMutexLocker locker(&m_devicesMutex);
+	QHash<quint64, bool>::const_iterator it = m_reliableDevices.constFind(device);
+	if (it != m_reliableDevices.constEnd()) {
+		return it.value();
+	}
+	QString path = PathStore::decodeName(encodedPath);
+	bool reliable = DirectoryCache::isReliableFilesystem(path);
+	if (!reliable) {
+		qDebug() << "Directory mtimes are not reliable on the filesystem of" << path << "doing a full scan";
+	}
+	m_reliableDevices.insert(device, reliable);
+	return reliable;
+}
+
+#ifdef Q_OS_LINUX
+
+struct linux_dirent64
+{
+	quint64 d_ino;
+	qint64 d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+void DirectoryScanner::processDirectory(int worker, quint32 directory)
+{
+	QByteArray encodedPath = m_paths->encodedDirectoryPath(directory);
+	emit currentPathChanged(PathStore::decodeName(encodedPath));
+	m_directoryCount.ref();
+
+	// If the directory didn't change since the last scan, use the recorded
+	// listing instead of reading the directory again. Changes made within
+	// the timestamp granularity of the listing could go unnoticed, so recent
+	// directories are always listed.
+	qint64 mtime = -1;
+	DirectoryCache::Entry listing;
+	if (m_directoryCache) {
+		struct stat st;
+		if (stat(encodedPath.constData(), &st) == 0 && isReliableDevice(st.st_dev, encodedPath)) {
+			qint64 directoryMtime = qint64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+			if (m_startTime - directoryMtime > qint64(2) * 1000000000) {
+				mtime = directoryMtime;
+			}
+		}
+		if (mtime >= 0 && m_directoryCache->find(encodedPath, mtime, &listing)) {
+			m_directoryCache->insert(encodedPath, listing);
+			m_cachedDirectoryCount.ref();
+			foreach (const QByteArray &name, listing.directories) {
+				addDirectory(worker, m_paths->addDirectory(directory, name));
+			}
+			if (!listing.files.isEmpty()) {
+				m_fileCount.fetchAndAddRelaxed(listing.files.size());
+				emit filesFound(m_paths->addFiles(directory, listing.files));
+			}
+			return;
+		}
+		listing.mtime = mtime;
+		listing.directories.clear();
+		listing.files.clear();
+	}
+
+	int fd = open(encodedPath.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		qWarning() << "Couldn't open directory" << PathStore::decodeName(encodedPath);
+		return;
+	}
+
+	// Read the raw directory entries, d_type tells us whether an entry is
+	// a directory or a regular file without having to stat it
+	char buffer[32 * 1024];
+	bool complete = true;
+	QList<QByteArray> files;
+	while (!isCancelled()) {
+		long size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+		if (size <= 0) {
+			complete = size == 0;
+			break;
+		}
+		for (long offset = 0; offset < size; ) {
+			struct linux_dirent64 *entry = reinterpret_cast<struct linux_dirent64 *>(buffer + offset);
+			offset += entry->d_reclen;
+			const char *name = entry->d_name;
+			// Skip hidden files, "." and ".."
+			if (name[0] == '.') {
+				continue;
+			}
+			unsigned char type = entry->d_type;
+			if (type == DT_REG && !strrchr(name, '.')) {
+				continue;
+			}
+			if (type != DT_DIR && type != DT_REG && type != DT_LNK && type != DT_UNKNOWN) {
+				continue;
+			}
+			if (type == DT_LNK || type == DT_UNKNOWN) {
+				struct stat st;
+				if (stat((encodedPath + name).constData(), &st) != 0) {
+					continue;
+				}
+				type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+			}
+			if (type == DT_DIR) {
+				QByteArray directoryName(name);
+				addDirectory(worker, m_paths->addDirectory(directory, directoryName));
+				listing.directories.append(directoryName);
+			}
+			else if (type == DT_REG) {
+				QByteArray fileName(name);
+				if (isAudioFile(fileName)) {
+					files.append(fileName);
+				}
+			}
+		}
+	}
+	close(fd);
+
+	if (mtime >= 0 && complete && !isCancelled()) {
+		listing.files = files;
+		m_directoryCache->insert(encodedPath, listing);
+	}
+
+	if (!files.isEmpty()) {
+		m_fileCount.fetchAndAddRelaxed(files.size());
+		emit filesFound(m_paths->addFiles(directory, files));
+	}
+}
+
+#else
+
+void DirectoryScanner::processDirectory(int worker, quint32 directory)
+{
+	QString path = m_paths->directoryPath(directory);
+	emit currentPathChanged(path);
+	m_directoryCount.ref();
+
+	QList<QByteArray> files;
+	QFileInfoList fileInfoList = QDir(path).entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot, QDir::NoSort);
+	for (int j = 0; j < fileInfoList.size(); j++) {
+		const QFileInfo &fileInfo = fileInfoList.at(j);
+		if (fileInfo.isDir()) {
+			addDirectory(worker, m_paths->addDirectory(directory, PathStore::encodeName(fileInfo.fileName())));
+		}
+		else if (isAudioFile(fileInfo.fileName())) {
+			files.append(PathStore::encodeName(fileInfo.fileName()));
+		}
+	}
+
+	if (!files.isEmpty()) {
+		m_fileCount.fetchAndAddRelaxed(files.size());
+		emit filesFound(m_paths->addFiles(directory, files));
+	}
+}
+
+#endif
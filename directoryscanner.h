@@ -0,0 +1,80 @@
+#ifndef FPSUBMIT_DIRECTORYSCANNER_H_
+#define FPSUBMIT_DIRECTORYSCANNER_H_
+
+#include <QObject>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QStringList>
+#include <QAtomicInt>
+#include <QHash>
+
+class ScanWorker;
+class DirectoryCache;
+class PathStore;
+
+// Walks a set of directory trees using several threads. Each worker keeps
+// its own queue of directories to list and steals from the others when it
+// runs out of work. Audio files are added to the path store and reported in
+// per-directory batches of handles through the filesFound() signal, which is
+// emitted from the worker threads.
+class DirectoryScanner : public QObject
+{
+	Q_OBJECT
+
+public:
+	DirectoryScanner(const QStringList &directories, int threadCount = 0);
+	~DirectoryScanner();
+
+	// Blocks until all directories have been listed or the scan is cancelled.
+	void scan();
+	void cancel();
+
+	// Reuses the listings of directories that didn't change since the last
+	// scan and records the current ones, on filesystems that support it.
+	void setDirectoryCache(DirectoryCache *cache);
+
+	bool isCancelled() const;
+	int directoryCount() const;
+	int fileCount() const;
+
+	static bool isAudioFile(const QString &fileName);
+	static bool isAudioFile(const QByteArray &encodedName);
+
+signals:
+	void currentPathChanged(const QString &path);
+	void filesFound(const QList<quint32> &files);
+
+private:
+	friend class ScanWorker;
+
+	struct WorkQueue
+	{
+		QMutex mutex;
+		QList<quint32> directories;
+	};
+
+	void addDirectory(int worker, quint32 directory);
+	bool takeDirectory(int worker, quint32 *directory);
+	void finishDirectory();
+	void processDirectory(int worker, quint32 directory);
+	void work(int worker);
+	bool isReliableDevice(quint64 device, const QByteArray &encodedPath);
+
+	QStringList m_directories;
+	PathStore *m_paths;
+	DirectoryCache *m_directoryCache;
+	QMutex m_devicesMutex;
+	QHash<quint64, bool> m_reliableDevices;
+	qint64 m_startTime;
+	QList<WorkQueue *> m_queues;
+	QMutex m_idleMutex;
+	QWaitCondition m_idleCondition;
+	QAtomicInt m_pending;
+	QAtomicInt m_cancelled;
+	QAtomicInt m_directoryCount;
+	QAtomicInt m_fileCount;
+	QAtomicInt m_cachedDirectoryCount;
+};
+
+#endif
@@ -0,0 +1,247 @@
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QSocketNotifier>
+#include <QThreadPool>
+#include <QTimer>
+#include <QDebug>
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+#include "constants.h"
+#include "directoryscanner.h"
+#include "directorywatcher.h"
+
+#ifdef Q_OS_LINUX
+static const quint32 WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY | IN_ONLYDIR;
+#endif
+
+class AddWatchesTask : public QRunnable
+{
+public:
+	AddWatchesTask(DirectoryWatcher *watcher, const QString &path, bool collectFiles)
+		: m_watcher(watcher), m_path(path), m_collectFiles(collectFiles)
+	{
+	}
+
+	void run()
+	{
+		// Files in new directories could have been created before we started
+		// watching them, so those are collected here
+		QStringList files;
+		bool ok = m_watcher->addWatch(m_path);
+		QDir::Filters filters = QDir::AllDirs | QDir::NoDotAndDotDot;
+		if (m_collectFiles) {
+			filters |= QDir::Files;
+		}
+		QDirIterator it(m_path, filters, QDirIterator::Subdirectories);
+		while (it.hasNext()) {
+			QString path = it.next();
+			QFileInfo fileInfo = it.fileInfo();
+			if (fileInfo.isDir()) {
+				if (ok && !fileInfo.isSymLink()) {
+					ok = m_watcher->addWatch(path);
+				}
+			}
+			else if (DirectoryScanner::isAudioFile(path)) {
+				files.append(path);
+			}
+		}
+		if (!ok) {
+			QMetaObject::invokeMethod(m_watcher, "enableFallbackRescan", Qt::QueuedConnection);
+		}
+		if (!files.isEmpty()) {
+			QMetaObject::invokeMethod(m_watcher, "addPendingFiles", Qt::QueuedConnection, Q_ARG(QStringList, files));
+		}
+	}
+
+private:
+	DirectoryWatcher *m_watcher;
+	QString m_path;
+	bool m_collectFiles;
+};
+
+DirectoryWatcher::DirectoryWatcher(const QStringList &directories, QObject *parent)
+	: QObject(parent), m_directories(directories), m_fd(-1), m_notifier(0), m_stopped(false)
+{
+	m_debounceTimer = new QTimer(this);
+	m_debounceTimer->setInterval(WATCH_DEBOUNCE_TIME / 2);
+	connect(m_debounceTimer, SIGNAL(timeout()), SLOT(flushPendingFiles()));
+	m_rescanTimer = new QTimer(this);
+	m_rescanTimer->setInterval(WATCH_RESCAN_INTERVAL);
+	connect(m_rescanTimer, SIGNAL(timeout()), SIGNAL(rescanNeeded()));
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+#ifdef Q_OS_LINUX
+	if (m_fd != -1) {
+		::close(m_fd);
+	}
+#endif
+}
+
+void DirectoryWatcher::start()
+{
+#ifdef Q_OS_LINUX
+	m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_fd == -1) {
+		qWarning() << "Couldn't initialize inotify";
+		enableFallbackRescan();
+		return;
+	}
+	m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+	connect(m_notifier, SIGNAL(activated(int)), SLOT(readEvents()));
+	foreach (const QString &directory, m_directories) {
+		addDirectoryTree(directory, false);
+	}
+#else
+	enableFallbackRescan();
+#endif
+}
+
+void DirectoryWatcher::stop()
+{
+	m_stopped = true;
+	if (m_notifier) {
+		m_notifier->setEnabled(false);
+	}
+	m_debounceTimer->stop();
+	m_rescanTimer->stop();
+	m_pendingFiles.clear();
+}
+
+bool DirectoryWatcher::addWatch(const QString &path)
+{
+#ifdef Q_OS_LINUX
+	QMutexLocker locker(&m_mutex);
+	int wd = inotify_add_watch(m_fd, QFile::encodeName(path).constData(), WATCH_MASK);
+	if (wd == -1) {
+		if (errno == ENOSPC) {
+			qWarning() << "Reached the inotify watch limit, see /proc/sys/fs/inotify/max_user_watches";
+			return false;
+		}
+		// The directory disappeared or is not readable
+		return true;
+	}
+	m_paths.insert(wd, path.endsWith('/') ? path : path + '/');
+	return true;
+#else
+	Q_UNUSED(path);
+	return false;
+#endif
+}
+
+void DirectoryWatcher::addDirectoryTree(const QString &path, bool collectFiles)
+{
+	AddWatchesTask *task = new AddWatchesTask(this, path, collectFiles);
+	task->setAutoDelete(true);
+	QThreadPool::globalInstance()->start(task);
+}
+
+void DirectoryWatcher::readEvents()
+{
+#ifdef Q_OS_LINUX
+	union {
+		struct inotify_event event;
+		char data[64 * 1024];
+	} buffer;
+	while (true) {
+		ssize_t size = read(m_fd, buffer.data, sizeof(buffer.data));
+		if (size <= 0) {
+			break;
+		}
+		for (ssize_t offset = 0; offset < size; ) {
+			struct inotify_event *event = reinterpret_cast<struct inotify_event *>(buffer.data + offset);
+			offset += sizeof(struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW) {
+				qWarning() << "The inotify event queue overflowed, rescanning";
+				emit rescanNeeded();
+				continue;
+			}
+			QString directory;
+			m_mutex.lock();
+			if (event->mask & IN_IGNORED) {
+				m_paths.remove(event->wd);
+			}
+			else {
+				directory = m_paths.value(event->wd);
+			}
+			m_mutex.unlock();
+			if (directory.isEmpty() || !event->len) {
+				continue;
+			}
+			QString name = QFile::decodeName(event->name);
+			if (name.startsWith('.')) {
+				continue;
+			}
+			QString path = directory + name;
+			if (event->mask & IN_ISDIR) {
+				if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+					addDirectoryTree(path, true);
+				}
+			}
+			else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+				addPendingFile(path);
+			}
+			else if (event->mask & IN_MODIFY) {
+				// Still being written, wait a bit longer
+				QHash<QString, QTime>::iterator it = m_pendingFiles.find(path);
+				if (it != m_pendingFiles.end()) {
+					it->start();
+				}
+			}
+		}
+	}
+#endif
+}
+
+void DirectoryWatcher::addPendingFile(const QString &path)
+{
+	if (m_stopped || !DirectoryScanner::isAudioFile(path)) {
+		return;
+	}
+	m_pendingFiles[path].start();
+	if (!m_debounceTimer->isActive()) {
+		m_debounceTimer->start();
+	}
+}
+
+void DirectoryWatcher::addPendingFiles(const QStringList &files)
+{
+	foreach (const QString &file, files) {
+		addPendingFile(file);
+	}
+}
+
+void DirectoryWatcher::flushPendingFiles()
+{
+	QStringList files;
+	QMutableHashIterator<QString, QTime> it(m_pendingFiles);
+	while (it.hasNext()) {
+		it.next();
+		if (it.value().elapsed() >= WATCH_DEBOUNCE_TIME) {
+			files.append(it.key());
+			it.remove();
+		}
+	}
+	if (m_pendingFiles.isEmpty()) {
+		m_debounceTimer->stop();
+	}
+	if (!files.isEmpty()) {
+		qDebug() << "Detected" << files.size() << "new or changed files";
+		emit filesChanged(files);
+	}
+}
+
+void DirectoryWatcher::enableFallbackRescan()
+{
+	if (!m_stopped && !m_rescanTimer->isActive()) {
+		qWarning() << "Not all changes can be watched, rescanning every" << WATCH_RESCAN_INTERVAL / 1000 << "seconds";
+		m_rescanTimer->start();
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef FPSUBMIT_DIRECTORYWATCHER_H_
+#define FPSUBMIT_DIRECTORYWATCHER_H_
+
+#include <QObject>
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
+#include <QTime>
+
+class QSocketNotifier;
+class QTimer;
+
+// Watches directory trees for new or rewritten audio files. On Linux every
+// directory gets an inotify watch, files are reported once nothing happened
+// to them for WATCH_DEBOUNCE_TIME, so that half-copied files are not picked
+// up. If the kernel event queue overflows or not all directories could be
+// watched, rescanNeeded() asks for a full rescan instead. On other systems
+// it simply requests a rescan every WATCH_RESCAN_INTERVAL.
+class DirectoryWatcher : public QObject
+{
+	Q_OBJECT
+
+public:
+	DirectoryWatcher(const QStringList &directories, QObject *parent = 0);
+	~DirectoryWatcher();
+
+	void start();
+	void stop();
+
+	// Called from the background tasks that add the watches.
+	bool addWatch(const QString &path);
+
+signals:
+	void filesChanged(const QStringList &files);
+	void rescanNeeded();
+
+private slots:
+	void readEvents();
+	void flushPendingFiles();
+	void addPendingFiles(const QStringList &files);
+	void enableFallbackRescan();
+
+private:
+	void addDirectoryTree(const QString &path, bool collectFiles);
+	void addPendingFile(const QString &path);
+
+	QStringList m_directories;
+	int m_fd;
+	QSocketNotifier *m_notifier;
+	QTimer *m_debounceTimer;
+	QTimer *m_rescanTimer;
+	QMutex m_mutex;
+	QHash<int, QString> m_paths;
+	QHash<QString, QTime> m_pendingFiles;
+	bool m_stopped;
+};
+
+#endif
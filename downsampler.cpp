@@ -0,0 +1,205 @@
+#include <math.h>
+#include "simd.h"
+#include "sampleconverter.h"
+#include "downsampler.h"
+
+// Larger ratios are left to chromaprint, the filter would get too big
+static const int MAX_FILTER_PHASES = 512;
+// Zero crossings of the sinc on each side of the center
+static const int FILTER_ZERO_CROSSINGS = 8;
+// Cutoff relative to the Nyquist frequency of the lower rate
+static const double FILTER_CUTOFF = 0.9;
+static const double PI = 3.14159265358979323846;
+
+static int greatestCommonDivisor(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static inline int16_t roundSample(float value)
+{
+	value = value < 32767.0f ? value : 32767.0f;
+	value = value > -32768.0f ? value : -32768.0f;
+	return int16_t(lrintf(value));
+}
+
+// Resizes the buffer without ever giving memory back, so that a downsampler
+// used for a series of files stops allocating once it has seen the longest
+// frames.
+template <typename T>
+static void resizeBuffer(QVector<T> &buffer, int size, int *allocations)
+{
+	if (size > buffer.capacity()) {
+		buffer.reserve(size);
+		(*allocations)++;
+	}
+	buffer.resize(size);
+}
+
+static float dotProduct(const float *a, const float *b, int size)
+{
+	float sum = 0.0f;
+	for (int i = 0; i < size; i++) {
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+#ifdef HAVE_X86_KERNELS
+TARGET_SSE2 static float dotProductSSE2(const float *a, const float *b, int size)
+{
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	int i = 0;
+	for (; i + 8 <= size; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+	float partial[4];
+	_mm_storeu_ps(partial, _mm_add_ps(sum0, sum1));
+	float sum = partial[0] + partial[1] + partial[2] + partial[3];
+	for (; i < size; i++) {
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+#endif
+
+Downsampler::Downsampler()
+	: m_channels(1), m_outputRate(0), m_phases(1), m_step(1), m_taps(0), m_position(0), m_phase(0), m_simd(false),
+	  m_filterPhases(0), m_filterStep(0), m_allocations(0)
+{
+}
+
+void Downsampler::setup(int sampleRate, int channels, int targetRate)
+{
+	m_channels = channels;
+	m_outputRate = sampleRate;
+	m_phases = 1;
+	m_step = 1;
+	m_taps = 0;
+	m_history.resize(0);
+	m_position = 0;
+	m_phase = 0;
+#ifdef HAVE_X86_KERNELS
+	m_simd = SampleConverter::bestKernel() >= SampleConverter::SSE2;
+#endif
+	if (sampleRate <= targetRate) {
+		return;
+	}
+	int divisor = greatestCommonDivisor(sampleRate, targetRate);
+	if (targetRate / divisor > MAX_FILTER_PHASES) {
+		return;
+	}
+	m_phases = targetRate / divisor;
+	m_step = sampleRate / divisor;
+	m_outputRate = targetRate;
+	// Most files in a collection share the rate, so the filter for the
+	// previous file can usually be used again
+	if (m_phases != m_filterPhases || m_step != m_filterStep) {
+		designFilter();
+		m_filterPhases = m_phases;
+		m_filterStep = m_step;
+	}
+	m_taps = m_coefficients.size() / m_phases;
+	// Start with silence in the history, so the first outputs have all the taps
+	resizeBuffer(m_history, m_taps - 1, &m_allocations);
+	m_history.fill(0.0f);
+	m_position = m_taps - 1;
+}
+
+void Downsampler::designFilter()
+{
+	// Prototype low-pass filter at the interpolated rate, split into one
+	// sub-filter per phase. Each sub-filter is stored in reverse, so that
+	// it can be applied as a dot product with the history.
+	double cutoff = 0.5 * FILTER_CUTOFF / m_step;
+	m_taps = int(ceil(2.0 * FILTER_ZERO_CROSSINGS / (2.0 * cutoff) / m_phases));
+	int length = m_taps * m_phases;
+	QVector<double> prototype(length);
+	double center = (length - 1) / 2.0;
+	double sum = 0.0;
+	for (int i = 0; i < length; i++) {
+		double x = i - center;
+		double sinc = x == 0.0 ? 1.0 : sin(2.0 * PI * cutoff * x) / (2.0 * PI * cutoff * x);
+		double window = 0.42 - 0.5 * cos(2.0 * PI * (i + 0.5) / length) + 0.08 * cos(4.0 * PI * (i + 0.5) / length);
+		prototype[i] = sinc * window;
+		sum += prototype[i];
+	}
+	// Unity gain at DC for every phase
+	double gain = m_phases / sum;
+	resizeBuffer(m_coefficients, length, &m_allocations);
+	for (int phase = 0; phase < m_phases; phase++) {
+		float *coefficients = m_coefficients.data() + phase * m_taps;
+		for (int j = 0; j < m_taps; j++) {
+			coefficients[j] = float(prototype[phase + (m_taps - 1 - j) * m_phases] * gain);
+		}
+	}
+}
+
+int Downsampler::process(const int16_t *input, int frames)
+{
+	// Downmix into the history, the same way chromaprint does it
+	int offset = m_history.size();
+	resizeBuffer(m_history, offset + frames, &m_allocations);
+	float *history = m_history.data() + offset;
+	if (m_channels == 1) {
+		for (int i = 0; i < frames; i++) {
+			history[i] = input[i];
+		}
+	}
+	else if (m_channels == 2) {
+		for (int i = 0; i < frames; i++) {
+			history[i] = (int(input[2 * i]) + int(input[2 * i + 1])) / 2;
+		}
+	}
+	else {
+		for (int i = 0; i < frames; i++) {
+			int sum = 0;
+			for (int c = 0; c < m_channels; c++) {
+				sum += input[i * m_channels + c];
+			}
+			history[i] = sum / m_channels;
+		}
+	}
+
+	if (!m_taps) {
+		resizeBuffer(m_output, frames, &m_allocations);
+		for (int i = 0; i < frames; i++) {
+			m_output[i] = int16_t(m_history.at(i));
+		}
+		m_history.resize(0);
+		return frames;
+	}
+
+	int count = 0;
+	resizeBuffer(m_output, int((qint64(m_history.size()) * m_phases) / m_step + 1), &m_allocations);
+	history = m_history.data();
+	int size = m_history.size();
+	while (m_position < size) {
+		const float *coefficients = m_coefficients.constData() + m_phase * m_taps;
+		const float *samples = history + m_position - (m_taps - 1);
+#ifdef HAVE_X86_KERNELS
+		float value = m_simd ? dotProductSSE2(coefficients, samples, m_taps) : dotProduct(coefficients, samples, m_taps);
+#else
+		float value = dotProduct(coefficients, samples, m_taps);
+#endif
+		m_output[count++] = roundSample(value);
+		m_phase += m_step;
+		m_position += m_phase / m_phases;
+		m_phase %= m_phases;
+	}
+
+	// Keep only what the next output samples still need
+	int keep = m_position - (m_taps - 1);
+	if (keep > 0) {
+		m_history.remove(0, qMin(keep, size));
+		m_position -= qMin(keep, size);
+	}
+	return count;
+}
@@ -0,0 +1,52 @@
+#ifndef FPSUBMIT_DOWNSAMPLER_H_
+#define FPSUBMIT_DOWNSAMPLER_H_
+
+#include <QVector>
+#include <stdint.h>
+
+// Mixes interleaved audio down to mono and resamples it to the rate
+// chromaprint works at, in a single pass. Chromaprint would do the same
+// internally, but only after we pushed all the channels at the original
+// rate through it. The resampler is a polyphase windowed-sinc filter for
+// the exact rational ratio between the rates. Rates at or below the target
+// and ratios that would need too many filter phases are only downmixed.
+class Downsampler
+{
+public:
+	Downsampler();
+
+	void setup(int sampleRate, int channels, int targetRate);
+
+	int outputSampleRate() const { return m_outputRate; }
+	// Number of times a buffer had to grow. Buffers are never shrunk and the
+	// filter is kept as long as the rates don't change.
+	int allocations() const { return m_allocations; }
+
+	// Processes the given number of frames and returns the number of
+	// samples available in output(), valid until the next call.
+	int process(const int16_t *input, int frames);
+	const int16_t *output() const { return m_output.constData(); }
+
+private:
+	void designFilter();
+
+	int m_channels;
+	int m_outputRate;
+	// Output advances by m_step/m_phases input samples per sample
+	int m_phases;
+	int m_step;
+	int m_taps;
+	QVector<float> m_coefficients;
+	QVector<float> m_history;
+	// Position of the next output sample, as an index into m_history and a phase
+	int m_position;
+	int m_phase;
+	bool m_simd;
+	QVector<int16_t> m_output;
+	// Ratio the coefficients were designed for
+	int m_filterPhases;
+	int m_filterStep;
+	int m_allocations;
+};
+
+#endif
@@ -0,0 +1,401 @@
+#include <QThread>
+#include <QtAlgorithms>
+#include "simd.h"
+#include "constants.h"
+#include "duplicateindex.h"
+
+static const int MIN_BUCKET_BITS = 16;
+static const int MAX_BUCKET_BITS = 24;
+static const int GROUP_CHUNK_SIZE = 256;
+// Track numbers take the top 24 bits of a posting
+static const int MAX_TRACKS = 1 << 24;
+
+typedef int (*BitErrorsFunc)(const quint32 *a, const quint32 *b, int size);
+
+static int bitErrorsScalar(const quint32 *a, const quint32 *b, int size)
+{
+	int errors = 0;
+	for (int i = 0; i < size; i++) {
+		quint32 x = a[i] ^ b[i];
+		x = x - ((x >> 1) & 0x55555555);
+		x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+		errors += (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+	}
+	return errors;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// SSE2 has no byte shuffle, so the bits are counted per byte with the
+// same tricks as the scalar code and the bytes are summed with psadbw.
+TARGET_SSE2 static int bitErrorsSSE2(const quint32 *a, const quint32 *b, int size)
+{
+	const __m128i m1 = _mm_set1_epi8(0x55);
+	const __m128i m2 = _mm_set1_epi8(0x33);
+	const __m128i m4 = _mm_set1_epi8(0x0F);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 4 <= size; i += 4) {
+		__m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)),
+		                          _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+		x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi16(x, 1), m1));
+		x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi16(x, 2), m2));
+		x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi16(x, 4)), m4);
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(x, zero));
+	}
+	int errors = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+	return errors + bitErrorsScalar(a + i, b + i, size - i);
+}
+
+// Looks up the bit counts of both nibbles of every byte with vpshufb.
+TARGET_AVX2 static int bitErrorsAVX2(const quint32 *a, const quint32 *b, int size)
+{
+	const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0F);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sum = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 8 <= size; i += 8) {
+		__m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)),
+		                             _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i)));
+		__m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(x, low)),
+		                                 _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(counts, zero));
+	}
+	__m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	int errors = _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half));
+	return errors + bitErrorsScalar(a + i, b + i, size - i);
+}
+
+#endif
+
+static BitErrorsFunc findBitErrorsFunc(SampleConverter::Kernel kernel)
+{
+#ifdef HAVE_X86_KERNELS
+	if (kernel == SampleConverter::AVX2) {
+		return &bitErrorsAVX2;
+	}
+	if (kernel == SampleConverter::SSE2) {
+		return &bitErrorsSSE2;
+	}
+#endif
+	return &bitErrorsScalar;
+}
+
+class GroupWorker : public QThread
+{
+public:
+	GroupWorker(const DuplicateIndex *index, const DuplicateIndex::SortedPostings *sorted, QAtomicInt *next,
+	            QList<QPair<int, int> > *pairs, DuplicateIndex::Stats *stats)
+		: m_index(index), m_sorted(sorted), m_next(next), m_pairs(pairs), m_stats(stats)
+	{
+	}
+
+protected:
+	void run()
+	{
+		m_index->groupRange(m_sorted, m_next, m_pairs, m_stats);
+	}
+
+private:
+	const DuplicateIndex *m_index;
+	const DuplicateIndex::SortedPostings *m_sorted;
+	QAtomicInt *m_next;
+	QList<QPair<int, int> > *m_pairs;
+	DuplicateIndex::Stats *m_stats;
+};
+
+DuplicateIndex::DuplicateIndex()
+	: m_bits(MIN_BUCKET_BITS)
+{
+	m_starts.append(0);
+	m_heads.fill(-1, 1 << m_bits);
+	setKernel(SampleConverter::bestKernel());
+}
+
+void DuplicateIndex::setKernel(SampleConverter::Kernel kernel)
+{
+	m_kernel = qMin(kernel, SampleConverter::bestKernel());
+	m_bitErrors = findBitErrorsFunc(m_kernel);
+}
+
+int DuplicateIndex::bitErrors(const quint32 *a, const quint32 *b, int size, SampleConverter::Kernel kernel)
+{
+	return findBitErrorsFunc(qMin(kernel, SampleConverter::bestKernel()))(a, b, size);
+}
+
+int DuplicateIndex::add(const QVector<quint32> &fingerprint, int length, quint32 file)
+{
+	int track = size();
+	if (track >= MAX_TRACKS) {
+		return -1;
+	}
+	if (file != NoFile) {
+		// The postings of the old track stay until the next rehash
+		int old = m_fileTracks.value(file, -1);
+		if (old != -1) {
+			m_removed[old] = true;
+		}
+		m_fileTracks.insert(file, track);
+	}
+	m_files.append(file);
+	m_removed.append(false);
+	int count = qMin(fingerprint.size(), DUPLICATE_COMPARE_ITEMS);
+	for (int i = 0; i < count; i++) {
+		m_items.append(fingerprint.at(i));
+	}
+	m_starts.append(m_items.size());
+	m_lengths.append(length);
+	// Use one more bit once the chains get long, that re-indexes everything
+	// including the new track
+	if (m_postings.size() + DUPLICATE_INDEX_ITEMS > 2 * m_heads.size() && m_bits < MAX_BUCKET_BITS) {
+		rehash(m_bits + 1);
+	}
+	else {
+		indexTrack(track);
+	}
+	return track;
+}
+
+void DuplicateIndex::indexTrack(int track)
+{
+	if (m_removed.at(track)) {
+		return;
+	}
+	const quint32 *values = items(track);
+	int count = qMin(itemCount(track), DUPLICATE_INDEX_ITEMS);
+	for (int i = 0; i < count; i++) {
+		// Repeated items are silence or a steady tone, which too many tracks share
+		if (i > 0 && values[i] == values[i - 1]) {
+			continue;
+		}
+		quint32 b = bucket(values[i]);
+		Posting posting;
+		posting.value = quint32(track) << 8 | quint32(i);
+		posting.next = m_heads.at(b);
+		m_postings.append(posting);
+		m_heads[b] = m_postings.size() - 1;
+	}
+}
+
+void DuplicateIndex::rehash(int bits)
+{
+	m_bits = bits;
+	m_heads.fill(-1, 1 << m_bits);
+	m_postings.resize(0);
+	for (int track = 0; track < size(); track++) {
+		indexTrack(track);
+	}
+}
+
+bool DuplicateIndex::isDuplicate(int track, int other, int offset) const
+{
+	if (m_removed.at(other) || (m_files.at(track) != NoFile && m_files.at(track) == m_files.at(other))) {
+		return false;
+	}
+	if (qAbs(m_lengths.at(track) - m_lengths.at(other)) > DUPLICATE_MAX_LENGTH_DIFFERENCE) {
+		return false;
+	}
+	// Item i of the track is aligned with item i + offset of the other one
+	int count = itemCount(track), otherCount = itemCount(other);
+	int start = qMax(0, -offset);
+	int end = qMin(count, otherCount - offset);
+	int overlap = end - start;
+	if (overlap <= 0 || overlap < qMin(DUPLICATE_MIN_OVERLAP, qMin(count, otherCount))) {
+		return false;
+	}
+	int errors = m_bitErrors(items(track) + start, items(other) + start + offset, overlap);
+	return errors <= overlap * 32 * DUPLICATE_MAX_BIT_ERROR_RATE;
+}
+
+QList<int> DuplicateIndex::findEarlier(int track, Stats *stats) const
+{
+	// Collect the postings of earlier tracks that share a bucket with the
+	// start of this one, the chains are ordered from the newest track
+	QVector<quint64> hits;
+	if (m_removed.at(track)) {
+		return matchHits(track, &hits, 0, stats);
+	}
+	const quint32 *values = items(track);
+	int count = qMin(itemCount(track), DUPLICATE_INDEX_ITEMS);
+	qint64 postings = 0;
+	for (int i = 0; i < count; i++) {
+		if (i > 0 && values[i] == values[i - 1]) {
+			continue;
+		}
+		int taken = 0;
+		for (int p = m_heads.at(bucket(values[i])); p != -1 && taken < DUPLICATE_MAX_POSTINGS; p = m_postings.at(p).next) {
+			postings++;
+			quint32 posting = m_postings.at(p).value;
+			if (int(posting >> 8) < track) {
+				hits.append(hitKey(posting, i));
+				taken++;
+			}
+		}
+	}
+	return matchHits(track, &hits, postings, stats);
+}
+
+QList<int> DuplicateIndex::findEarlier(int track, const SortedPostings &sorted, Stats *stats) const
+{
+	// Same as above, but every bucket is a sequential run of postings in
+	// the order of the tracks, the earlier tracks are the ones before the
+	// first posting of this track. The bounds of all runs are looked up
+	// first, so that those cache misses overlap.
+	QVector<quint64> hits;
+	if (m_removed.at(track)) {
+		return matchHits(track, &hits, 0, stats);
+	}
+	const quint32 *values = items(track);
+	int count = qMin(itemCount(track), DUPLICATE_INDEX_ITEMS);
+	int firsts[DUPLICATE_INDEX_ITEMS], lasts[DUPLICATE_INDEX_ITEMS];
+	for (int i = 0; i < count; i++) {
+		quint32 b = bucket(values[i]);
+		firsts[i] = sorted.starts.at(b);
+		lasts[i] = sorted.starts.at(b + 1);
+	}
+	qint64 postings = 0;
+	for (int i = 0; i < count; i++) {
+		if (i > 0 && values[i] == values[i - 1]) {
+			continue;
+		}
+		// The latest postings before the track, like the chains give them
+		const quint32 *run = sorted.values.constData();
+		int last = qLowerBound(run + firsts[i], run + lasts[i], quint32(track) << 8) - run;
+		int first = qMax(firsts[i], last - DUPLICATE_MAX_POSTINGS);
+		for (int p = last - 1; p >= first; p--) {
+			hits.append(hitKey(run[p], i));
+		}
+		postings += last - first;
+	}
+	return matchHits(track, &hits, postings, stats);
+}
+
+QList<int> DuplicateIndex::matchHits(int track, QVector<quint64> *hits, qint64 postings, Stats *stats) const
+{
+	// The hits are keyed by the track and the offset, so after sorting the
+	// hits of each alignment are next to each other
+	qSort(hits->begin(), hits->end());
+	QList<int> result;
+	int comparisons = 0;
+	for (int i = 0; i < hits->size(); ) {
+		int j = i + 1;
+		while (j < hits->size() && hits->at(j) == hits->at(i)) {
+			j++;
+		}
+		int other = int(hits->at(i) >> 32);
+		if (j - i >= DUPLICATE_MIN_HITS && (result.isEmpty() || result.last() != other)) {
+			comparisons++;
+			if (isDuplicate(track, other, int(hits->at(i) & 0xFFFFFFFF) - 256)) {
+				result.append(other);
+			}
+		}
+		i = j;
+	}
+
+	if (stats) {
+		stats->queries++;
+		stats->postings += postings;
+		stats->comparisons += comparisons;
+		stats->matches += result.size();
+	}
+	return result;
+}
+
+void DuplicateIndex::groupRange(const SortedPostings *sorted, QAtomicInt *next, QList<QPair<int, int> > *pairs, Stats *stats) const
+{
+	while (true) {
+		int first = next->fetchAndAddRelaxed(GROUP_CHUNK_SIZE);
+		if (first >= size()) {
+			break;
+		}
+		int last = qMin(size(), first + GROUP_CHUNK_SIZE);
+		for (int track = first; track < last; track++) {
+			foreach (int other, findEarlier(track, *sorted, stats)) {
+				pairs->append(qMakePair(other, track));
+			}
+		}
+	}
+}
+
+static int findRoot(QVector<int> &groups, int track)
+{
+	while (groups.at(track) != track) {
+		groups[track] = groups.at(groups.at(track));
+		track = groups.at(track);
+	}
+	return track;
+}
+
+QVector<int> DuplicateIndex::group(int threadCount, Stats *stats) const
+{
+	if (threadCount <= 0) {
+		threadCount = QThread::idealThreadCount();
+	}
+	// Chains are good for adding tracks one by one, but following them is
+	// a cache miss for every posting. For a pass over the whole library the
+	// postings are sorted by bucket first, the chains are in the order the
+	// tracks were added, so the sort is a stable counting sort.
+	SortedPostings sorted;
+	sorted.starts.fill(0, m_heads.size() + 1);
+	for (int p = 0; p < m_postings.size(); p++) {
+		sorted.starts[bucket(postingItem(m_postings.at(p).value)) + 1]++;
+	}
+	for (int b = 0; b < m_heads.size(); b++) {
+		sorted.starts[b + 1] += sorted.starts.at(b);
+	}
+	QVector<int> fill = sorted.starts;
+	sorted.values.resize(m_postings.size());
+	for (int p = 0; p < m_postings.size(); p++) {
+		quint32 posting = m_postings.at(p).value;
+		sorted.values[fill[bucket(postingItem(posting))]++] = posting;
+	}
+	fill.clear();
+
+	QAtomicInt next(0);
+	QVector<QList<QPair<int, int> > > pairs(threadCount);
+	QVector<Stats> threadStats(threadCount);
+
+	// The calling thread acts as the first worker
+	QList<GroupWorker *> workers;
+	for (int i = 1; i < threadCount; i++) {
+		GroupWorker *worker = new GroupWorker(this, &sorted, &next, &pairs[i], &threadStats[i]);
+		worker->start();
+		workers.append(worker);
+	}
+	groupRange(&sorted, &next, &pairs[0], &threadStats[0]);
+	foreach (GroupWorker *worker, workers) {
+		worker->wait();
+		delete worker;
+	}
+
+	// Merge the matching pairs, the root of each group is its first track
+	QVector<int> groups(size());
+	for (int i = 0; i < groups.size(); i++) {
+		groups[i] = i;
+	}
+	for (int i = 0; i < threadCount; i++) {
+		for (int j = 0; j < pairs.at(i).size(); j++) {
+			int a = findRoot(groups, pairs.at(i).at(j).first);
+			int b = findRoot(groups, pairs.at(i).at(j).second);
+			if (a != b) {
+				groups[qMax(a, b)] = qMin(a, b);
+			}
+		}
+	}
+	for (int i = 0; i < groups.size(); i++) {
+		groups[i] = findRoot(groups, i);
+	}
+
+	if (stats) {
+		for (int i = 0; i < threadCount; i++) {
+			stats->queries += threadStats.at(i).queries;
+			stats->postings += threadStats.at(i).postings;
+			stats->comparisons += threadStats.at(i).comparisons;
+			stats->matches += threadStats.at(i).matches;
+		}
+	}
+	return groups;
+}
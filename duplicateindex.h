@@ -0,0 +1,121 @@
+#ifndef FPSUBMIT_DUPLICATEINDEX_H_
+#define FPSUBMIT_DUPLICATEINDEX_H_
+
+#include <QVector>
+#include <QList>
+#include <QHash>
+#include <QPair>
+#include <QAtomicInt>
+#include "sampleconverter.h"
+
+// Finds copies of the same recording, rips, transcodes and compilation
+// tracks, among raw fingerprints. Only the start of each fingerprint is
+// kept. The items at the very start are indexed by their top bits, in
+// buckets of postings that record the track and the position. Another track
+// becomes a candidate once enough of its postings agree on the same offset
+// against the query, and candidates of similar length are then compared
+// bit by bit at that offset. Buckets are chains in flat arrays, so adding a
+// track never moves the existing ones, and the number of bits grows with the
+// library so that the chains stay short. Tracks are numbered from zero in
+// the order they were added, there can be at most 16M of them.
+//
+// A track can belong to a file. Adding a file again, e.g. after it was
+// retagged, removes its old track, which then never matches anything, and a
+// track never matches another one of the same file. Removed tracks keep
+// their items, so the index grows by about 1KB with every track added and
+// never shrinks.
+class DuplicateIndex
+{
+public:
+	static const quint32 NoFile = 0xFFFFFFFF;
+
+	struct Stats
+	{
+		Stats() : queries(0), postings(0), comparisons(0), matches(0) {}
+
+		qint64 queries;
+		// Postings visited while looking for candidates
+		qint64 postings;
+		// Candidates compared bit by bit
+		qint64 comparisons;
+		qint64 matches;
+	};
+
+	DuplicateIndex();
+
+	int size() const { return m_lengths.size(); }
+
+	// Adds the fingerprint of a track that is the given number of seconds long
+	// and returns its number, or -1 if the index is full. The previous track
+	// of the same file, if any, is removed.
+	int add(const QVector<quint32> &fingerprint, int length, quint32 file = NoFile);
+	bool isRemoved(int track) const { return m_removed.at(track); }
+
+	// Numbers of the tracks added before the given one that are duplicates of
+	// it. In a bucket shared by too many tracks, only the postings of the
+	// latest DUPLICATE_MAX_POSTINGS tracks before this one are considered.
+	QList<int> findEarlier(int track, Stats *stats = 0) const;
+
+	// Assigns every track to a group of duplicates, which is numbered after
+	// its first track. Removed tracks are in groups of their own. The tracks are split between the given number of
+	// threads, by default one per core.
+	QVector<int> group(int threadCount = 0, Stats *stats = 0) const;
+
+	// Kernel used for comparing fingerprints, the best one the CPU supports
+	// by default.
+	void setKernel(SampleConverter::Kernel kernel);
+	SampleConverter::Kernel kernel() const { return m_kernel; }
+
+	// Number of bits that differ between the two arrays.
+	static int bitErrors(const quint32 *a, const quint32 *b, int size, SampleConverter::Kernel kernel);
+
+private:
+	friend class GroupWorker;
+
+	typedef int (*BitErrorsFunc)(const quint32 *a, const quint32 *b, int size);
+
+	struct Posting
+	{
+		// Track number in the top 24 bits, position in the low 8 bits
+		quint32 value;
+		// Next posting in the same bucket, -1 ends the chain
+		int next;
+	};
+
+	// The postings of each bucket one after another, ordered by track
+	struct SortedPostings
+	{
+		QVector<int> starts;
+		QVector<quint32> values;
+	};
+
+	const quint32 *items(int track) const { return m_items.constData() + m_starts.at(track); }
+	int itemCount(int track) const { return m_starts.at(track + 1) - m_starts.at(track); }
+	quint32 bucket(quint32 value) const { return value >> (32 - m_bits); }
+	quint32 postingItem(quint32 posting) const { return items(posting >> 8)[posting & 0xFF]; }
+	// Sorts by the other track first, then by the offset
+	static quint64 hitKey(quint32 posting, int position) { return quint64(posting >> 8) << 32 | quint32(int(posting & 0xFF) - position + 256); }
+	void indexTrack(int track);
+	void rehash(int bits);
+	bool isDuplicate(int track, int other, int offset) const;
+	QList<int> findEarlier(int track, const SortedPostings &sorted, Stats *stats) const;
+	QList<int> matchHits(int track, QVector<quint64> *hits, qint64 postings, Stats *stats) const;
+	void groupRange(const SortedPostings *sorted, QAtomicInt *next, QList<QPair<int, int> > *pairs, Stats *stats) const;
+
+	// Start of each fingerprint, concatenated
+	QVector<quint32> m_items;
+	QVector<int> m_starts;
+	QVector<int> m_lengths;
+	QVector<quint32> m_files;
+	QVector<bool> m_removed;
+	// Current track of each file
+	QHash<quint32, int> m_fileTracks;
+	// First posting of each bucket
+	QVector<int> m_heads;
+	QVector<Posting> m_postings;
+	int m_bits;
+	SampleConverter::Kernel m_kernel;
+	BitErrorsFunc m_bitErrors;
+};
+
+#endif
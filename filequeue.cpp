@@ -0,0 +1,271 @@
+#include <QMutexLocker>
+#include <QString>
+#include <QFile>
+#include <QDebug>
+#ifdef Q_OS_LINUX
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+#include "constants.h"
+#include "pathstore.h"
+#include "filequeue.h"
+
+FileQueue::FileQueue(int capacity, Order order)
+	: m_nextDevice(0), m_size(0), m_deviceConcurrency(0), m_order(order), m_capacity(capacity),
+	  m_totalCount(0), m_closed(false)
+{
+}
+
+FileQueue::~FileQueue()
+{
+	qDeleteAll(m_devices);
+}
+
+FileQueue::Order FileQueue::order() const
+{
+	return m_order;
+}
+
+FileQueue::Order FileQueue::orderFromString(const QString &name)
+{
+	if (name == "inode") {
+		return InodeOrder;
+	}
+	if (name == "extent") {
+		return ExtentOrder;
+	}
+	return ListingOrder;
+}
+
+QString FileQueue::orderName(Order order)
+{
+	switch (order) {
+	case InodeOrder:
+		return "inode";
+	case ExtentOrder:
+		return "extent";
+	default:
+		return "listing";
+	}
+}
+
+quint64 FileQueue::sortKey(const QByteArray &encodedPath, const FileState &state, Order order)
+{
+#ifdef Q_OS_LINUX
+	if (order == ExtentOrder) {
+		int fd = open(encodedPath.constData(), O_RDONLY | O_CLOEXEC);
+		if (fd != -1) {
+			struct {
+				struct fiemap map;
+				struct fiemap_extent extent;
+			} request;
+			memset(&request, 0, sizeof(request));
+			request.map.fm_start = 0;
+			request.map.fm_length = FIEMAP_MAX_OFFSET;
+			request.map.fm_extent_count = 1;
+			int result = ioctl(fd, FS_IOC_FIEMAP, &request.map);
+			close(fd);
+			if (result == 0 && request.map.fm_mapped_extents > 0 &&
+			    !(request.extent.fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+				return request.extent.fe_physical;
+			}
+		}
+	}
+#endif
+	Q_UNUSED(encodedPath);
+	Q_UNUSED(order);
+	return state.inode;
+}
+
+int FileQueue::deviceConcurrency(const QByteArray &encodedPath, quint64 device)
+{
+#ifdef Q_OS_LINUX
+	struct statfs st;
+	if (statfs(encodedPath.constData(), &st) == 0) {
+		switch (static_cast<quint32>(st.f_type)) {
+		case 0x6969:     // NFS
+		case 0x517B:     // SMB
+		case 0xFF534D42: // CIFS
+		case 0xFE534D42: // SMB2
+		case 0x00C36400: // Ceph
+		case 0x5346414F: // AFS
+		case 0x65735546: // FUSE, usually sshfs or similar
+			return MAX_ACTIVE_FILES_NETWORK;
+		}
+	}
+	// Partitions don't have their own queue attributes, their parent does
+	QString sysfsPath = QString("/sys/dev/block/%1:%2/").arg(major(device)).arg(minor(device));
+	QFile file(sysfsPath + "queue/rotational");
+	if (!file.exists()) {
+		file.setFileName(sysfsPath + "../queue/rotational");
+	}
+	if (file.open(QIODevice::ReadOnly)) {
+		return file.readAll().trimmed() == "0" ? MAX_ACTIVE_FILES_SOLID_STATE : MAX_ACTIVE_FILES_ROTATIONAL;
+	}
+#endif
+	Q_UNUSED(encodedPath);
+	Q_UNUSED(device);
+	return MAX_ACTIVE_FILES;
+}
+
+void FileQueue::setDeviceConcurrency(int limit)
+{
+	QMutexLocker locker(&m_mutex);
+	m_deviceConcurrency = limit;
+	foreach (DeviceQueue *device, m_devices) {
+		device->limit = limit;
+	}
+}
+
+bool FileQueue::push(const QList<Entry> &entries)
+{
+	// Find out the limits of devices we didn't see yet before taking the
+	// lock, it can take a while on network filesystems
+	QHash<quint64, quint32> newDevices;
+	m_mutex.lock();
+	bool fixedLimit = m_deviceConcurrency > 0;
+	foreach (const Entry &entry, entries) {
+		if (!m_devices.contains(entry.state.device)) {
+			newDevices.insert(entry.state.device, entry.file);
+		}
+	}
+	m_mutex.unlock();
+	QHash<quint64, int> limits;
+	if (!fixedLimit) {
+		QHash<quint64, quint32>::const_iterator it;
+		for (it = newDevices.constBegin(); it != newDevices.constEnd(); ++it) {
+			QByteArray encodedPath = PathStore::instance()->encodedPath(it.value());
+			int limit = deviceConcurrency(encodedPath, it.key());
+			qDebug() << "Reading up to" << limit << "files at once from the device of" << PathStore::decodeName(encodedPath);
+			limits.insert(it.key(), limit);
+		}
+	}
+
+	QMutexLocker locker(&m_mutex);
+	while (!m_closed && m_size >= m_capacity) {
+		m_notFull.wait(&m_mutex);
+	}
+	if (m_closed) {
+		return false;
+	}
+	foreach (const Entry &entry, entries) {
+		DeviceQueue *device = m_devices.value(entry.state.device);
+		if (!device) {
+			device = new DeviceQueue();
+			device->limit = m_deviceConcurrency > 0 ? m_deviceConcurrency : limits.value(entry.state.device, MAX_ACTIVE_FILES);
+			m_devices.insert(entry.state.device, device);
+			m_deviceOrder.append(entry.state.device);
+		}
+		if (m_order != ListingOrder) {
+			device->sortedFiles.insert(entry.key, entry);
+		}
+		else {
+			device->files.append(entry);
+		}
+	}
+	m_size += entries.size();
+	m_totalCount += entries.size();
+	return true;
+}
+
+void FileQueue::close()
+{
+	QMutexLocker locker(&m_mutex);
+	m_closed = true;
+	foreach (DeviceQueue *device, m_devices) {
+		device->files.clear();
+		device->sortedFiles.clear();
+	}
+	m_size = 0;
+	m_notFull.wakeAll();
+}
+
+bool FileQueue::take(quint32 *file, FileState *state)
+{
+	QMutexLocker locker(&m_mutex);
+	if (m_size == 0) {
+		return false;
+	}
+	// Round-robin over the devices that have both pending files and a free slot
+	for (int i = 0; i < m_deviceOrder.size(); i++) {
+		int index = (m_nextDevice + i) % m_deviceOrder.size();
+		quint64 id = m_deviceOrder.at(index);
+		DeviceQueue *device = m_devices.value(id);
+		if (device->active >= device->limit) {
+			continue;
+		}
+		Entry entry;
+		if (!device->sortedFiles.isEmpty()) {
+			// Continue the sweep from the last file handed out
+			QMultiMap<quint64, Entry>::iterator it = device->sortedFiles.lowerBound(device->position);
+			if (it == device->sortedFiles.end()) {
+				it = device->sortedFiles.begin();
+			}
+			device->position = it.key();
+			entry = it.value();
+			device->sortedFiles.erase(it);
+		}
+		else if (!device->files.isEmpty()) {
+			entry = device->files.takeFirst();
+		}
+		else {
+			continue;
+		}
+		*file = entry.file;
+		if (state) {
+			*state = entry.state;
+		}
+		device->active++;
+		m_activeFiles.insertMulti(*file, id);
+		m_nextDevice = index + 1;
+		if (--m_size < m_capacity) {
+			m_notFull.wakeAll();
+		}
+		return true;
+	}
+	return false;
+}
+
+void FileQueue::release(quint32 file)
+{
+	QMutexLocker locker(&m_mutex);
+	QHash<quint32, quint64>::iterator it = m_activeFiles.find(file);
+	if (it == m_activeFiles.end()) {
+		return;
+	}
+	DeviceQueue *device = m_devices.value(it.value());
+	if (device) {
+		device->active--;
+	}
+	m_activeFiles.erase(it);
+}
+
+bool FileQueue::isEmpty() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_size == 0;
+}
+
+bool FileQueue::isClosed() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_closed;
+}
+
+int FileQueue::size() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_size;
+}
+
+int FileQueue::totalCount() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_totalCount;
+}
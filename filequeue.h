@@ -0,0 +1,102 @@
+#ifndef FPSUBMIT_FILEQUEUE_H_
+#define FPSUBMIT_FILEQUEUE_H_
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QList>
+#include <QHash>
+#include <QMultiMap>
+#include "filestatecache.h"
+
+// Bounded queue of files waiting to be fingerprinted. The file list loaders
+// push batches of files into it while they are still scanning and block when
+// the queue is full, the fingerprinter takes files out of it one by one.
+// Files are referred to by their handles in the path store.
+//
+// Each device gets its own queue and a limit on how many of its files can
+// be read at the same time, depending on whether it's a rotational disk,
+// an SSD or a network share. Files are taken from the devices in turns,
+// skipping those that are already busy, so a slow device doesn't hold back
+// the fast ones and no device gets more readers than it can handle.
+//
+// Within a device, files are handed out in the order they were found, or
+// sorted by where they are stored on the disk. Sorted files are taken in
+// one sweep across the disk, wrapping around at the end, so the files being
+// read at the same time are close to each other instead of making the disk
+// seek between them.
+class FileQueue
+{
+public:
+	enum Order
+	{
+		ListingOrder,
+		InodeOrder,
+		ExtentOrder
+	};
+
+	struct Entry
+	{
+		quint32 file;
+		// As seen by the scan, the device is the one the file is queued for
+		FileState state;
+		quint64 key;
+	};
+
+	FileQueue(int capacity, Order order = ListingOrder);
+	~FileQueue();
+
+	Order order() const;
+	static Order orderFromString(const QString &name);
+	static QString orderName(Order order);
+	// Sort key of the file for the given order, the physical offset of its
+	// first extent if the filesystem can report it, otherwise the inode.
+	static quint64 sortKey(const QByteArray &encodedPath, const FileState &state, Order order);
+
+	// Uses the same limit for all devices, instead of one based on the
+	// device type.
+	void setDeviceConcurrency(int limit);
+
+	// Blocks while the queue is full. Returns false if the queue was closed.
+	bool push(const QList<Entry> &entries);
+	// Drops all pending files and wakes up a blocked producer.
+	void close();
+
+	// Returns false if there are no files, or all devices with pending
+	// files are busy. Every taken file must be released when it's done.
+	bool take(quint32 *file, FileState *state = 0);
+	void release(quint32 file);
+
+	bool isEmpty() const;
+	bool isClosed() const;
+	int size() const;
+	int totalCount() const;
+
+private:
+	struct DeviceQueue
+	{
+		DeviceQueue() : position(0), active(0), limit(0) {}
+
+		QList<Entry> files;
+		QMultiMap<quint64, Entry> sortedFiles;
+		quint64 position;
+		int active;
+		int limit;
+	};
+
+	static int deviceConcurrency(const QByteArray &encodedPath, quint64 device);
+
+	mutable QMutex m_mutex;
+	QWaitCondition m_notFull;
+	QHash<quint64, DeviceQueue *> m_devices;
+	QList<quint64> m_deviceOrder;
+	QHash<quint32, quint64> m_activeFiles;
+	int m_nextDevice;
+	int m_size;
+	int m_deviceConcurrency;
+	Order m_order;
+	int m_capacity;
+	int m_totalCount;
+	bool m_closed;
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDebug>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "filestatecache.h"
+
+static const char *FILE_STATE_CACHE_MAGIC = "AIDFILES";
+static const quint32 FILE_STATE_CACHE_VERSION = 1;
+static const quint32 MIN_FILE_STATE_CACHE_CAPACITY = 1 << 16;
+
+FileState FileState::fromPath(const QString &path)
+{
+	FileState state;
+#ifdef Q_OS_WIN32
+	QFileInfo fileInfo(path);
+	if (fileInfo.exists()) {
+		state.size = fileInfo.size();
+		state.mtime = qint64(fileInfo.lastModified().toTime_t()) * 1000000000;
+	}
+#else
+	struct stat st;
+	if (stat(QFile::encodeName(path).constData(), &st) == 0) {
+		state.device = st.st_dev;
+		state.inode = st.st_ino;
+		state.size = st.st_size;
+#ifdef Q_OS_LINUX
+		state.mtime = qint64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+		state.mtime = qint64(st.st_mtime) * 1000000000;
+#endif
+	}
+#endif
+	return state;
+}
+
+Q_GLOBAL_STATIC(FileStateCache, globalFileStateCache)
+
+FileStateCache *FileStateCache::instance()
+{
+	return globalFileStateCache();
+}
+
+FileStateCache::FileStateCache()
+	: m_fileName(QDir::cleanPath(cacheFileName() + "/../files.idx")),
+	  m_table(FILE_STATE_CACHE_MAGIC, FILE_STATE_CACHE_VERSION), m_opened(false)
+{
+}
+
+FileStateCache::~FileStateCache()
+{
+}
+
+bool FileStateCache::open()
+{
+	m_opened = true;
+	QDir().mkpath(QDir::cleanPath(m_fileName + "/.."));
+	if (m_table.open(m_fileName)) {
+		return true;
+	}
+	qDebug() << "Creating new file state cache" << m_fileName;
+	return m_table.create(m_fileName, MIN_FILE_STATE_CACHE_CAPACITY);
+}
+
+quint64 FileStateCache::keyHash(const FileState &state, quint64 pathHash)
+{
+	// Without inode numbers (Windows) the best we can do is to key by path
+	if (!state.inode) {
+		return pathHash;
+	}
+	quint64 key[2] = { state.device, state.inode };
+	return hashBytes(reinterpret_cast<const char *>(key), sizeof(key));
+}
+
+FileStateCache::Slot *FileStateCache::find(quint64 hash, const FileState &state, quint64 pathHash)
+{
+	for (quint32 i = m_table.firstSlot(hash); m_table.slot(i)->hash; i = m_table.nextSlot(i)) {
+		Slot *slot = m_table.slot(i);
+		if (slot->hash != hash) {
+			continue;
+		}
+		if (state.inode ? (slot->device == state.device && slot->inode == state.inode) : slot->pathHash == pathHash) {
+			return slot;
+		}
+	}
+	return 0;
+}
+
+FileStateCache::Status FileStateCache::classify(const QString &path, const FileState &state, Outcome *outcome)
+{
+	QByteArray encodedPath = path.toUtf8();
+	quint64 pathHash = hashBytes(encodedPath.constData(), encodedPath.size());
+	quint64 hash = keyHash(state, pathHash);
+
+	m_lock.lockForRead();
+	if (!m_opened) {
+		m_lock.unlock();
+		m_lock.lockForWrite();
+		if (!m_opened) {
+			open();
+		}
+	}
+	Slot *slot = m_table.isOpen() ? find(hash, state, pathHash) : 0;
+	if (!slot) {
+		m_lock.unlock();
+		return New;
+	}
+	if (outcome) {
+		*outcome = Outcome(slot->outcome);
+	}
+	if (slot->size != state.size || slot->mtime != state.mtime) {
+		m_lock.unlock();
+		return Modified;
+	}
+	if (slot->pathHash == pathHash) {
+		m_lock.unlock();
+		return Unchanged;
+	}
+	m_lock.unlock();
+
+	QWriteLocker locker(&m_lock);
+	slot = find(hash, state, pathHash);
+	if (slot) {
+		slot->pathHash = pathHash;
+	}
+	return Moved;
+}
+
+void FileStateCache::update(const QString &path, const FileState &state, Outcome outcome)
+{
+	if (!state.isValid()) {
+		return;
+	}
+	QByteArray encodedPath = path.toUtf8();
+	quint64 pathHash = hashBytes(encodedPath.constData(), encodedPath.size());
+	quint64 hash = keyHash(state, pathHash);
+
+	QWriteLocker locker(&m_lock);
+	if (!m_opened) {
+		open();
+	}
+	if (!m_table.isOpen()) {
+		return;
+	}
+	Slot *slot = find(hash, state, pathHash);
+	if (!slot) {
+		slot = m_table.insert(hash);
+		if (!slot) {
+			return;
+		}
+	}
+	slot->device = state.device;
+	slot->inode = state.inode;
+	slot->size = state.size;
+	slot->mtime = state.mtime;
+	slot->pathHash = pathHash;
+	slot->outcome = outcome;
+}
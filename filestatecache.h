@@ -0,0 +1,82 @@
+#ifndef FPSUBMIT_FILESTATECACHE_H_
+#define FPSUBMIT_FILESTATECACHE_H_
+
+#include <QReadWriteLock>
+#include <QString>
+#include "mappedtable.h"
+
+// Identity and version of a file, as seen by stat().
+struct FileState
+{
+	FileState() : device(0), inode(0), size(-1), mtime(0)
+	{
+	}
+
+	static FileState fromPath(const QString &path);
+
+	bool isValid() const { return size >= 0; }
+
+	quint64 device;
+	quint64 inode;
+	qint64 size;
+	qint64 mtime;
+};
+
+// Persistent record of every file that went through the fingerprinter,
+// keyed by device and inode number. It lets a rescan tell from stat() data
+// alone whether a file is new, was modified since it was last analyzed, or
+// is the same file as before, possibly under a different name.
+class FileStateCache
+{
+public:
+	enum Status
+	{
+		New,
+		Unchanged,
+		Moved,
+		Modified
+	};
+
+	enum Outcome
+	{
+		Unknown = 0,
+		Submitted = 1,
+		Failed = 2,
+		// Not submitted, another copy of the same recording was
+		Duplicate = 3
+	};
+
+	FileStateCache();
+	~FileStateCache();
+
+	static FileStateCache *instance();
+
+	// Compares the file with its last record and returns the outcome of the
+	// last analysis. Moved files get their record updated to the new path.
+	Status classify(const QString &path, const FileState &state, Outcome *outcome = 0);
+	void update(const QString &path, const FileState &state, Outcome outcome);
+
+private:
+	struct Slot
+	{
+		quint64 hash;
+		quint64 device;
+		quint64 inode;
+		qint64 size;
+		qint64 mtime;
+		quint64 pathHash;
+		quint32 outcome;
+		quint32 reserved;
+	};
+
+	bool open();
+	Slot *find(quint64 hash, const FileState &state, quint64 pathHash);
+	static quint64 keyHash(const FileState &state, quint64 pathHash);
+
+	QReadWriteLock m_lock;
+	QString m_fileName;
+	MappedTable<Slot> m_table;
+	bool m_opened;
+};
+
+#endif
@@ -1,18 +1,78 @@
 #include <stdlib.h>
+#include <QtAlgorithms>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QThreadStorage>
 #include "fingerprintcalculator.h"
 
-QMutex FingerprintCalculator::m_mutex;
+// Creating and freeing contexts is not thread-safe, FFTW's planner isn't
+static QMutex contextMutex;
+static QAtomicInt contextCounter;
+
+static ChromaprintContext *createContext()
+{
+    QMutexLocker locker(&contextMutex);
+    contextCounter.ref();
+    return chromaprint_new(CHROMAPRINT_ALGORITHM_DEFAULT);
+}
+
+static void freeContext(ChromaprintContext *context)
+{
+    QMutexLocker locker(&contextMutex);
+    chromaprint_free(context);
+}
+
+struct LocalContext
+{
+    LocalContext() : context(createContext()), busy(false) {}
+    ~LocalContext() { freeContext(context); }
+
+    ChromaprintContext *context;
+    bool busy;
+};
+
+// Freed when the thread exits
+Q_GLOBAL_STATIC(QThreadStorage<LocalContext *>, localContexts)
 
 FingerprintCalculator::FingerprintCalculator()
+    : m_context(0), m_local(0)
 {
-    QMutexLocker locker(&m_mutex);
-    m_context = chromaprint_new(CHROMAPRINT_ALGORITHM_DEFAULT);
+    QThreadStorage<LocalContext *> *storage = localContexts();
+    if (!storage->hasLocalData()) {
+        storage->setLocalData(new LocalContext());
+    }
+    LocalContext *local = storage->localData();
+    if (local->busy) {
+        m_context = createContext();
+        return;
+    }
+    local->busy = true;
+    m_local = local;
+    m_context = local->context;
 }
 
 FingerprintCalculator::~FingerprintCalculator()
 {
-    QMutexLocker locker(&m_mutex);
-    chromaprint_free(m_context);
+    if (m_local) {
+        m_local->busy = false;
+    }
+    else {
+        freeContext(m_context);
+    }
+}
+
+void FingerprintCalculator::freeLocal()
+{
+    QThreadStorage<LocalContext *> *storage = localContexts();
+    if (storage->hasLocalData() && !storage->localData()->busy) {
+        // Deletes the old context
+        storage->setLocalData(0);
+    }
+}
+
+int FingerprintCalculator::contextCount()
+{
+    return contextCounter;
 }
 
 bool FingerprintCalculator::start(int sampleRate, int numChannels)
@@ -25,16 +85,53 @@ void FingerprintCalculator::feed(qint16 *data, int size)
     chromaprint_feed(m_context, data, size);
 }
 
-QString FingerprintCalculator::finish()
+// The pointer type of the output argument differs between chromaprint versions
+template <typename T>
+static int getRawFingerprint(int (*function)(ChromaprintContext *, T **, int *), ChromaprintContext *context, quint32 **data, int *size)
 {
-    char *fingerprint;
+    T *result = 0;
+    int ok = function(context, &result, size);
+    *data = reinterpret_cast<quint32 *>(result);
+    return ok;
+}
 
-    chromaprint_finish(m_context);
-    chromaprint_get_fingerprint(m_context, &fingerprint);
+QVector<quint32> FingerprintCalculator::rawFingerprint()
+{
+    quint32 *data = 0;
+    int size = 0;
+    QVector<quint32> result;
+    if (getRawFingerprint(chromaprint_get_raw_fingerprint, m_context, &data, &size) && data) {
+        result.resize(size);
+        qCopy(data, data + size, result.begin());
+    }
+    free(data);
+    return result;
+}
 
-    QString result(fingerprint);
-    free(fingerprint);
+bool FingerprintCalculator::finish()
+{
+    return chromaprint_finish(m_context);
+}
+
+// The pointer types of the arguments differ between chromaprint versions
+template <typename T, typename U>
+static int encodeFingerprint(int (*function)(T *, int, int, U **, int *, int), const quint32 *data, int size, char **encoded, int *encodedSize)
+{
+    U *result = 0;
+    int ok = function((T *)data, size, CHROMAPRINT_ALGORITHM_DEFAULT, &result, encodedSize, 1);
+    *encoded = reinterpret_cast<char *>(result);
+    return ok;
+}
 
+QString FingerprintCalculator::encode(const QVector<quint32> &fingerprint)
+{
+    char *encoded = 0;
+    int size = 0;
+    QString result;
+    if (encodeFingerprint(chromaprint_encode_fingerprint, fingerprint.constData(), fingerprint.size(), &encoded, &size) && encoded) {
+        result = QString::fromAscii(encoded, size);
+    }
+    free(encoded);
     return result;
 }
 
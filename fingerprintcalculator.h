@@ -2,10 +2,17 @@
 #define FPSUBMIT_FINGERPRINTCALCULATOR_H_
 
 #include <QString>
-#include <QMutex>
+#include <QVector>
 #include <chromaprint.h>
+#include "audioconsumer.h"
 
-class FingerprintCalculator {
+struct LocalContext;
+
+// Calculates the fingerprint of a file. Chromaprint contexts are expensive
+// to create, they allocate FFT plans and buffers, and creating them has to
+// be serialized, so each thread keeps one and the calculators on that
+// thread reuse it for file after file.
+class FingerprintCalculator : public AudioConsumer {
 
 public:
     FingerprintCalculator();
@@ -13,11 +20,23 @@ public:
 
     bool start(int sampleRate, int numChannels);
     void feed(qint16 *data, int size);
-    QString finish();
+    bool finish();
+    // Uncompressed fingerprint, only valid after finish().
+    QVector<quint32> rawFingerprint();
+
+    // Compressed and base64-encoded form of a raw fingerprint, as submitted
+    // to the server.
+    static QString encode(const QVector<quint32> &fingerprint);
+
+    // Frees the calling thread's context, the next calculator creates a new one.
+    static void freeLocal();
+    // Number of contexts created so far.
+    static int contextCount();
 
 private:
-    ChromaprintContext *m_context;    
-    static QMutex m_mutex;
+    ChromaprintContext *m_context;
+    // The thread's context, or null if it was busy and m_context is our own
+    LocalContext *m_local;
 };
 
 #endif
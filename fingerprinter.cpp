@@ -8,9 +8,17 @@
 #include <QDesktopServices>
 #include <QMutexLocker>
 #include <QThreadPool>
+#include <QSettings>
 #include "loadfilelisttask.h"
+#include "filequeue.h"
+#include "directorywatcher.h"
 #include "analyzefiletask.h"
-#include "updatelogfiletask.h"
+#include "analysispipeline.h"
+#include "resultcache.h"
+#include "duplicateindex.h"
+#include "fingerprintcalculator.h"
+#include "logwriter.h"
+#include "pathstore.h"
 #include "fingerprinter.h"
 #include "constants.h"
 #include "utils.h"
@@ -58,10 +66,33 @@ private:
 	QNetworkProxy m_httpProxy;
 };
 
-Fingerprinter::Fingerprinter(const QString &apiKey, const QStringList &directories)
+Fingerprinter::Fingerprinter(const QString &apiKey, const QStringList &directories, bool watch)
     : m_apiKey(apiKey), m_directories(directories), m_paused(false), m_cancelled(false),
-	  m_finished(false), m_reply(0), m_activeFiles(0), m_fingerprintedFiles(0), m_submittedFiles(0)
+	  m_finished(false), m_fingerprintingStarted(false), m_watching(watch), m_rescanPending(false),
+	  m_watcher(0), m_pipeline(0), m_duplicates(0), m_duplicateFiles(0), m_reply(0), m_activeFiles(0), m_loadingTasks(0), m_fingerprintedFiles(0),
+	  m_fileCount(0), m_submittedFiles(0)
 {
+	FileQueue::Order order = FileQueue::orderFromString(QSettings().value("queue/order").toString());
+	m_files = QSharedPointer<FileQueue>(new FileQueue(MAX_QUEUED_FILES, order));
+	m_analyzeOptions = AnalyzeOptions::fromSettings();
+	// Looked up and filled by the analysis threads, the log writer drops
+	// the results once they are submitted
+	if (QSettings().value("analysis/resultcache", true).toBool()) {
+		m_analyzeOptions.resultCache = ResultCache::instance();
+	}
+	// Lives as long as the fingerprinter and takes about 1KB per analyzed
+	// file, which adds up when watching a large library for a long time
+	if (QSettings().value("submit/skipduplicates", false).toBool()) {
+		m_duplicates = new DuplicateIndex();
+	}
+	if (QSettings().value("analysis/pipeline", true).toBool()) {
+		m_pipeline = new AnalysisPipeline(m_analyzeOptions);
+		connect(m_pipeline, SIGNAL(resultsAvailable()), SLOT(onResultsAvailable()), Qt::QueuedConnection);
+		m_maxActiveFiles = m_pipeline->capacity();
+	}
+	else {
+		m_maxActiveFiles = qMax(MAX_ACTIVE_FILES, QThreadPool::globalInstance()->maxThreadCount());
+	}
 	m_networkAccessManager = new QNetworkAccessManager(this);
 	m_networkAccessManager->setProxyFactory(new NetworkProxyFactory());
 	connect(m_networkAccessManager, SIGNAL(finished(QNetworkReply *)), SLOT(onRequestFinished(QNetworkReply*)));
@@ -69,19 +100,63 @@ Fingerprinter::Fingerprinter(const QString &apiKey, const QStringList &directori
 
 Fingerprinter::~Fingerprinter()
 {
+	m_files->close();
+	delete m_pipeline;
+	delete m_duplicates;
+	qDeleteAll(m_submitQueue);
 }
 
 void Fingerprinter::start()
 {
 	m_time.start();
-	LoadFileListTask *task = new LoadFileListTask(m_directories);
-	connect(task, SIGNAL(finished(const QStringList &)), SLOT(onFileListLoaded(const QStringList &)), Qt::QueuedConnection);
+	if (m_watching) {
+		// Start watching before the initial scan, so that nothing added
+		// in the meantime is missed
+		m_watcher = new DirectoryWatcher(m_directories, this);
+		connect(m_watcher, SIGNAL(filesChanged(const QStringList &)), SLOT(onFilesChanged(const QStringList &)));
+		connect(m_watcher, SIGNAL(rescanNeeded()), SLOT(onRescanNeeded()));
+		m_watcher->start();
+	}
+	emit fileListLoadingStarted();
+	loadFiles(m_directories);
+}
+
+void Fingerprinter::loadFiles(const QStringList &directories, const QStringList &files)
+{
+	m_loadingTasks++;
+	LoadFileListTask *task = new LoadFileListTask(directories, m_files);
+	if (!files.isEmpty()) {
+		task->setFiles(files);
+	}
+	connect(task, SIGNAL(filesAvailable()), SLOT(onFilesAvailable()), Qt::QueuedConnection);
+	connect(task, SIGNAL(finished()), SLOT(onFileListLoaded()), Qt::QueuedConnection);
 	connect(task, SIGNAL(currentPathChanged(const QString &)), SIGNAL(currentPathChanged(const QString &)), Qt::QueuedConnection);
 	task->setAutoDelete(true);
-	emit fileListLoadingStarted();
 	QThreadPool::globalInstance()->start(task);
 }
 
+void Fingerprinter::onFilesChanged(const QStringList &files)
+{
+	if (isCancelled()) {
+		return;
+	}
+	loadFiles(QStringList(), files);
+}
+
+void Fingerprinter::onRescanNeeded()
+{
+	if (isCancelled()) {
+		return;
+	}
+	// Rescanning is cheap thanks to the caches, but there's no point in
+	// running more than one scan at a time
+	if (m_loadingTasks > 0) {
+		m_rescanPending = true;
+		return;
+	}
+	loadFiles(m_directories);
+}
+
 void Fingerprinter::pause()
 {
 	m_paused = true;
@@ -90,20 +165,28 @@ void Fingerprinter::pause()
 void Fingerprinter::resume()
 {
 	m_paused = false;
-	while (!m_files.isEmpty() && m_activeFiles < MAX_ACTIVE_FILES) {
-		fingerprintNextFile();
-	}
+	fingerprintNextFiles();
 	maybeSubmit();
+	checkFinished();
 }
 
 void Fingerprinter::cancel()
 {
 	m_cancelled = true;
-	m_files.clear();
+	m_watching = false;
+	if (m_watcher) {
+		m_watcher->stop();
+	}
+	m_files->close();
+	if (m_pipeline) {
+		m_pipeline->cancel();
+	}
+	qDeleteAll(m_submitQueue);
 	m_submitQueue.clear();
 	if (m_reply) {
 		m_reply->abort();
 	}
+	checkFinished();
 }
 
 bool Fingerprinter::isPaused()
@@ -121,68 +204,185 @@ bool Fingerprinter::isFinished()
 	return m_finished;
 }
 
+bool Fingerprinter::isWatching()
+{
+	return m_watching;
+}
+
 bool Fingerprinter::isRunning()
 {
 	return !isPaused() && !isCancelled() && !isFinished();
 }
 
-void Fingerprinter::onFileListLoaded(const QStringList &files)
+bool Fingerprinter::hasPendingFiles()
 {
-	m_files = files;
-	if (m_files.isEmpty()) {
+	return m_loadingTasks > 0 || !m_files->isEmpty();
+}
+
+void Fingerprinter::checkFinished()
+{
+	if (m_finished || m_activeFiles > 0 || hasPendingFiles()) {
+		return;
+	}
+	if (m_watching) {
+		if (isRunning()) {
+			maybeSubmit(true);
+		}
+		emit statusChanged(tr("Waiting for new files..."));
+		return;
+	}
+	if (m_submitQueue.isEmpty() && !m_reply) {
+		if (m_pipeline) {
+			m_pipeline->logStats();
+		}
+		if (m_duplicates) {
+			qDebug() << "Skipped" << m_duplicateFiles << "duplicates of" << m_duplicates->size() - m_duplicateFiles << "files";
+		}
 		m_finished = true;
-		emit noFilesError();
 		emit finished();
 		return;
 	}
-	emit fingerprintingStarted(files.size());
-	while (!m_files.isEmpty() && m_activeFiles < MAX_ACTIVE_FILES) {
-		fingerprintNextFile();
+	if (!isCancelled()) {
+		maybeSubmit(true);
+	}
+}
+
+void Fingerprinter::onFilesAvailable()
+{
+	if (isCancelled()) {
+		return;
+	}
+	int fileCount = m_files->totalCount();
+	if (fileCount == m_fileCount) {
+		return;
+	}
+	m_fileCount = fileCount;
+	if (!m_fingerprintingStarted) {
+		m_fingerprintingStarted = true;
+		qDebug() << "First files available after" << m_time.elapsed() << "ms";
+		emit fingerprintingStarted(m_fileCount);
+	}
+	else {
+		emit fileCountChanged(m_fileCount);
+		if (m_watching) {
+			emit statusChanged(tr("Fingerprinting..."));
+		}
+	}
+	if (isRunning()) {
+		fingerprintNextFiles();
 	}
 }
 
-void Fingerprinter::fingerprintNextFile()
+void Fingerprinter::onFileListLoaded()
 {
-	if (m_files.isEmpty()) {
+	m_loadingTasks--;
+	qDebug() << "File list loaded after" << m_time.elapsed() << "ms";
+	onFilesAvailable();
+	if (isCancelled()) {
+		checkFinished();
+		return;
+	}
+	if (m_rescanPending && m_loadingTasks == 0) {
+		m_rescanPending = false;
+		loadFiles(m_directories);
+	}
+	if (m_fileCount == 0 && !m_watching && !hasPendingFiles()) {
+		m_finished = true;
+		emit noFilesError();
+		emit finished();
 		return;
 	}
+	checkFinished();
+}
+
+void Fingerprinter::fingerprintNextFiles()
+{
+	// The queue enforces the per-device limits, this only keeps us from
+	// queueing up more files than the pipeline or the thread pool can work on
+	while (m_activeFiles < m_maxActiveFiles && fingerprintNextFile()) {
+	}
+}
+
+bool Fingerprinter::fingerprintNextFile()
+{
+	quint32 file;
+	FileState state;
+	if (!m_files->take(&file, &state)) {
+		return false;
+	}
 	m_activeFiles++;
-	QString path = m_files.takeFirst();
-	emit currentPathChanged(path);
-	AnalyzeFileTask *task = new AnalyzeFileTask(path);
+	emit currentPathChanged(PathStore::instance()->path(file));
+	if (m_pipeline) {
+		m_pipeline->submit(file, state);
+		return true;
+	}
+	AnalyzeFileTask *task = new AnalyzeFileTask(file, state, m_analyzeOptions);
 	connect(task, SIGNAL(finished(AnalyzeResult *)), SLOT(onFileAnalyzed(AnalyzeResult *)), Qt::QueuedConnection);
 	task->setAutoDelete(true);
 	QThreadPool::globalInstance()->start(task);
+	return true;
 }
 
 void Fingerprinter::onFileAnalyzed(AnalyzeResult *result)
 {
 	m_activeFiles--;
-	emit progress(++m_fingerprintedFiles);
+	m_files->release(result->file);
+	if (++m_fingerprintedFiles == 1) {
+		qDebug() << "First file analyzed after" << m_time.elapsed() << "ms";
+	}
+	emit progress(m_fingerprintedFiles);
 	if (!result->error) {
-		if (!isCancelled()) {
+		// Only the first file of each group of duplicates is submitted
+		if (m_duplicates && isDuplicate(result)) {
+			qDebug() << "Not submitting" << PathStore::instance()->path(result->file) << "it's a duplicate";
+			LogWriter::instance()->duplicate(result->file, result->fileState);
+			m_duplicateFiles++;
+			delete result;
+		}
+		else if (!isCancelled()) {
 			m_submitQueue.append(result);
 		}
+		else {
+			delete result;
+		}
 		if (isRunning()) {
 			maybeSubmit();
 		}
 	}
 	else {
-		qDebug() << "Error" << result->errorMessage << "while processing" << result->fileName;
+		// After cancelling, the pipeline reports the files it skipped as errors
+		if (!isCancelled()) {
+			qDebug() << "Error" << result->errorMessage << "while processing" << PathStore::instance()->path(result->file);
+			// Files that aren't recorded are tried again by the next scan
+			if (!result->retry) {
+				LogWriter::instance()->failed(result->file, result->fileState);
+			}
+		}
+		// Results share arena blocks with the ones around them, a leaked
+		// one would keep the whole block alive
+		delete result;
 	}
 	if (isRunning()) {
-		fingerprintNextFile();
+		fingerprintNextFiles();
 	}
-	if (m_activeFiles == 0 && m_files.isEmpty()) {
-		if (m_submitQueue.isEmpty()) {
-			m_finished = true;
-			emit finished();
-			return;
-		}
-		maybeSubmit(true);
+	checkFinished();
+}
+
+void Fingerprinter::onResultsAvailable()
+{
+	foreach (AnalyzeResult *result, m_pipeline->takeResults()) {
+		onFileAnalyzed(result);
 	}
 }
 
+bool Fingerprinter::isDuplicate(AnalyzeResult *result)
+{
+	// A file that changed while watching replaces its old fingerprint, so
+	// it's not a duplicate of its own earlier version
+	int track = m_duplicates->add(result->fingerprint, result->length, result->file);
+	return track != -1 && !m_duplicates->findEarlier(track).isEmpty();
+}
+
 bool Fingerprinter::maybeSubmit(bool force)
 {
 	int size = qMin(MAX_BATCH_SIZE, m_submitQueue.size());
@@ -224,15 +424,18 @@ bool Fingerprinter::maybeSubmit(bool force)
 					url.addQueryItem(QString("discno.%1").arg(i), QString::number(result->discNo));
 				}
 			}
-			url.addQueryItem(QString("fingerprint.%1").arg(i), result->fingerprint);
-			QString format = extractExtension(result->fileName);
+			url.addQueryItem(QString("fingerprint.%1").arg(i), FingerprintCalculator::encode(result->fingerprint));
+			QString format = extractExtension(PathStore::instance()->path(result->file));
 			if (!format.isEmpty()) {
 				url.addQueryItem(QString("fileformat.%1").arg(i), format);
 			}
 			if (result->bitrate) {
 				url.addQueryItem(QString("bitrate.%1").arg(i), QString::number(result->bitrate));
 			}
-			m_submitting.append(result->fileName);
+			SubmittedFile file;
+			file.file = result->file;
+			file.state = result->fileState;
+			m_submitting.append(file);
 			delete result;
 		}
 		qDebug() << url.encodedQuery();
@@ -278,9 +481,7 @@ void Fingerprinter::onRequestFinished(QNetworkReply *reply)
 	}
 
 	if (m_submitted.size() > 0) {
-		UpdateLogFileTask *task = new UpdateLogFileTask(m_submitted);
-		task->setAutoDelete(true);
-		QThreadPool::globalInstance()->start(task);
+		LogWriter::instance()->submitted(m_submitted);
 		m_submitted.clear();
 	}
 
@@ -288,13 +489,8 @@ void Fingerprinter::onRequestFinished(QNetworkReply *reply)
 	reply->deleteLater();
 	m_reply = 0;
 
-	if (m_submitQueue.isEmpty() && m_files.isEmpty()) {
-		m_finished = true;
-		emit finished();
-		return;
-	}
-
 	if (isRunning()) {
-		maybeSubmit(m_files.isEmpty());
+		maybeSubmit();
 	}
+	checkFinished();
 }
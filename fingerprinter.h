@@ -5,9 +5,16 @@
 #include <QDir>
 #include <QMutex>
 #include <QNetworkAccessManager>
+#include <QSharedPointer>
 #include <QTime>
+#include "logwriter.h"
+#include "analyzefiletask.h"
 
 class AnalyzeResult;
+class AnalysisPipeline;
+class DuplicateIndex;
+class FileQueue;
+class DirectoryWatcher;
 class QNetworkReply;
 
 class Fingerprinter : public QObject 
@@ -15,13 +22,14 @@ class Fingerprinter : public QObject
     Q_OBJECT
 
 public:
-    Fingerprinter(const QString &apiKey, const QStringList &directories);
+    Fingerprinter(const QString &apiKey, const QStringList &directories, bool watch = false);
     ~Fingerprinter();
 
 	bool isPaused();
 	bool isCancelled();
 	bool isRunning();
 	bool isFinished();
+	bool isWatching();
 
 	int submitttedFingerprints() const { return m_submittedFiles; }
 
@@ -30,6 +38,7 @@ signals:
     void currentPathChanged(const QString &path);
 	void fileListLoadingStarted();
 	void fingerprintingStarted(int fileCount);
+	void fileCountChanged(int fileCount);
 	void progress(int i);
 	void finished();
 	void networkError(const QString &message);
@@ -43,30 +52,52 @@ public slots:
     void cancel();
 
 private slots:
-	void onFileListLoaded(const QStringList &files);
+	void onFilesAvailable();
+	void onFileListLoaded();
+	void onFilesChanged(const QStringList &files);
+	void onRescanNeeded();
 	void onFileAnalyzed(AnalyzeResult *);
+	void onResultsAvailable();
 	void onRequestFinished(QNetworkReply *reply);
 
 private:
-	void fingerprintNextFile();
+	void loadFiles(const QStringList &directories, const QStringList &files = QStringList());
+	void fingerprintNextFiles();
+	bool fingerprintNextFile();
+	bool hasPendingFiles();
+	void checkFinished();
 	bool maybeSubmit(bool force=false);
+	bool isDuplicate(AnalyzeResult *result);
 
     QString m_apiKey;
-    QStringList m_files;
+    QSharedPointer<FileQueue> m_files;
     QStringList m_directories;
 	QNetworkAccessManager *m_networkAccessManager;
+	DirectoryWatcher *m_watcher;
+	// Analyzes the files, if disabled each file is a task on the global thread pool
+	AnalysisPipeline *m_pipeline;
+	// Fingerprints analyzed in this run, only used if duplicates are not submitted
+	DuplicateIndex *m_duplicates;
+	int m_duplicateFiles;
 	QList<AnalyzeResult *> m_submitQueue;
-	QStringList m_submitting;
-	QStringList m_submitted;
+	QList<SubmittedFile> m_submitting;
+	QList<SubmittedFile> m_submitted;
 	QNetworkReply *m_reply;
 
 	QTime m_time;
 	int m_fingerprintedFiles;
+	int m_fileCount;
 	int m_submittedFiles;
 	int m_activeFiles;
+	int m_maxActiveFiles;
+	AnalyzeOptions m_analyzeOptions;
+	int m_loadingTasks;
 	bool m_cancelled;
 	bool m_paused;
 	bool m_finished;
+	bool m_fingerprintingStarted;
+	bool m_watching;
+	bool m_rescanPending;
 };
 
 #endif
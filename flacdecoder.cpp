@@ -0,0 +1,536 @@
+#include <string.h>
+#include "inputfile.h"
+#include "flacdecoder.h"
+
+// FFmpeg handles up to 32 bits, the side channel of those would need 33 bit
+// arithmetic
+static const int MAX_BITS_PER_SAMPLE = 24;
+
+enum
+{
+	CHANNELS_INDEPENDENT = 7,
+	CHANNELS_LEFT_SIDE = 8,
+	CHANNELS_SIDE_RIGHT = 9,
+	CHANNELS_MID_SIDE = 10
+};
+
+static inline int countLeadingZeros(quint64 value)
+{
+#ifdef __GNUC__
+	return __builtin_clzll(value);
+#else
+	int count = 0;
+	while (!(value & (Q_UINT64_C(1) << 63))) {
+		value <<= 1;
+		count++;
+	}
+	return count;
+#endif
+}
+
+static quint8 updateCrc8(quint8 crc, quint8 byte)
+{
+	crc ^= byte;
+	for (int i = 0; i < 8; i++) {
+		crc = (crc & 0x80) ? quint8((crc << 1) ^ 0x07) : quint8(crc << 1);
+	}
+	return crc;
+}
+
+FlacDecoder::FlacDecoder()
+	: m_input(0), m_bufferPosition(0), m_bufferSize(0), m_cache(0), m_cacheBits(0), m_error(false),
+	  m_bitsPerSample(0), m_allocations(0)
+{
+}
+
+bool FlacDecoder::fillBuffer()
+{
+	qint64 size = m_input->read(reinterpret_cast<char *>(m_buffer), BUFFER_SIZE);
+	m_bufferPosition = 0;
+	m_bufferSize = size > 0 ? int(size) : 0;
+	return m_bufferSize > 0;
+}
+
+void FlacDecoder::fillCache()
+{
+	while (m_cacheBits <= 56) {
+		if (m_bufferPosition == m_bufferSize && !fillBuffer()) {
+			break;
+		}
+		m_cache |= quint64(m_buffer[m_bufferPosition++]) << (56 - m_cacheBits);
+		m_cacheBits += 8;
+	}
+}
+
+inline quint32 FlacDecoder::readBits(int count)
+{
+	if (count == 0) {
+		return 0;
+	}
+	if (m_cacheBits < count) {
+		fillCache();
+		if (m_cacheBits < count) {
+			m_error = true;
+			m_cache = 0;
+			m_cacheBits = 0;
+			return 0;
+		}
+	}
+	quint32 value = quint32(m_cache >> (64 - count));
+	m_cache <<= count;
+	m_cacheBits -= count;
+	return value;
+}
+
+inline qint32 FlacDecoder::readSignedBits(int count)
+{
+	if (count == 0) {
+		return 0;
+	}
+	return qint32(readBits(count) << (32 - count)) >> (32 - count);
+}
+
+inline quint32 FlacDecoder::readUnary()
+{
+	quint32 zeros = 0;
+	while (true) {
+		if (m_cacheBits == 0) {
+			fillCache();
+			if (m_cacheBits == 0) {
+				m_error = true;
+				return 0;
+			}
+		}
+		if (m_cache == 0) {
+			zeros += m_cacheBits;
+			m_cacheBits = 0;
+			continue;
+		}
+		// Bits past the valid ones are always zero, so the first set bit is valid
+		int count = countLeadingZeros(m_cache);
+		m_cache <<= count;
+		m_cache <<= 1;
+		m_cacheBits -= count + 1;
+		return zeros + count;
+	}
+}
+
+void FlacDecoder::alignToByte()
+{
+	readBits(m_cacheBits % 8);
+}
+
+bool FlacDecoder::readMetadata()
+{
+	// Some taggers put an ID3v2 tag in front of the stream
+	char header[10];
+	if (m_input->read(header, 4) != 4) {
+		return false;
+	}
+	if (memcmp(header, "ID3", 3) == 0) {
+		if (m_input->read(header + 4, 6) != 6) {
+			return false;
+		}
+		qint64 size = ((header[6] & 0x7f) << 21) | ((header[7] & 0x7f) << 14) | ((header[8] & 0x7f) << 7) | (header[9] & 0x7f);
+		if ((header[5] & 0x10)) {
+			// Footer
+			size += 10;
+		}
+		if (!m_input->seek(10 + size) || m_input->read(header, 4) != 4) {
+			return false;
+		}
+	}
+	if (memcmp(header, "fLaC", 4) != 0) {
+		return false;
+	}
+
+	// STREAMINFO has to be the first block, the others are skipped
+	bool haveStreamInfo = false;
+	while (true) {
+		uchar block[34];
+		if (m_input->read(reinterpret_cast<char *>(block), 4) != 4) {
+			return false;
+		}
+		bool last = block[0] & 0x80;
+		int type = block[0] & 0x7f;
+		int size = (block[1] << 16) | (block[2] << 8) | block[3];
+		qint64 next = m_input->position() + size;
+		if (type == 0) {
+			if (size < 34 || m_input->read(reinterpret_cast<char *>(block), 34) != 34) {
+				return false;
+			}
+			m_sampleRate = (block[10] << 12) | (block[11] << 4) | (block[12] >> 4);
+			m_channels = ((block[12] >> 1) & 0x07) + 1;
+			m_bitsPerSample = (((block[12] & 0x01) << 4) | (block[13] >> 4)) + 1;
+			haveStreamInfo = true;
+		}
+		else if (!haveStreamInfo) {
+			return false;
+		}
+		if (!m_input->seek(next)) {
+			return false;
+		}
+		if (last) {
+			break;
+		}
+	}
+	return m_sampleRate > 0 && m_bitsPerSample >= 4 && m_bitsPerSample <= MAX_BITS_PER_SAMPLE;
+}
+
+bool FlacDecoder::open(InputFile *input)
+{
+	m_input = input;
+	m_channels = 0;
+	m_sampleRate = 0;
+	m_bitsPerSample = 0;
+	m_bufferPosition = 0;
+	m_bufferSize = 0;
+	m_cache = 0;
+	m_cacheBits = 0;
+	m_error = false;
+	return m_input->seek(0) && readMetadata();
+}
+
+bool FlacDecoder::decodeResidual(int32_t *output, int blockSize, int order)
+{
+	int method = readBits(2);
+	if (method > 1) {
+		return false;
+	}
+	int parameterBits = method == 0 ? 4 : 5;
+	int escape = (1 << parameterBits) - 1;
+	int partitionOrder = readBits(4);
+	int partitions = 1 << partitionOrder;
+	int partitionSize = blockSize >> partitionOrder;
+	if ((partitionSize << partitionOrder) != blockSize || partitionSize < order) {
+		return false;
+	}
+	int i = order;
+	for (int partition = 0; partition < partitions; partition++) {
+		int parameter = readBits(parameterBits);
+		int end = (partition + 1) * partitionSize;
+		if (parameter == escape) {
+			int bits = readBits(5);
+			for (; i < end; i++) {
+				output[i] = readSignedBits(bits);
+			}
+		}
+		else {
+			for (; i < end; i++) {
+				quint32 value = readUnary() << parameter;
+				value |= readBits(parameter);
+				output[i] = qint32(value >> 1) ^ -qint32(value & 1);
+			}
+		}
+		if (m_error) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool FlacDecoder::decodeSubframe(int32_t *output, int blockSize, int bitsPerSample)
+{
+	if (readBits(1) != 0) {
+		return false;
+	}
+	int type = readBits(6);
+	int wastedBits = 0;
+	if (readBits(1)) {
+		wastedBits = readUnary() + 1;
+		if (wastedBits >= bitsPerSample) {
+			return false;
+		}
+		bitsPerSample -= wastedBits;
+	}
+
+	if (type == 0) {
+		int32_t value = readSignedBits(bitsPerSample);
+		for (int i = 0; i < blockSize; i++) {
+			output[i] = value;
+		}
+	}
+	else if (type == 1) {
+		for (int i = 0; i < blockSize; i++) {
+			output[i] = readSignedBits(bitsPerSample);
+		}
+	}
+	else if (type >= 8 && type <= 12) {
+		int order = type - 8;
+		if (order > blockSize) {
+			return false;
+		}
+		for (int i = 0; i < order; i++) {
+			output[i] = readSignedBits(bitsPerSample);
+		}
+		if (!decodeResidual(output, blockSize, order)) {
+			return false;
+		}
+		// The residual is stored in place of the samples it predicts
+		switch (order) {
+		case 1:
+			for (int i = 1; i < blockSize; i++) {
+				output[i] += output[i - 1];
+			}
+			break;
+		case 2:
+			for (int i = 2; i < blockSize; i++) {
+				output[i] += 2 * output[i - 1] - output[i - 2];
+			}
+			break;
+		case 3:
+			for (int i = 3; i < blockSize; i++) {
+				output[i] += 3 * output[i - 1] - 3 * output[i - 2] + output[i - 3];
+			}
+			break;
+		case 4:
+			for (int i = 4; i < blockSize; i++) {
+				output[i] += 4 * output[i - 1] - 6 * output[i - 2] + 4 * output[i - 3] - output[i - 4];
+			}
+			break;
+		}
+	}
+	else if (type >= 32) {
+		int order = type - 31;
+		if (order > blockSize) {
+			return false;
+		}
+		for (int i = 0; i < order; i++) {
+			output[i] = readSignedBits(bitsPerSample);
+		}
+		int precision = readBits(4) + 1;
+		int shift = readSignedBits(5);
+		if (precision == 16 || shift < 0) {
+			return false;
+		}
+		int32_t coefficients[32];
+		for (int i = 0; i < order; i++) {
+			coefficients[i] = readSignedBits(precision);
+		}
+		if (!decodeResidual(output, blockSize, order)) {
+			return false;
+		}
+		// 32-bit sums are enough when the largest possible sum fits
+		int orderBits = 0;
+		while ((1 << orderBits) < order) {
+			orderBits++;
+		}
+		if (bitsPerSample + precision + orderBits <= 32) {
+			for (int i = order; i < blockSize; i++) {
+				int32_t sum = 0;
+				for (int j = 0; j < order; j++) {
+					sum += coefficients[j] * output[i - 1 - j];
+				}
+				output[i] += sum >> shift;
+			}
+		}
+		else {
+			for (int i = order; i < blockSize; i++) {
+				qint64 sum = 0;
+				for (int j = 0; j < order; j++) {
+					sum += qint64(coefficients[j]) * output[i - 1 - j];
+				}
+				output[i] += int32_t(sum >> shift);
+			}
+		}
+	}
+	else {
+		return false;
+	}
+
+	if (wastedBits) {
+		for (int i = 0; i < blockSize; i++) {
+			output[i] *= 1 << wastedBits;
+		}
+	}
+	return !m_error;
+}
+
+int FlacDecoder::decodeFrame()
+{
+	// Look for the frame sync code, which also skips whatever follows the
+	// last frame, like an ID3v1 tag
+	quint8 header[16];
+	header[0] = readBits(8);
+	while (true) {
+		if (m_error) {
+			return 0;
+		}
+		if (header[0] != 0xff) {
+			header[0] = readBits(8);
+			continue;
+		}
+		header[1] = readBits(8);
+		if ((header[1] & 0xfe) == 0xf8) {
+			break;
+		}
+		header[0] = header[1];
+	}
+
+	int size = 2;
+	header[size++] = readBits(8);
+	header[size++] = readBits(8);
+	int blockSizeCode = header[2] >> 4;
+	int sampleRateCode = header[2] & 0x0f;
+	int channelAssignment = header[3] >> 4;
+	int sampleSizeCode = (header[3] >> 1) & 0x07;
+
+	// UTF-8 style coded frame or sample number, only needed for the CRC
+	quint8 first = readBits(8);
+	header[size++] = first;
+	int extraBytes = 0;
+	if (first & 0x80) {
+		for (quint8 mask = 0x40; (first & mask) && extraBytes < 6; mask >>= 1) {
+			extraBytes++;
+		}
+		if (extraBytes == 0) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < extraBytes; i++) {
+		header[size] = readBits(8);
+		if ((header[size++] & 0xc0) != 0x80) {
+			return -1;
+		}
+	}
+
+	int blockSize = 0;
+	if (blockSizeCode == 1) {
+		blockSize = 192;
+	}
+	else if (blockSizeCode >= 2 && blockSizeCode <= 5) {
+		blockSize = 576 << (blockSizeCode - 2);
+	}
+	else if (blockSizeCode == 6) {
+		header[size] = readBits(8);
+		blockSize = header[size++] + 1;
+	}
+	else if (blockSizeCode == 7) {
+		header[size] = readBits(8);
+		header[size + 1] = readBits(8);
+		blockSize = ((header[size] << 8) | header[size + 1]) + 1;
+		size += 2;
+	}
+	else if (blockSizeCode >= 8) {
+		blockSize = 256 << (blockSizeCode - 8);
+	}
+	else {
+		return -1;
+	}
+
+	// The sample rate of the stream info is used in any case
+	if (sampleRateCode == 12) {
+		header[size++] = readBits(8);
+	}
+	else if (sampleRateCode == 13 || sampleRateCode == 14) {
+		header[size++] = readBits(8);
+		header[size++] = readBits(8);
+	}
+	else if (sampleRateCode == 15) {
+		return -1;
+	}
+
+	quint8 crc = 0;
+	for (int i = 0; i < size; i++) {
+		crc = updateCrc8(crc, header[i]);
+	}
+	if (quint8(readBits(8)) != crc || m_error) {
+		return -1;
+	}
+
+	static const int sampleSizes[] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+	int bitsPerSample = sampleSizeCode ? sampleSizes[sampleSizeCode] : m_bitsPerSample;
+	int channels = channelAssignment <= CHANNELS_INDEPENDENT ? channelAssignment + 1 : 2;
+	// Changes of the format in the middle of the stream are not supported
+	if (bitsPerSample != m_bitsPerSample || channels != m_channels || channelAssignment > CHANNELS_MID_SIDE) {
+		m_error = true;
+		return 0;
+	}
+
+	if (m_decoded.size() < blockSize * channels) {
+		m_decoded.resize(blockSize * channels);
+		m_allocations++;
+	}
+	for (int channel = 0; channel < channels; channel++) {
+		int bits = bitsPerSample;
+		if ((channelAssignment == CHANNELS_LEFT_SIDE && channel == 1) ||
+		    (channelAssignment == CHANNELS_SIDE_RIGHT && channel == 0) ||
+		    (channelAssignment == CHANNELS_MID_SIDE && channel == 1)) {
+			bits++;
+		}
+		if (!decodeSubframe(m_decoded.data() + channel * blockSize, blockSize, bits)) {
+			return -1;
+		}
+	}
+	alignToByte();
+	// Frame CRC-16
+	readBits(16);
+	if (m_error) {
+		return 0;
+	}
+
+	int32_t *left = m_decoded.data();
+	int32_t *right = left + blockSize;
+	switch (channelAssignment) {
+	case CHANNELS_LEFT_SIDE:
+		for (int i = 0; i < blockSize; i++) {
+			right[i] = left[i] - right[i];
+		}
+		break;
+	case CHANNELS_SIDE_RIGHT:
+		for (int i = 0; i < blockSize; i++) {
+			left[i] += right[i];
+		}
+		break;
+	case CHANNELS_MID_SIDE:
+		for (int i = 0; i < blockSize; i++) {
+			int32_t side = right[i];
+			int32_t mid = (left[i] * 2) | (side & 1);
+			left[i] = (mid + side) >> 1;
+			right[i] = (mid - side) >> 1;
+		}
+		break;
+	}
+	return blockSize;
+}
+
+int FlacDecoder::decode(const int16_t **samples)
+{
+	int blockSize;
+	do {
+		blockSize = decodeFrame();
+	} while (blockSize < 0);
+	if (blockSize == 0) {
+		return 0;
+	}
+
+	int count = blockSize * m_channels;
+	if (m_output.size() < count) {
+		m_output.resize(count);
+		m_allocations++;
+	}
+	// Same as FFmpeg, narrow samples are scaled up to 16 bits and the top
+	// 16 bits of wider ones are kept
+	int16_t *output = m_output.data();
+	const int32_t *decoded = m_decoded.constData();
+	if (m_bitsPerSample <= 16) {
+		int scale = 1 << (16 - m_bitsPerSample);
+		for (int channel = 0; channel < m_channels; channel++) {
+			const int32_t *input = decoded + channel * blockSize;
+			for (int i = 0; i < blockSize; i++) {
+				output[i * m_channels + channel] = int16_t(input[i] * scale);
+			}
+		}
+	}
+	else {
+		int shift = m_bitsPerSample - 16;
+		for (int channel = 0; channel < m_channels; channel++) {
+			const int32_t *input = decoded + channel * blockSize;
+			for (int i = 0; i < blockSize; i++) {
+				output[i * m_channels + channel] = int16_t(input[i] >> shift);
+			}
+		}
+	}
+	*samples = output;
+	return blockSize;
+}
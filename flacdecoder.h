@@ -0,0 +1,54 @@
+#ifndef FPSUBMIT_FLACDECODER_H_
+#define FPSUBMIT_FLACDECODER_H_
+
+#include <QVector>
+#include "nativedecoder.h"
+
+// Native FLAC streams with up to 24 bits per sample. The decoded samples
+// are scaled to 16 bits the same way FFmpeg's FLAC decoder and
+// SampleConverter would do it. Frames with a broken header are skipped,
+// like FFmpeg does, but the frame CRC is not checked, same as FFmpeg's
+// default.
+class FlacDecoder : public NativeDecoder
+{
+public:
+	FlacDecoder();
+
+	bool open(InputFile *input);
+	int decode(const int16_t **samples);
+	int allocations() const { return m_allocations; }
+
+private:
+	enum
+	{
+		BUFFER_SIZE = 64 * 1024
+	};
+
+	bool readMetadata();
+	int decodeFrame();
+	bool decodeSubframe(int32_t *output, int blockSize, int bitsPerSample);
+	bool decodeResidual(int32_t *output, int blockSize, int order);
+
+	bool fillBuffer();
+	void fillCache();
+	inline quint32 readBits(int count);
+	inline qint32 readSignedBits(int count);
+	inline quint32 readUnary();
+	void alignToByte();
+
+	InputFile *m_input;
+	uint8_t m_buffer[BUFFER_SIZE];
+	int m_bufferPosition;
+	int m_bufferSize;
+	// The next bits of the stream, starting at the top bit
+	quint64 m_cache;
+	int m_cacheBits;
+	bool m_error;
+
+	int m_bitsPerSample;
+	QVector<int32_t> m_decoded;
+	QVector<int16_t> m_output;
+	int m_allocations;
+};
+
+#endif
@@ -0,0 +1,208 @@
+#include <QtGlobal>
+#include <stdlib.h>
+#include <string.h>
+#ifdef Q_OS_WIN32
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#include "constants.h"
+#include "inputfile.h"
+
+InputFile::InputFile()
+	:
+#ifndef Q_OS_WIN32
+	  m_fd(-1),
+#endif
+	  m_buffer(0), m_prefetchedSize(0), m_bufferOffset(0), m_bufferSize(0), m_position(0), m_size(0), m_open(false), m_allocations(0)
+{
+}
+
+InputFile::~InputFile()
+{
+	close();
+#ifdef Q_OS_WIN32
+	if (m_buffer) {
+		_aligned_free(m_buffer);
+	}
+#else
+	free(m_buffer);
+#endif
+}
+
+bool InputFile::allocateBuffer()
+{
+	if (m_buffer) {
+		return true;
+	}
+	// Aligned, so that direct block reads don't need any copying in the kernel
+	void *buffer = 0;
+#ifdef Q_OS_WIN32
+	buffer = _aligned_malloc(INPUT_BLOCK_SIZE, 4096);
+#else
+	if (posix_memalign(&buffer, 4096, INPUT_BLOCK_SIZE) != 0) {
+		buffer = 0;
+	}
+#endif
+	if (!buffer) {
+		return false;
+	}
+	m_buffer = static_cast<char *>(buffer);
+	m_allocations++;
+	return true;
+}
+
+bool InputFile::open(const char *encodedPath)
+{
+	close();
+	m_stats = Stats();
+#ifdef Q_OS_WIN32
+	m_file.setFileName(QString::fromUtf8(encodedPath));
+	if (!m_file.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+		return false;
+	}
+	m_size = m_file.size();
+#else
+	m_fd = ::open(encodedPath, O_RDONLY | O_CLOEXEC);
+	if (m_fd == -1) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(m_fd, &st) != 0) {
+		close();
+		return false;
+	}
+	m_size = st.st_size;
+#endif
+	if (!allocateBuffer()) {
+		close();
+		return false;
+	}
+	m_open = true;
+	return true;
+}
+
+void InputFile::close()
+{
+#ifdef Q_OS_WIN32
+	m_file.close();
+#else
+	if (m_fd != -1) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+#endif
+	m_open = false;
+	m_prefetchedSize = 0;
+	m_bufferOffset = 0;
+	m_bufferSize = 0;
+	m_position = 0;
+	m_size = 0;
+}
+
+void InputFile::setReadahead(qint64 length)
+{
+#if defined(Q_OS_LINUX)
+	if (m_fd != -1) {
+		posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(m_fd, 0, qMin(length, m_size), POSIX_FADV_WILLNEED);
+	}
+#else
+	Q_UNUSED(length);
+#endif
+}
+
+bool InputFile::prefetch(qint64 length)
+{
+	if (!m_open) {
+		return false;
+	}
+	m_prefetchedSize = 0;
+	int size = int(qMin(length, m_size));
+	if (size <= 0) {
+		return true;
+	}
+	if (m_prefetched.size() < size) {
+		// Nothing worth copying in the old one
+		m_prefetched = QByteArray();
+		m_prefetched.resize(size);
+		m_allocations++;
+	}
+	qint64 position = m_position;
+	m_position = 0;
+	qint64 result = read(m_prefetched.data(), size);
+	m_position = position;
+	if (result < 0) {
+		return false;
+	}
+	m_prefetchedSize = result;
+	return true;
+}
+
+qint64 InputFile::readBlock(qint64 offset, char *data, qint64 size)
+{
+	m_stats.readCalls++;
+#ifdef Q_OS_WIN32
+	if (!m_file.seek(offset)) {
+		return -1;
+	}
+	qint64 result = m_file.read(data, size);
+#else
+	qint64 result = pread(m_fd, data, size, offset);
+#endif
+	if (result > 0) {
+		m_stats.bytesRead += result;
+	}
+	return result;
+}
+
+qint64 InputFile::read(char *data, qint64 maxSize)
+{
+	if (!m_open) {
+		return -1;
+	}
+	qint64 total = 0;
+	while (total < maxSize && m_position < m_size) {
+		if (m_position < m_prefetchedSize) {
+			qint64 size = qMin(maxSize - total, m_prefetchedSize - m_position);
+			memcpy(data + total, m_prefetched.constData() + m_position, size);
+			total += size;
+			m_position += size;
+			continue;
+		}
+		qint64 offset = m_position - m_bufferOffset;
+		if (offset >= 0 && offset < m_bufferSize) {
+			qint64 size = qMin(maxSize - total, m_bufferSize - offset);
+			memcpy(data + total, m_buffer + offset, size);
+			total += size;
+			m_position += size;
+			continue;
+		}
+		qint64 blockOffset = m_position & ~qint64(INPUT_BLOCK_SIZE - 1);
+		qint64 size = readBlock(blockOffset, m_buffer, INPUT_BLOCK_SIZE);
+		if (size <= 0) {
+			m_bufferSize = 0;
+			break;
+		}
+		m_bufferOffset = blockOffset;
+		m_bufferSize = size;
+		if (m_position >= m_bufferOffset + m_bufferSize) {
+			// The file got shorter under us
+			break;
+		}
+	}
+	return total > 0 || m_position >= m_size ? total : -1;
+}
+
+bool InputFile::seek(qint64 position)
+{
+	if (position < 0) {
+		return false;
+	}
+	// Only moves the read position, the buffer is refilled on the next read
+	m_stats.seeks++;
+	m_position = position;
+	return true;
+}
@@ -0,0 +1,79 @@
+#ifndef FPSUBMIT_INPUTFILE_H_
+#define FPSUBMIT_INPUTFILE_H_
+
+#include <QtGlobal>
+#include <QByteArray>
+#ifdef Q_OS_WIN32
+#include <QFile>
+#endif
+
+// Read-only file that serves small reads from a large buffer filled with
+// block-aligned reads. Demuxers read files in small pieces and jump around
+// while probing, which on network filesystems turns into one round trip per
+// read. Reading whole aligned blocks keeps the number of system calls low,
+// and the readahead hint lets the kernel fetch the part of the file we are
+// going to need before we ask for it.
+class InputFile
+{
+public:
+	struct Stats
+	{
+		Stats() : bytesRead(0), readCalls(0), seeks(0) {}
+
+		qint64 bytesRead;
+		// System calls that read from the file
+		int readCalls;
+		// Seeks requested by the reader, they don't touch the file by themselves
+		int seeks;
+	};
+
+	InputFile();
+	~InputFile();
+
+	// The buffer is kept when the file is closed, so it's allocated only
+	// once when the same object is used to read a series of files.
+	bool open(const char *encodedPath);
+	void close();
+	bool isOpen() const { return m_open; }
+
+	// Tells the kernel we'll read the given number of bytes from the start
+	// of the file, the rest of the file is left alone.
+	void setReadahead(qint64 length);
+
+	// Reads the given number of bytes from the start of the file into
+	// memory, later reads of that part don't touch the file. The data is
+	// kept until the file is closed, the memory for it until the object is
+	// destroyed, so it only grows to the largest prefetch seen.
+	bool prefetch(qint64 length);
+
+	qint64 read(char *data, qint64 maxSize);
+	bool seek(qint64 position);
+	qint64 position() const { return m_position; }
+	qint64 size() const { return m_size; }
+
+	const Stats &stats() const { return m_stats; }
+	// Number of times the buffers were allocated.
+	int allocations() const { return m_allocations; }
+
+private:
+	qint64 readBlock(qint64 offset, char *data, qint64 size);
+	bool allocateBuffer();
+
+#ifdef Q_OS_WIN32
+	QFile m_file;
+#else
+	int m_fd;
+#endif
+	char *m_buffer;
+	QByteArray m_prefetched;
+	qint64 m_prefetchedSize;
+	qint64 m_bufferOffset;
+	qint64 m_bufferSize;
+	qint64 m_position;
+	qint64 m_size;
+	bool m_open;
+	Stats m_stats;
+	int m_allocations;
+};
+
+#endif
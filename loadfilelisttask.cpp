@@ -1,19 +1,26 @@
 #include <QDir>
 #include <QFile>
-#include <QDesktopServices>
-#include <QSet>
 #include <QDebug>
 #include "utils.h"
+#include "directoryscanner.h"
+#include "directorycache.h"
+#include "filequeue.h"
+#include "submittedlog.h"
+#include "filestatecache.h"
+#include "pathstore.h"
 #include "loadfilelisttask.h"
 
-LoadFileListTask::LoadFileListTask(const QStringList &directories)
-	: m_directories(removeDuplicateDirectories(directories))
+LoadFileListTask::LoadFileListTask(const QStringList &directories, const QSharedPointer<FileQueue> &queue)
+	: m_directories(removeDuplicateDirectories(directories)), m_queue(queue), m_scanner(0)
 {
 }
 
 QStringList LoadFileListTask::removeDuplicateDirectories(const QStringList &directories)
 {
     int directoryCount = directories.size();
+    if (!directoryCount) {
+        return QStringList();
+    }
     QList<QString> sortedDirectories;
     for (int i = 0; i < directoryCount; i++) {
         sortedDirectories.append(QDir(directories.at(i)).canonicalPath() + QDir::separator());
@@ -31,72 +38,84 @@ QStringList LoadFileListTask::removeDuplicateDirectories(const QStringList &dire
 	return result;
 }
 
-void LoadFileListTask::processFile(const QString &path)
+void LoadFileListTask::processFiles(const QList<quint32> &files)
 {
-    static QSet<QString> allowedExtensions = QSet<QString>()
-        << "MP3" 
-		<< "MP4"
-        << "M4A"
-        << "FLAC"
-        << "OGG"
-        << "OGA"
-        << "APE"
-        << "OGGFLAC"
-        << "TTA"
-        << "WV"
-        << "MPC"
-        << "WMA";
-
-	if (allowedExtensions.contains(extractExtension(path))) {
-		if (!m_cache.contains(path)) {
-			m_cache.insert(path);
-			m_files.append(path);
+	PathStore *paths = PathStore::instance();
+	SubmittedLog *submittedLog = SubmittedLog::instance();
+	FileStateCache *fileStateCache = FileStateCache::instance();
+	FileQueue::Order order = m_queue->order();
+	QList<FileQueue::Entry> newFiles;
+	foreach (quint32 file, files) {
+		QString path = paths->path(file);
+		FileState state = FileState::fromPath(path);
+		if (!state.isValid()) {
+			continue;
+		}
+		// Only new and modified files need to be analyzed
+		FileStateCache::Status status = fileStateCache->classify(path, state);
+		if (status == FileStateCache::Unchanged || status == FileStateCache::Moved) {
+			continue;
+		}
+		if (status == FileStateCache::New && submittedLog->contains(file)) {
+			// Submitted before we started keeping track of file states
+			fileStateCache->update(path, state, FileStateCache::Submitted);
+			continue;
+		}
+		FileQueue::Entry entry;
+		entry.file = file;
+		entry.state = state;
+		entry.key = 0;
+		if (order != FileQueue::ListingOrder) {
+			entry.key = FileQueue::sortKey(paths->encodedPath(file), state, order);
 		}
+		newFiles.append(entry);
 	}
+	if (newFiles.isEmpty()) {
+		return;
+	}
+	// Blocks while the fingerprinter is behind, which keeps the scan from
+	// running too far ahead
+	if (!m_queue->push(newFiles)) {
+		if (m_scanner) {
+			m_scanner->cancel();
+		}
+		return;
+	}
+	emit filesAvailable();
 }
 
-void LoadFileListTask::processDirectory(const QString &path)
+void LoadFileListTask::setFiles(const QStringList &files)
 {
-	emit currentPathChanged(path);
-    QFileInfoList fileInfoList = QDir(path).entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot);
-	for (int j = 0; j < fileInfoList.size(); j++) {
-		QFileInfo fileInfo = fileInfoList.at(j);
-		if (fileInfo.isDir()) {
-			processDirectory(fileInfo.filePath());
-		}
-		else {
-			processFile(fileInfo.filePath());
-		}
-    }
+	m_files = files;
 }
 
-static QSet<QString> readCacheFile()
+void LoadFileListTask::run()
 {
-	QString fileName = cacheFileName();
-	QFile file(fileName);
-	if (!file.open(QIODevice::ReadOnly)) {
-		qWarning() << "Couldn't open cache file" << fileName << "for reading";
-		return QSet<QString>();
-	}
-	QTextStream stream(&file);
-	stream.setCodec("UTF-8");
-	QSet<QString> result;
-	while (true) {
-		QString fileName = stream.readLine();
-		if (fileName.isEmpty()) {
-			break;
+	if (!m_files.isEmpty()) {
+		QList<quint32> files;
+		foreach (const QString &path, m_files) {
+			files.append(PathStore::instance()->addFile(path));
 		}
-		result.insert(fileName);
+		processFiles(files);
+		emit finished();
+		return;
 	}
-	return result;
-}
 
-void LoadFileListTask::run()
-{
-	m_cache = readCacheFile();
-	foreach (QString path, m_directories) {
-		processDirectory(path);
+	DirectoryCache directoryCache;
+	directoryCache.load();
+	DirectoryScanner scanner(m_directories);
+	scanner.setDirectoryCache(&directoryCache);
+	m_scanner = &scanner;
+	connect(&scanner, SIGNAL(currentPathChanged(const QString &)), SIGNAL(currentPathChanged(const QString &)), Qt::DirectConnection);
+	connect(&scanner, SIGNAL(filesFound(const QList<quint32> &)), SLOT(processFiles(const QList<quint32> &)), Qt::DirectConnection);
+	scanner.scan();
+	if (!scanner.isCancelled()) {
+		directoryCache.save();
 	}
-	emit finished(m_files);
+	m_scanner = 0;
+	PathStore *paths = PathStore::instance();
+	qDebug() << "Path store holds" << paths->fileCount() << "files in" << paths->directoryCount() << "directories using"
+	         << paths->memoryUsage() / 1024 << "KB (" << paths->stringMemoryUsage() / 1024 << "KB as separate strings)";
+	emit finished();
 }
 
@@ -3,31 +3,38 @@
 
 #include <QRunnable>
 #include <QObject>
-#include <QSet>
+#include <QSharedPointer>
 #include <QStringList>
 
+class DirectoryScanner;
+class FileQueue;
+
 class LoadFileListTask : public QObject, public QRunnable
 {
 	Q_OBJECT
 
 public:
-	LoadFileListTask(const QStringList &directories);
+	LoadFileListTask(const QStringList &directories, const QSharedPointer<FileQueue> &queue);
 	void run();
 
-	QStringList files() const { return m_files; }
+	// Checks only the given files, instead of scanning the directories.
+	void setFiles(const QStringList &files);
 
 signals:
-	void finished(const QStringList &files);
+	void filesAvailable();
+	void finished();
 	void currentPathChanged(const QString &path);
 
+private slots:
+	void processFiles(const QList<quint32> &files);
+
 private:
 	static QStringList removeDuplicateDirectories(const QStringList &directories);
-	void processDirectory(const QString &path);
-	void processFile(const QString &path);
 
-	QSet<QString> m_cache;
 	QStringList m_directories;
 	QStringList m_files;
+	QSharedPointer<FileQueue> m_queue;
+	DirectoryScanner *m_scanner;
 };
 
 #endif
@@ -0,0 +1,254 @@
+#include <QSettings>
+#include <QDebug>
+#include "submittedlog.h"
+#include "pathstore.h"
+#include "resultcache.h"
+#include "constants.h"
+#include "logwriter.h"
+
+static QMutex globalLogWriterMutex;
+static LogWriter *globalLogWriter = 0;
+
+LogWriter *LogWriter::instance()
+{
+	QMutexLocker locker(&globalLogWriterMutex);
+	if (!globalLogWriter) {
+		globalLogWriter = new LogWriter();
+		globalLogWriter->start();
+	}
+	return globalLogWriter;
+}
+
+void LogWriter::shutdown()
+{
+	QMutexLocker locker(&globalLogWriterMutex);
+	if (globalLogWriter) {
+		delete globalLogWriter;
+		globalLogWriter = 0;
+	}
+}
+
+LogWriter::LogWriter()
+	: m_lastSync(0), m_dirty(false), m_resultCache(0), m_fsyncPolicy(FsyncAlways), m_stopping(false)
+{
+	m_clock.start();
+	QSettings settings;
+	if (settings.value("analysis/resultcache", true).toBool()) {
+		m_resultCache = ResultCache::instance();
+	}
+	QString policy = settings.value("log/fsync").toString();
+	if (policy == "never") {
+		m_fsyncPolicy = FsyncNever;
+	}
+	else if (policy == "periodic") {
+		m_fsyncPolicy = FsyncPeriodic;
+	}
+}
+
+LogWriter::~LogWriter()
+{
+	stop();
+	Stats s = stats();
+	if (s.batches) {
+		qDebug() << "Log writer committed" << s.entries << "entries in" << s.batches << "batches with"
+		         << s.syncs << "fsyncs, average latency" << s.totalLatency / s.entries
+		         << "ms, maximum latency" << s.maxLatency << "ms";
+	}
+}
+
+void LogWriter::setFsyncPolicy(FsyncPolicy policy)
+{
+	QMutexLocker locker(&m_mutex);
+	m_fsyncPolicy = policy;
+}
+
+void LogWriter::submitted(const QList<SubmittedFile> &files)
+{
+	QMutexLocker locker(&m_mutex);
+	qint64 now = m_clock.elapsed();
+	foreach (const SubmittedFile &file, files) {
+		Entry entry;
+		entry.file = file.file;
+		entry.state = file.state;
+		entry.outcome = FileStateCache::Submitted;
+		entry.queued = now;
+		m_queue.append(entry);
+	}
+	m_condition.wakeOne();
+}
+
+void LogWriter::failed(quint32 file, const FileState &state)
+{
+	Entry entry;
+	entry.file = file;
+	entry.state = state;
+	entry.outcome = FileStateCache::Failed;
+	enqueue(entry);
+}
+
+void LogWriter::duplicate(quint32 file, const FileState &state)
+{
+	Entry entry;
+	entry.file = file;
+	entry.state = state;
+	entry.outcome = FileStateCache::Duplicate;
+	enqueue(entry);
+}
+
+void LogWriter::enqueue(const Entry &entry)
+{
+	QMutexLocker locker(&m_mutex);
+	m_queue.append(entry);
+	m_queue.last().queued = m_clock.elapsed();
+	m_condition.wakeOne();
+}
+
+LogWriter::Stats LogWriter::stats()
+{
+	QMutexLocker locker(&m_mutex);
+	return m_stats;
+}
+
+void LogWriter::stop()
+{
+	m_mutex.lock();
+	m_stopping = true;
+	m_condition.wakeOne();
+	m_mutex.unlock();
+	wait();
+}
+
+void LogWriter::run()
+{
+	QMutexLocker locker(&m_mutex);
+	while (true) {
+		if (m_queue.isEmpty()) {
+			if (m_stopping) {
+				if (m_dirty) {
+					locker.unlock();
+					syncLog();
+				}
+				break;
+			}
+			if (!m_dirty) {
+				m_condition.wait(&m_mutex);
+				continue;
+			}
+			// With the periodic policy the last batch before the queue goes
+			// idle is synced once the interval is over, not only at exit
+			qint64 remaining = m_lastSync + LOG_SYNC_INTERVAL - m_clock.elapsed();
+			if (remaining > 0 && m_condition.wait(&m_mutex, (unsigned long)remaining)) {
+				continue;
+			}
+			if (m_queue.isEmpty() && !m_stopping) {
+				locker.unlock();
+				syncLog();
+				locker.relock();
+			}
+			continue;
+		}
+		// Take everything that piled up while the previous batch was being
+		// written, the whole batch then shares a single write and fsync
+		QList<Entry> entries = m_queue;
+		m_queue.clear();
+		locker.unlock();
+		commit(entries);
+		locker.relock();
+	}
+}
+
+// Only called from the writer thread
+void LogWriter::syncLog()
+{
+	m_lastSync = m_clock.elapsed();
+	if (!SubmittedLog::instance()->sync()) {
+		// Tried again after the next interval
+		qWarning() << "Couldn't flush the submitted log to the disk";
+		return;
+	}
+	m_dirty = false;
+	if (!m_unsynced.isEmpty()) {
+		updateStates(m_unsynced, m_unsyncedPaths);
+		m_unsynced.clear();
+		m_unsyncedPaths.clear();
+	}
+	QMutexLocker locker(&m_mutex);
+	m_stats.syncs++;
+}
+
+void LogWriter::updateStates(const QList<Entry> &entries, const QStringList &paths)
+{
+	FileStateCache *fileStateCache = FileStateCache::instance();
+	for (int i = 0; i < entries.size(); i++) {
+		fileStateCache->update(paths.at(i), entries.at(i).state, entries.at(i).outcome);
+	}
+	if (m_resultCache) {
+		foreach (const Entry &entry, entries) {
+			if (entry.outcome != FileStateCache::Failed) {
+				m_resultCache->remove(entry.file, entry.state);
+			}
+		}
+	}
+}
+
+void LogWriter::commit(const QList<Entry> &entries)
+{
+	PathStore *pathStore = PathStore::instance();
+	QStringList paths;
+	foreach (const Entry &entry, entries) {
+		paths.append(pathStore->path(entry.file));
+	}
+	QStringList submittedPaths;
+	for (int i = 0; i < entries.size(); i++) {
+		if (entries.at(i).outcome == FileStateCache::Submitted) {
+			submittedPaths.append(paths.at(i));
+		}
+	}
+
+	m_mutex.lock();
+	FsyncPolicy policy = m_fsyncPolicy;
+	m_mutex.unlock();
+
+	if (!submittedPaths.isEmpty()) {
+		SubmittedLog::instance()->append(submittedPaths);
+		if (policy != FsyncNever) {
+			m_dirty = true;
+		}
+		if (policy == FsyncAlways || (policy == FsyncPeriodic && m_clock.elapsed() - m_lastSync >= LOG_SYNC_INTERVAL)) {
+			syncLog();
+		}
+	}
+
+	// A file is marked as submitted only after its path is synced, so a
+	// crash or a power loss can't leave it marked while the log lacks it and
+	// then skip it forever. With the periodic policy that waits for the next
+	// fsync. Without any fsync only a crash of the process is covered.
+	if (m_dirty) {
+		QList<Entry> synced;
+		QStringList syncedPaths;
+		for (int i = 0; i < entries.size(); i++) {
+			if (entries.at(i).outcome == FileStateCache::Submitted) {
+				m_unsynced.append(entries.at(i));
+				m_unsyncedPaths.append(paths.at(i));
+			}
+			else {
+				synced.append(entries.at(i));
+				syncedPaths.append(paths.at(i));
+			}
+		}
+		updateStates(synced, syncedPaths);
+	}
+	else {
+		updateStates(entries, paths);
+	}
+
+	qint64 now = m_clock.elapsed();
+	QMutexLocker locker(&m_mutex);
+	m_stats.batches++;
+	m_stats.entries += entries.size();
+	foreach (const Entry &entry, entries) {
+		qint64 latency = now - entry.queued;
+		m_stats.totalLatency += latency;
+		m_stats.maxLatency = qMax(m_stats.maxLatency, latency);
+	}
+}
@@ -0,0 +1,96 @@
+#ifndef FPSUBMIT_LOGWRITER_H_
+#define FPSUBMIT_LOGWRITER_H_
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QTime>
+#include <QStringList>
+#include "filestatecache.h"
+
+class ResultCache;
+
+struct SubmittedFile
+{
+	quint32 file;
+	FileState state;
+};
+
+// Dedicated thread that records the results of the fingerprinting in the
+// submitted log and the file state cache. Everything queued while the
+// previous batch was being written is committed together, with one write
+// and, depending on the fsync policy, one fsync.
+class LogWriter : public QThread
+{
+public:
+	enum FsyncPolicy
+	{
+		FsyncNever,
+		FsyncPeriodic,
+		FsyncAlways
+	};
+
+	struct Stats
+	{
+		Stats() : batches(0), entries(0), syncs(0), totalLatency(0), maxLatency(0) {}
+
+		qint64 batches;
+		qint64 entries;
+		qint64 syncs;
+		qint64 totalLatency;
+		qint64 maxLatency;
+	};
+
+	LogWriter();
+	~LogWriter();
+
+	static LogWriter *instance();
+	// Writes out everything that's still queued and stops the thread.
+	static void shutdown();
+
+	void setFsyncPolicy(FsyncPolicy policy);
+
+	void submitted(const QList<SubmittedFile> &files);
+	void failed(quint32 file, const FileState &state);
+	void duplicate(quint32 file, const FileState &state);
+
+	// Time from queueing an entry until it was written, in milliseconds.
+	Stats stats();
+
+protected:
+	void run();
+
+private:
+	struct Entry
+	{
+		quint32 file;
+		FileState state;
+		FileStateCache::Outcome outcome;
+		qint64 queued;
+	};
+
+	void enqueue(const Entry &entry);
+	void commit(const QList<Entry> &entries);
+	void updateStates(const QList<Entry> &entries, const QStringList &paths);
+	void syncLog();
+	void stop();
+
+	QMutex m_mutex;
+	QWaitCondition m_condition;
+	QList<Entry> m_queue;
+	QTime m_clock;
+	qint64 m_lastSync;
+	// Paths were appended to the log since the last fsync
+	bool m_dirty;
+	// Submitted files whose paths are not synced yet, their states are
+	// recorded by the next fsync
+	QList<Entry> m_unsynced;
+	QStringList m_unsyncedPaths;
+	// Submitted and duplicate files are dropped from it
+	ResultCache *m_resultCache;
+	FsyncPolicy m_fsyncPolicy;
+	Stats m_stats;
+	bool m_stopping;
+};
+
+#endif
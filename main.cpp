@@ -1,10 +1,15 @@
 #include <QApplication>
 #include "decoder.h"
 #include "mainwindow.h"
+#include "benchmark.h"
+#include "logwriter.h"
 
 int main(int argc, char **argv)
 {
 	Decoder::initialize();
+	if (isBenchmarkCommand(argc, argv)) {
+		return runBenchmark(argc, argv);
+	}
 	QApplication app(argc, argv);
 	app.setOrganizationName("Acoustid");
 	app.setOrganizationDomain("acoustid.org");
@@ -12,5 +17,7 @@ int main(int argc, char **argv)
 	app.setApplicationVersion(VERSION);
 	MainWindow window;
 	window.show();
-	return app.exec();
+	int result = app.exec();
+	LogWriter::shutdown();
+	return result;
 }
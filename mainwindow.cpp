@@ -64,6 +64,9 @@ void MainWindow::setupUi()
 	QLabel *apiKeyLabel = new QLabel(tr("Your Acoustid &API key:"));
 	apiKeyLabel->setBuddy(m_apiKeyEdit);
 
+	m_watchCheckBox = new QCheckBox(tr("&Keep watching the folders for new files"));
+	m_watchCheckBox->setChecked(settings.value("watch").toBool());
+
 	QPushButton *fingerprintButton = new QPushButton(tr("&Fingerprint..."));
 	connect(fingerprintButton, SIGNAL(clicked()), SLOT(fingerprint()));
 
@@ -79,6 +82,7 @@ void MainWindow::setupUi()
 	mainLayout->addLayout(apiKeyLayout);
 	mainLayout->addWidget(treeViewLabel);
 	mainLayout->addWidget(treeView);
+	mainLayout->addWidget(m_watchCheckBox);
 	mainLayout->addWidget(buttonBox);
 
 	QWidget *centralWidget = new QWidget();
@@ -108,7 +112,8 @@ void MainWindow::fingerprint()
 	}
 	QSettings settings;
 	settings.setValue("apikey", apiKey);
-	Fingerprinter *fingerprinter = new Fingerprinter(apiKey, directories);
+	settings.setValue("watch", m_watchCheckBox->isChecked());
+	Fingerprinter *fingerprinter = new Fingerprinter(apiKey, directories, m_watchCheckBox->isChecked());
     ProgressDialog *progressDialog = new ProgressDialog(this, fingerprinter);
 	fingerprinter->start();
     progressDialog->setModal(true);
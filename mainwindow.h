@@ -3,6 +3,7 @@
 
 #include <QMainWindow>
 #include <QLineEdit>
+#include <QCheckBox>
 #include "checkabledirmodel.h"
 
 class MainWindow : public QMainWindow
@@ -21,6 +22,7 @@ private:
 	bool validateFields(QString &apiKey, QList<QString> &directories);
 
 	QLineEdit *m_apiKeyEdit;
+	QCheckBox *m_watchCheckBox;
 	CheckableDirModel *m_directoryModel;
 };
 
@@ -0,0 +1,188 @@
+#ifndef FPSUBMIT_MAPPEDTABLE_H_
+#define FPSUBMIT_MAPPEDTABLE_H_
+
+#include <QFile>
+#include <QDebug>
+#include <string.h>
+#include "utils.h"
+
+inline quint64 hashBytes(const char *data, int size, quint64 seed = 14695981039346656037ULL)
+{
+	// FNV-1a, a zero hash is reserved for empty slots
+	quint64 hash = seed;
+	for (int i = 0; i < size; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+}
+
+// Memory-mapped open-addressed hash table with fixed-size slots, used for
+// the on-disk indexes in the cache directory. The first member of Slot must
+// be a "quint64 hash" field, where zero marks an empty slot. The table
+// doesn't do any locking, that's left to the owner.
+template <typename Slot>
+class MappedTable
+{
+public:
+	struct Header
+	{
+		char magic[8];
+		quint32 version;
+		quint32 capacity;
+		quint32 count;
+		quint32 reserved;
+		quint64 extra[2];
+	};
+
+	MappedTable(const char *magic, quint32 version)
+		: m_version(version), m_data(0), m_header(0), m_slots(0)
+	{
+		memcpy(m_magic, magic, sizeof(m_magic));
+	}
+
+	~MappedTable()
+	{
+		close();
+	}
+
+	bool isOpen() const
+	{
+		return m_data != 0;
+	}
+
+	// Opens an existing table, fails if the file is missing or invalid.
+	bool open(const QString &fileName)
+	{
+		close();
+		m_file.setFileName(fileName);
+		if (!m_file.open(QIODevice::ReadWrite)) {
+			return false;
+		}
+		if (m_file.size() < qint64(sizeof(Header)) || !map()) {
+			close();
+			return false;
+		}
+		quint32 capacity = m_header->capacity;
+		if (memcmp(m_header->magic, m_magic, sizeof(m_magic)) != 0 || m_header->version != m_version ||
+		    capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+		    m_file.size() != qint64(sizeof(Header)) + qint64(capacity) * qint64(sizeof(Slot))) {
+			qWarning() << "Invalid index file" << fileName;
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	// Creates an empty table, replacing any existing file.
+	bool create(const QString &fileName, quint32 capacity)
+	{
+		close();
+		m_file.setFileName(fileName);
+		if (!m_file.open(QIODevice::ReadWrite | QIODevice::Truncate)) {
+			qWarning() << "Couldn't create index file" << fileName;
+			return false;
+		}
+		if (!m_file.resize(qint64(sizeof(Header)) + qint64(capacity) * qint64(sizeof(Slot))) || !map()) {
+			qWarning() << "Couldn't allocate index file" << fileName;
+			close();
+			return false;
+		}
+		memset(m_data, 0, m_file.size());
+		memcpy(m_header->magic, m_magic, sizeof(m_magic));
+		m_header->version = m_version;
+		m_header->capacity = capacity;
+		return true;
+	}
+
+	void close()
+	{
+		if (m_data) {
+			m_file.unmap(m_data);
+			m_data = 0;
+			m_header = 0;
+			m_slots = 0;
+		}
+		m_file.close();
+	}
+
+	Header *header() const { return m_header; }
+	quint32 capacity() const { return m_header->capacity; }
+	quint32 count() const { return m_header->count; }
+
+	quint32 firstSlot(quint64 hash) const { return quint32(hash) & (m_header->capacity - 1); }
+	quint32 nextSlot(quint32 i) const { return (i + 1) & (m_header->capacity - 1); }
+	Slot *slot(quint32 i) const { return m_slots + i; }
+
+	// Claims an empty slot for the hash, growing the table first if it's
+	// more than 70% full. Pointers returned earlier are invalid after that.
+	Slot *insert(quint64 hash)
+	{
+		if ((m_header->count + 1) * 10ULL > m_header->capacity * 7ULL) {
+			if (!grow()) {
+				return 0;
+			}
+		}
+		quint32 i = firstSlot(hash);
+		while (m_slots[i].hash) {
+			i = nextSlot(i);
+		}
+		m_slots[i].hash = hash;
+		m_header->count++;
+		return m_slots + i;
+	}
+
+	// Rebuilds the table with twice the capacity, through a temporary file
+	// that atomically replaces the current one.
+	bool grow()
+	{
+		QString fileName = m_file.fileName();
+		QString tmpFileName = fileName + ".tmp";
+		MappedTable<Slot> table(m_magic, m_version);
+		if (!table.create(tmpFileName, m_header->capacity * 2)) {
+			return false;
+		}
+		memcpy(table.m_header->extra, m_header->extra, sizeof(m_header->extra));
+		for (quint32 i = 0; i < m_header->capacity; i++) {
+			if (m_slots[i].hash) {
+				quint32 j = table.firstSlot(m_slots[i].hash);
+				while (table.m_slots[j].hash) {
+					j = table.nextSlot(j);
+				}
+				table.m_slots[j] = m_slots[i];
+				table.m_header->count++;
+			}
+		}
+		table.close();
+		close();
+		if (!replaceFile(tmpFileName, fileName)) {
+			qWarning() << "Couldn't replace index file" << fileName;
+			// Keep using the old table, it's still valid, just full
+			QFile::remove(tmpFileName);
+			open(fileName);
+			return false;
+		}
+		return open(fileName);
+	}
+
+private:
+	bool map()
+	{
+		m_data = m_file.map(0, m_file.size());
+		if (!m_data) {
+			return false;
+		}
+		m_header = reinterpret_cast<Header *>(m_data);
+		m_slots = reinterpret_cast<Slot *>(m_data + sizeof(Header));
+		return true;
+	}
+
+	char m_magic[8];
+	quint32 m_version;
+	QFile m_file;
+	uchar *m_data;
+	Header *m_header;
+	Slot *m_slots;
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef FPSUBMIT_NATIVEDECODER_H_
+#define FPSUBMIT_NATIVEDECODER_H_
+
+#include <stdint.h>
+
+class InputFile;
+
+// Decoder for one of the simple formats that make up most collections,
+// producing the interleaved 16-bit samples chromaprint takes without going
+// through FFmpeg's demuxer and codec machinery. The output must be exactly
+// what the FFmpeg path would produce, so open() fails for anything the
+// decoder doesn't fully support and the file is left to FFmpeg.
+class NativeDecoder
+{
+public:
+	NativeDecoder() : m_channels(0), m_sampleRate(0) {}
+	virtual ~NativeDecoder() {}
+
+	// Reads the headers from the start of the file.
+	virtual bool open(InputFile *input) = 0;
+
+	// Decodes the next block of audio and returns the number of frames in
+	// it, or 0 at the end of the stream. The samples are valid until the
+	// next call.
+	virtual int decode(const int16_t **samples) = 0;
+
+	// Number of times a buffer had to grow.
+	virtual int allocations() const = 0;
+
+	int channels() const { return m_channels; }
+	int sampleRate() const { return m_sampleRate; }
+
+protected:
+	int m_channels;
+	int m_sampleRate;
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include <QDir>
+#include <QFile>
+#include <QTextCodec>
+#include <string.h>
+#include "mappedtable.h"
+#include "pathstore.h"
+
+static const int NAME_CHUNK_BITS = 20;
+static const int NAME_CHUNK_SIZE = 1 << NAME_CHUNK_BITS;
+static const int MIN_TABLE_CAPACITY = 1024;
+
+Q_GLOBAL_STATIC(PathStore, globalPathStore)
+
+PathStore *PathStore::instance()
+{
+	return globalPathStore();
+}
+
+static inline quint32 entryHash(quint32 parent, const char *name, int size)
+{
+	return quint32(hashBytes(name, size, 14695981039346656037ULL ^ (quint64(parent) * 1099511628211ULL)));
+}
+
+PathStore::PathStore()
+	: m_chunkUsed(NAME_CHUNK_SIZE), m_stringMemoryUsage(0)
+{
+	m_directoryTable.fill(0, MIN_TABLE_CAPACITY);
+	m_fileTable.fill(0, MIN_TABLE_CAPACITY);
+}
+
+PathStore::~PathStore()
+{
+	foreach (char *chunk, m_chunks) {
+		delete[] chunk;
+	}
+}
+
+QByteArray PathStore::encodeName(const QString &name)
+{
+#ifdef Q_OS_WIN32
+	return name.toUtf8();
+#else
+	return QFile::encodeName(name);
+#endif
+}
+
+QString PathStore::decodeName(const QByteArray &name)
+{
+#ifdef Q_OS_WIN32
+	return QString::fromUtf8(name);
+#else
+	return QFile::decodeName(name);
+#endif
+}
+
+quint32 PathStore::storeName(const char *name, int size)
+{
+	if (m_chunkUsed + size + 1 > NAME_CHUNK_SIZE) {
+		m_chunks.append(new char[NAME_CHUNK_SIZE]);
+		m_chunkUsed = 0;
+	}
+	quint32 offset = (quint32(m_chunks.size() - 1) << NAME_CHUNK_BITS) | quint32(m_chunkUsed);
+	char *data = m_chunks.last() + m_chunkUsed;
+	memcpy(data, name, size);
+	data[size] = '\0';
+	m_chunkUsed += size + 1;
+	return offset;
+}
+
+const char *PathStore::name(quint32 offset) const
+{
+	return m_chunks.at(offset >> NAME_CHUNK_BITS) + (offset & (NAME_CHUNK_SIZE - 1));
+}
+
+void PathStore::rehashDirectories()
+{
+	m_directoryTable.fill(0, m_directoryTable.size() * 2);
+	quint32 mask = m_directoryTable.size() - 1;
+	for (int i = 0; i < m_directories.size(); i++) {
+		const Directory &directory = m_directories.at(i);
+		const char *data = name(directory.name);
+		quint32 slot = entryHash(directory.parent, data, strlen(data)) & mask;
+		while (m_directoryTable.at(slot)) {
+			slot = (slot + 1) & mask;
+		}
+		m_directoryTable[slot] = i + 1;
+	}
+}
+
+void PathStore::rehashFiles()
+{
+	m_fileTable.fill(0, m_fileTable.size() * 2);
+	quint32 mask = m_fileTable.size() - 1;
+	for (int i = 0; i < m_files.size(); i++) {
+		const File &file = m_files.at(i);
+		const char *data = name(file.name);
+		quint32 slot = entryHash(file.directory, data, strlen(data)) & mask;
+		while (m_fileTable.at(slot)) {
+			slot = (slot + 1) & mask;
+		}
+		m_fileTable[slot] = i + 1;
+	}
+}
+
+quint32 PathStore::insertDirectory(quint32 parent, const char *data, int size)
+{
+	quint32 mask = m_directoryTable.size() - 1;
+	quint32 slot = entryHash(parent, data, size) & mask;
+	while (quint32 handle = m_directoryTable.at(slot)) {
+		const Directory &directory = m_directories.at(handle - 1);
+		if (directory.parent == parent) {
+			const char *other = name(directory.name);
+			if (memcmp(other, data, size) == 0 && other[size] == '\0') {
+				return handle - 1;
+			}
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	Directory directory;
+	directory.parent = parent;
+	directory.name = storeName(data, size);
+	directory.length = size + (parent == InvalidHandle ? 0 : m_directories.at(parent).length);
+	quint32 handle = m_directories.size();
+	m_directories.append(directory);
+	m_directoryTable[slot] = handle + 1;
+	if (m_directories.size() * 4 > m_directoryTable.size() * 3) {
+		rehashDirectories();
+	}
+	return handle;
+}
+
+quint32 PathStore::insertFile(quint32 directory, const char *data, int size)
+{
+	quint32 mask = m_fileTable.size() - 1;
+	quint32 slot = entryHash(directory, data, size) & mask;
+	while (quint32 handle = m_fileTable.at(slot)) {
+		const File &file = m_files.at(handle - 1);
+		if (file.directory == directory) {
+			const char *other = name(file.name);
+			if (memcmp(other, data, size) == 0 && other[size] == '\0') {
+				return handle - 1;
+			}
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	File file;
+	file.directory = directory;
+	file.name = storeName(data, size);
+	quint32 handle = m_files.size();
+	m_files.append(file);
+	m_fileTable[slot] = handle + 1;
+	if (m_files.size() * 4 > m_fileTable.size() * 3) {
+		rehashFiles();
+	}
+	// Roughly a QString header, its UTF-16 data and a QList node
+	qint64 length = m_directories.at(directory).length + size;
+	m_stringMemoryUsage += 2 * (length + 1) + 4 * sizeof(void *);
+	return handle;
+}
+
+quint32 PathStore::addDirectory(const QString &path)
+{
+	QString cleanPath = QDir::fromNativeSeparators(path);
+	if (!cleanPath.endsWith('/')) {
+		cleanPath += '/';
+	}
+	QWriteLocker locker(&m_lock);
+	quint32 directory = InvalidHandle;
+	int start = 0;
+	while (start < cleanPath.size()) {
+		int end = cleanPath.indexOf('/', start) + 1;
+		QByteArray component = encodeName(cleanPath.mid(start, end - start));
+		directory = insertDirectory(directory, component.constData(), component.size());
+		start = end;
+	}
+	return directory;
+}
+
+quint32 PathStore::addDirectory(quint32 parent, const QByteArray &encodedName)
+{
+	QByteArray component = encodedName + '/';
+	QWriteLocker locker(&m_lock);
+	return insertDirectory(parent, component.constData(), component.size());
+}
+
+quint32 PathStore::addFile(const QString &path)
+{
+	QString cleanPath = QDir::fromNativeSeparators(path);
+	int pos = cleanPath.lastIndexOf('/');
+	quint32 directory = addDirectory(cleanPath.left(pos + 1));
+	return addFile(directory, encodeName(cleanPath.mid(pos + 1)));
+}
+
+quint32 PathStore::addFile(quint32 directory, const QByteArray &encodedName)
+{
+	QWriteLocker locker(&m_lock);
+	return insertFile(directory, encodedName.constData(), encodedName.size());
+}
+
+QList<quint32> PathStore::addFiles(quint32 directory, const QList<QByteArray> &encodedNames)
+{
+	QList<quint32> result;
+	result.reserve(encodedNames.size());
+	QWriteLocker locker(&m_lock);
+	foreach (const QByteArray &encodedName, encodedNames) {
+		result.append(insertFile(directory, encodedName.constData(), encodedName.size()));
+	}
+	return result;
+}
+
+void PathStore::appendDirectoryPath(QByteArray *result, quint32 directory) const
+{
+	// Fill the path in from the end, walking up the tree
+	int end = result->size() + m_directories.at(directory).length;
+	result->resize(end);
+	char *data = result->data();
+	while (directory != InvalidHandle) {
+		const Directory &node = m_directories.at(directory);
+		const char *component = name(node.name);
+		int size = strlen(component);
+		end -= size;
+		memcpy(data + end, component, size);
+		directory = node.parent;
+	}
+}
+
+QByteArray PathStore::encodedDirectoryPath(quint32 directory)
+{
+	QReadLocker locker(&m_lock);
+	QByteArray result;
+	appendDirectoryPath(&result, directory);
+	return result;
+}
+
+QString PathStore::directoryPath(quint32 directory)
+{
+	return decodeName(encodedDirectoryPath(directory));
+}
+
+QByteArray PathStore::encodedPath(quint32 handle)
+{
+	QReadLocker locker(&m_lock);
+	const File &file = m_files.at(handle);
+	const char *fileName = name(file.name);
+	QByteArray result;
+	result.reserve(m_directories.at(file.directory).length + strlen(fileName));
+	appendDirectoryPath(&result, file.directory);
+	result.append(fileName);
+	return result;
+}
+
+QString PathStore::path(quint32 file)
+{
+	return decodeName(encodedPath(file));
+}
+
+QByteArray PathStore::utf8Path(quint32 file)
+{
+#ifdef Q_OS_WIN32
+	return encodedPath(file);
+#else
+	static bool localeIsUtf8 = QTextCodec::codecForLocale()->mibEnum() == 106;
+	if (localeIsUtf8) {
+		return encodedPath(file);
+	}
+	return path(file).toUtf8();
+#endif
+}
+
+int PathStore::fileCount()
+{
+	QReadLocker locker(&m_lock);
+	return m_files.size();
+}
+
+int PathStore::directoryCount()
+{
+	QReadLocker locker(&m_lock);
+	return m_directories.size();
+}
+
+qint64 PathStore::memoryUsage()
+{
+	QReadLocker locker(&m_lock);
+	return qint64(m_chunks.size()) * NAME_CHUNK_SIZE +
+		qint64(m_directories.capacity()) * sizeof(Directory) +
+		qint64(m_files.capacity()) * sizeof(File) +
+		qint64(m_directoryTable.size() + m_fileTable.size()) * sizeof(quint32);
+}
+
+qint64 PathStore::stringMemoryUsage()
+{
+	QReadLocker locker(&m_lock);
+	return m_stringMemoryUsage;
+}
@@ -0,0 +1,83 @@
+#ifndef FPSUBMIT_PATHSTORE_H_
+#define FPSUBMIT_PATHSTORE_H_
+
+#include <QReadWriteLock>
+#include <QVector>
+#include <QList>
+#include <QStringList>
+
+// Interned storage for the paths of all files seen by the fingerprinter.
+// Directories form a tree of nodes, each holding one encoded path component
+// and a link to its parent, and files are a directory node plus a name. The
+// names live in large shared chunks, so a file costs a few bytes on top of
+// its name instead of a heap-allocated UTF-16 copy of its full path. Files
+// and directories are identified by 32-bit handles, adding the same path
+// again returns the existing handle.
+class PathStore
+{
+public:
+	enum { InvalidHandle = 0xffffffff };
+
+	PathStore();
+	~PathStore();
+
+	static PathStore *instance();
+
+	// Adds all components of an absolute directory path.
+	quint32 addDirectory(const QString &path);
+	quint32 addDirectory(quint32 parent, const QByteArray &encodedName);
+	quint32 addFile(const QString &path);
+	quint32 addFile(quint32 directory, const QByteArray &encodedName);
+	QList<quint32> addFiles(quint32 directory, const QList<QByteArray> &encodedNames);
+
+	QString path(quint32 file);
+	QByteArray encodedPath(quint32 file);
+	QByteArray utf8Path(quint32 file);
+	QString directoryPath(quint32 directory);
+	// Includes the trailing slash.
+	QByteArray encodedDirectoryPath(quint32 directory);
+
+	int fileCount();
+	int directoryCount();
+	// Bytes used by the store and, for comparison, what the same paths
+	// would take as individual QStrings in a QStringList.
+	qint64 memoryUsage();
+	qint64 stringMemoryUsage();
+
+	static QByteArray encodeName(const QString &name);
+	static QString decodeName(const QByteArray &name);
+
+private:
+	struct Directory
+	{
+		quint32 parent;
+		quint32 name;
+		quint32 length;
+	};
+
+	struct File
+	{
+		quint32 directory;
+		quint32 name;
+	};
+
+	quint32 insertDirectory(quint32 parent, const char *name, int size);
+	quint32 insertFile(quint32 directory, const char *name, int size);
+	quint32 storeName(const char *name, int size);
+	const char *name(quint32 offset) const;
+	void appendDirectoryPath(QByteArray *result, quint32 directory) const;
+	void rehashDirectories();
+	void rehashFiles();
+
+	QReadWriteLock m_lock;
+	QVector<char *> m_chunks;
+	int m_chunkUsed;
+	QVector<Directory> m_directories;
+	QVector<File> m_files;
+	// Open-addressed tables of handles + 1, used to find existing entries
+	QVector<quint32> m_directoryTable;
+	QVector<quint32> m_fileTable;
+	qint64 m_stringMemoryUsage;
+};
+
+#endif
@@ -20,7 +20,9 @@ ProgressDialog::ProgressDialog(QWidget *parent, Fingerprinter *fingerprinter)
 	setupUi();
     connect(fingerprinter, SIGNAL(fileListLoadingStarted()), SLOT(onFileListLoadingStarted()));
     connect(fingerprinter, SIGNAL(fingerprintingStarted(int)), SLOT(onFingerprintingStarted(int)));
+    connect(fingerprinter, SIGNAL(fileCountChanged(int)), SLOT(onFileCountChanged(int)));
     connect(fingerprinter, SIGNAL(currentPathChanged(const QString &)), SLOT(onCurrentPathChanged(const QString &)));
+    connect(fingerprinter, SIGNAL(statusChanged(const QString &)), SLOT(onStatusChanged(const QString &)));
     connect(fingerprinter, SIGNAL(finished()), SLOT(onFinished()));
     connect(fingerprinter, SIGNAL(networkError(const QString &)), SLOT(onNetworkError(const QString &)));
     connect(fingerprinter, SIGNAL(authenticationError()), SLOT(onAuthenticationError()));
@@ -87,6 +89,11 @@ void ProgressDialog::onFingerprintingStarted(int count)
 	m_mainStatusLabel->setText(tr("Fingerprinting..."));
 }
 
+void ProgressDialog::onFileCountChanged(int count)
+{
+	m_progressBar->setMaximum(count);
+}
+
 void ProgressDialog::onFinished()
 {
 	m_mainStatusLabel->setText(tr("Submitted %n fingerprint(s), thank you!", "", m_fingerprinter->submitttedFingerprints()));
@@ -95,6 +102,11 @@ void ProgressDialog::onFinished()
 	m_stopButton->setVisible(false);
 }
 
+void ProgressDialog::onStatusChanged(const QString &message)
+{
+	m_mainStatusLabel->setText(message);
+}
+
 void ProgressDialog::onCurrentPathChanged(const QString &path)
 {
     QString elidedPath =
@@ -20,7 +20,9 @@ public slots:
     void stop();
 	void onFileListLoadingStarted();
 	void onFingerprintingStarted(int count);
+	void onFileCountChanged(int count);
 	void onCurrentPathChanged(const QString &path);
+	void onStatusChanged(const QString &message);
 	void onFinished();
 	void onNetworkError(const QString &message);
 	void onAuthenticationError();
@@ -0,0 +1,125 @@
+#include <QThreadStorage>
+#include <new>
+#include "analyzefiletask.h"
+#include "constants.h"
+#include "resultarena.h"
+
+struct StringPool
+{
+	StringPool() : next(0) {}
+
+	QString strings[RESULT_STRING_POOL_SIZE];
+	int next;
+};
+
+// Freed when the thread exits
+Q_GLOBAL_STATIC(QThreadStorage<StringPool *>, stringPools)
+
+Q_GLOBAL_STATIC_WITH_ARGS(ResultArena, globalResultArena, (sizeof(AnalyzeResult)))
+
+ResultArena *ResultArena::instance()
+{
+	return globalResultArena();
+}
+
+ResultArena::ResultArena(size_t recordSize)
+	: m_recordSize(recordSize), m_current(0), m_enabled(true)
+{
+}
+
+ResultArena::~ResultArena()
+{
+	// Blocks with live records are left alone, they are freed by the last one
+	if (m_current && !m_current->live) {
+		::operator delete(m_current);
+	}
+}
+
+void ResultArena::setEnabled(bool enabled)
+{
+	QMutexLocker locker(&m_mutex);
+	m_enabled = enabled;
+}
+
+ResultArena::Stats ResultArena::stats()
+{
+	QMutexLocker locker(&m_mutex);
+	return m_stats;
+}
+
+void *ResultArena::allocate(size_t size)
+{
+	QMutexLocker locker(&m_mutex);
+	m_stats.records++;
+	m_stats.liveRecords++;
+	if (!m_enabled || size > m_recordSize) {
+		Header *header = static_cast<Header *>(::operator new(sizeof(Header) + size));
+		header->block = 0;
+		return header + 1;
+	}
+	if (m_current && m_current->used == RESULT_ARENA_BLOCK_SIZE) {
+		if (!m_current->live) {
+			m_current->used = 0;
+		}
+		else {
+			// Freed together with its last record
+			m_current = 0;
+		}
+	}
+	if (!m_current) {
+		m_current = static_cast<Block *>(::operator new(sizeof(Block) + RESULT_ARENA_BLOCK_SIZE * slotSize()));
+		m_current->used = 0;
+		m_current->live = 0;
+		m_stats.blocks++;
+	}
+	char *slot = reinterpret_cast<char *>(m_current + 1) + m_current->used * slotSize();
+	m_current->used++;
+	if (m_current->live++ == 0) {
+		m_stats.liveBlocks++;
+	}
+	Header *header = reinterpret_cast<Header *>(slot);
+	header->block = m_current;
+	return header + 1;
+}
+
+void ResultArena::release(void *record)
+{
+	if (!record) {
+		return;
+	}
+	Header *header = static_cast<Header *>(record) - 1;
+	QMutexLocker locker(&m_mutex);
+	m_stats.liveRecords--;
+	Block *block = header->block;
+	if (!block) {
+		::operator delete(header);
+		return;
+	}
+	if (!--block->live) {
+		m_stats.liveBlocks--;
+		// The current block is kept for the next records
+		if (block != m_current) {
+			::operator delete(block);
+		}
+	}
+}
+
+QString ResultArena::intern(const QString &string)
+{
+	if (string.isEmpty()) {
+		return string;
+	}
+	QThreadStorage<StringPool *> *storage = stringPools();
+	if (!storage->hasLocalData()) {
+		storage->setLocalData(new StringPool());
+	}
+	StringPool *pool = storage->localData();
+	for (int i = 0; i < RESULT_STRING_POOL_SIZE; i++) {
+		if (pool->strings[i] == string) {
+			return pool->strings[i];
+		}
+	}
+	pool->strings[pool->next] = string;
+	pool->next = (pool->next + 1) % RESULT_STRING_POOL_SIZE;
+	return string;
+}
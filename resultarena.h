@@ -0,0 +1,77 @@
+#ifndef FPSUBMIT_RESULTARENA_H_
+#define FPSUBMIT_RESULTARENA_H_
+
+#include <QMutex>
+#include <QString>
+#include <stddef.h>
+
+// Memory for AnalyzeResult records. Records are carved out of blocks that
+// hold one submission batch each, in the order the analysis finishes, and
+// they are submitted and freed in about the same order, so a block is
+// usually released as a whole soon after its batch was sent. A large
+// backlog then costs one allocation per batch instead of one per result,
+// and the records of a batch sit next to each other. There is a single
+// arena for the whole process, shared by the analysis threads behind a
+// mutex. A block is only freed once all of its records are, so every
+// result has to be deleted, one that leaks keeps its whole block alive.
+class ResultArena
+{
+public:
+	struct Stats
+	{
+		Stats() : records(0), blocks(0), liveRecords(0), liveBlocks(0) {}
+
+		// Allocated so far
+		qint64 records;
+		qint64 blocks;
+		int liveRecords;
+		// Blocks with live records in them
+		int liveBlocks;
+	};
+
+	explicit ResultArena(size_t recordSize);
+	~ResultArena();
+
+	static ResultArena *instance();
+
+	void *allocate(size_t size);
+	void release(void *record);
+
+	// With the arena disabled every record is a separate heap allocation,
+	// for comparison.
+	void setEnabled(bool enabled);
+	Stats stats();
+
+	// Returns a string equal to the given one, sharing the data with it if
+	// it was interned on the same thread recently. Tracks from the same
+	// album have the same artist, album and album artist, and they are
+	// usually analyzed one after another, so a handful of strings per thread
+	// is enough.
+	static QString intern(const QString &string);
+
+private:
+	struct Block
+	{
+		int used;
+		int live;
+		// Keeps the slots 16 bytes aligned
+		int reserved[2];
+	};
+
+	// In front of every record
+	struct Header
+	{
+		Block *block;
+		void *reserved;
+	};
+
+	size_t slotSize() const { return (sizeof(Header) + m_recordSize + 15) & ~size_t(15); }
+
+	QMutex m_mutex;
+	size_t m_recordSize;
+	Block *m_current;
+	Stats m_stats;
+	bool m_enabled;
+};
+
+#endif
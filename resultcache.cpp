@@ -0,0 +1,512 @@
+#include <QDir>
+#include <QFileInfo>
+#include <QDataStream>
+#include <QStringList>
+#include <QtAlgorithms>
+#include <QDebug>
+#include "crc.h"
+#include "utils.h"
+#include "pathstore.h"
+#include "resultarena.h"
+#include "analyzefiletask.h"
+#include "constants.h"
+#include "resultcache.h"
+
+static const char *RESULT_INDEX_MAGIC = "AIDRESIX";
+static const quint32 RESULT_INDEX_VERSION = 1;
+static const quint32 MIN_RESULT_INDEX_CAPACITY = 1 << 12;
+static const quint32 RESULT_RECORD_MAGIC = 0x52444941;
+
+// Each record is this header followed by the result serialized with
+// QDataStream, padded so that the next header is aligned.
+struct RecordHeader
+{
+	quint32 magic;
+	// Size of the serialized result
+	quint32 length;
+	// CRC-32 of the serialized result
+	quint32 checksum;
+	quint32 reserved;
+	quint64 device;
+	quint64 inode;
+	qint64 size;
+	qint64 mtime;
+	quint64 pathHash;
+};
+
+static quint32 recordSize(quint32 length)
+{
+	return (sizeof(RecordHeader) + length + 7) & ~7;
+}
+
+static quint32 checksum(const char *data, int size)
+{
+	crc_t crc = crc_init();
+	crc = crc_update(crc, reinterpret_cast<const unsigned char *>(data), size);
+	return quint32(crc_finalize(crc));
+}
+
+static quint64 keyHash(quint64 device, quint64 inode, quint64 pathHash)
+{
+	// Without inode numbers (Windows) the best we can do is to key by path
+	if (!inode) {
+		return pathHash;
+	}
+	quint64 key[2] = { device, inode };
+	return hashBytes(reinterpret_cast<const char *>(key), sizeof(key));
+}
+
+static QByteArray serializeResult(const AnalyzeResult *result, quint64 pathHash)
+{
+	QByteArray payload;
+	QDataStream stream(&payload, QIODevice::WriteOnly);
+	stream.setVersion(QDataStream::Qt_4_6);
+	stream << result->mbid << result->track << result->artist << result->album << result->albumArtist << result->puid;
+	stream << qint32(result->trackNo) << qint32(result->discNo) << qint32(result->year);
+	stream << qint32(result->length) << qint32(result->bitrate);
+	stream << result->fingerprint;
+
+	RecordHeader header;
+	header.magic = RESULT_RECORD_MAGIC;
+	header.length = payload.size();
+	header.checksum = checksum(payload.constData(), payload.size());
+	header.reserved = 0;
+	header.device = result->fileState.device;
+	header.inode = result->fileState.inode;
+	header.size = result->fileState.size;
+	header.mtime = result->fileState.mtime;
+	header.pathHash = pathHash;
+
+	QByteArray record(reinterpret_cast<const char *>(&header), sizeof(header));
+	record += payload;
+	record += QByteArray(recordSize(header.length) - record.size(), '\0');
+	return record;
+}
+
+static AnalyzeResult *deserializeResult(const uchar *record)
+{
+	const RecordHeader *header = reinterpret_cast<const RecordHeader *>(record);
+	QByteArray payload = QByteArray::fromRawData(reinterpret_cast<const char *>(record + sizeof(RecordHeader)), header->length);
+	QDataStream stream(payload);
+	stream.setVersion(QDataStream::Qt_4_6);
+	AnalyzeResult *result = new AnalyzeResult();
+	qint32 trackNo, discNo, year, length, bitrate;
+	stream >> result->mbid >> result->track >> result->artist >> result->album >> result->albumArtist >> result->puid;
+	stream >> trackNo >> discNo >> year >> length >> bitrate;
+	stream >> result->fingerprint;
+	if (stream.status() != QDataStream::Ok) {
+		delete result;
+		return 0;
+	}
+	result->artist = ResultArena::intern(result->artist);
+	result->album = ResultArena::intern(result->album);
+	result->albumArtist = ResultArena::intern(result->albumArtist);
+	result->trackNo = trackNo;
+	result->discNo = discNo;
+	result->year = year;
+	result->length = length;
+	result->bitrate = bitrate;
+	return result;
+}
+
+static bool isValidRecord(const uchar *record, qint64 available)
+{
+	if (available < qint64(sizeof(RecordHeader))) {
+		return false;
+	}
+	const RecordHeader *header = reinterpret_cast<const RecordHeader *>(record);
+	return header->magic == RESULT_RECORD_MAGIC && recordSize(header->length) <= available &&
+	       header->checksum == checksum(reinterpret_cast<const char *>(record + sizeof(RecordHeader)), header->length);
+}
+
+Q_GLOBAL_STATIC(ResultCache, globalResultCache)
+
+ResultCache *ResultCache::instance()
+{
+	return globalResultCache();
+}
+
+ResultCache::ResultCache(const QString &directory)
+	: m_directory(directory.isEmpty() ? QDir::cleanPath(cacheFileName() + "/..") : directory),
+	  m_indexFileName(m_directory + "/results.idx"),
+	  m_index(RESULT_INDEX_MAGIC, RESULT_INDEX_VERSION), m_opened(false)
+{
+}
+
+ResultCache::~ResultCache()
+{
+	close();
+}
+
+QString ResultCache::segmentFileName(quint32 segment) const
+{
+	return m_directory + QString("/results.%1.seg").arg(segment, 6, 10, QChar('0'));
+}
+
+QList<quint32> ResultCache::segmentNumbers() const
+{
+	QList<quint32> segments;
+	foreach (const QString &name, QDir(m_directory).entryList(QStringList() << "results.*.seg", QDir::Files)) {
+		bool ok;
+		quint32 segment = name.section('.', 1, 1).toUInt(&ok);
+		if (ok) {
+			segments.append(segment);
+		}
+	}
+	qSort(segments);
+	return segments;
+}
+
+bool ResultCache::open()
+{
+	m_opened = true;
+	QDir().mkpath(m_directory);
+	QList<quint32> segments = segmentNumbers();
+
+	// The index is thrown away if it describes more data than the last
+	// segment has, which means the segments were replaced behind our back
+	bool valid = m_index.open(m_indexFileName);
+	if (valid) {
+		QFileInfo fileInfo(segmentFileName(lastSegment()));
+		valid = lastSegmentSize() <= quint64(fileInfo.exists() ? fileInfo.size() : 0);
+	}
+	if (!valid) {
+		qDebug() << "Creating new result cache index" << m_indexFileName;
+		if (!m_index.create(m_indexFileName, MIN_RESULT_INDEX_CAPACITY)) {
+			return false;
+		}
+		if (!segments.isEmpty()) {
+			m_index.header()->extra[0] = segments.first();
+		}
+	}
+
+	// Pick up the records that were appended after the index was last
+	// updated, there might be some if the previous run crashed in between
+	foreach (quint32 segment, segments) {
+		if (segment >= lastSegment()) {
+			indexSegment(segment, segment == lastSegment() ? lastSegmentSize() : 0, segment == segments.last());
+		}
+	}
+
+	quint64 totalSize = 0, liveSize = 0;
+	foreach (quint32 segment, segments) {
+		totalSize += QFileInfo(segmentFileName(segment)).size();
+	}
+	for (quint32 i = 0; i < m_index.capacity(); i++) {
+		if (m_index.slot(i)->hash) {
+			liveSize += m_index.slot(i)->length;
+		}
+	}
+	if (totalSize > quint64(RESULT_CACHE_SEGMENT_SIZE) && liveSize * 2 < totalSize) {
+		compact();
+	}
+	return true;
+}
+
+void ResultCache::close()
+{
+	m_appendFile.close();
+	qDeleteAll(m_segments);
+	m_segments.clear();
+	m_index.close();
+}
+
+const uchar *ResultCache::mapSegment(quint32 segment, qint64 end)
+{
+	Segment *s = m_segments.value(segment);
+	if (s && s->mappedSize >= end) {
+		return s->data;
+	}
+	if (!s) {
+		s = new Segment();
+		s->file.setFileName(segmentFileName(segment));
+		if (!s->file.open(QIODevice::ReadOnly)) {
+			delete s;
+			return 0;
+		}
+		m_segments.insert(segment, s);
+	}
+	// The segment grew since it was mapped
+	if (s->data) {
+		s->file.unmap(s->data);
+		s->data = 0;
+		s->mappedSize = 0;
+	}
+	qint64 size = s->file.size();
+	if (size == 0 || size < end) {
+		return 0;
+	}
+	s->data = s->file.map(0, size);
+	if (!s->data) {
+		qWarning() << "Couldn't map result cache segment" << s->file.fileName();
+		return 0;
+	}
+	s->mappedSize = size;
+	return s->data;
+}
+
+void ResultCache::indexSegment(quint32 segment, qint64 start, bool last)
+{
+	QString fileName = segmentFileName(segment);
+	qint64 size = QFileInfo(fileName).size();
+	m_index.header()->extra[0] = segment;
+	m_index.header()->extra[1] = start;
+	const uchar *data = size > start ? mapSegment(segment, size) : 0;
+	if (!data) {
+		return;
+	}
+	int records = 0;
+	qint64 offset = start;
+	while (offset < size && isValidRecord(data + offset, size - offset)) {
+		if (!updateSlot(&m_index, data + offset, segment, offset)) {
+			return;
+		}
+		offset += recordSize(reinterpret_cast<const RecordHeader *>(data + offset)->length);
+		m_index.header()->extra[1] = offset;
+		records++;
+	}
+	if (records) {
+		qDebug() << "Indexed" << records << "results from" << fileName;
+	}
+	if (offset < size) {
+		// A crash in the middle of a write can leave a partial record at the
+		// end of the last segment, anything we append has to go after it
+		if (last) {
+			qWarning() << "Truncating torn tail of" << fileName << "from" << size << "to" << offset << "bytes";
+			delete m_segments.take(segment);
+			QFile::resize(fileName, offset);
+		}
+		else {
+			qWarning() << "Ignoring damaged data at the end of" << fileName;
+		}
+	}
+}
+
+ResultCache::Slot *ResultCache::findSlot(MappedTable<Slot> *table, quint64 hash, quint64 device, quint64 inode, quint64 pathHash)
+{
+	for (quint32 i = table->firstSlot(hash); table->slot(i)->hash; i = table->nextSlot(i)) {
+		Slot *slot = table->slot(i);
+		if (slot->hash != hash) {
+			continue;
+		}
+		if (inode ? (slot->device == device && slot->inode == inode) : slot->pathHash == pathHash) {
+			return slot;
+		}
+	}
+	return 0;
+}
+
+ResultCache::Slot *ResultCache::updateSlot(MappedTable<Slot> *table, const uchar *record, quint32 segment, quint64 offset)
+{
+	const RecordHeader *header = reinterpret_cast<const RecordHeader *>(record);
+	quint64 hash = keyHash(header->device, header->inode, header->pathHash);
+	Slot *slot = findSlot(table, hash, header->device, header->inode, header->pathHash);
+	if (!slot) {
+		slot = table->insert(hash);
+		if (!slot) {
+			return 0;
+		}
+	}
+	slot->device = header->device;
+	slot->inode = header->inode;
+	slot->size = header->size;
+	slot->mtime = header->mtime;
+	slot->pathHash = header->pathHash;
+	slot->segment = segment;
+	slot->offset = offset;
+	slot->length = recordSize(header->length);
+	return slot;
+}
+
+bool ResultCache::append(MappedTable<Slot> *table, QFile *file, const QByteArray &record)
+{
+	// Start a new segment once the current one is full
+	if (table->header()->extra[1] > 0 && table->header()->extra[1] + record.size() > quint64(RESULT_CACHE_SEGMENT_SIZE)) {
+		file->close();
+		table->header()->extra[0]++;
+		table->header()->extra[1] = 0;
+	}
+	quint32 segment = quint32(table->header()->extra[0]);
+	quint64 offset = table->header()->extra[1];
+	if (!file->isOpen()) {
+		file->setFileName(segmentFileName(segment));
+		if (!file->open(QIODevice::Append)) {
+			qCritical() << "Couldn't open result cache segment" << file->fileName() << "for writing";
+			return false;
+		}
+	}
+	if (file->write(record) != record.size() || !file->flush()) {
+		qCritical() << "Couldn't write to result cache segment" << file->fileName();
+		// Don't leave a partial record where the next one is going to be
+		file->resize(offset);
+		file->close();
+		return false;
+	}
+	// Growing the table moves the header, so it's looked up again
+	if (!updateSlot(table, reinterpret_cast<const uchar *>(record.constData()), segment, offset)) {
+		return false;
+	}
+	table->header()->extra[1] = offset + record.size();
+	return true;
+}
+
+bool ResultCache::isOlder(const Slot &a, const Slot &b)
+{
+	return a.segment < b.segment || (a.segment == b.segment && a.offset < b.offset);
+}
+
+void ResultCache::compact()
+{
+	qDebug() << "Compacting result cache" << m_directory;
+
+	// Copy the live records to new segments in the order they were written,
+	// with a new index that replaces the current one when everything is done
+	QList<Slot> live;
+	for (quint32 i = 0; i < m_index.capacity(); i++) {
+		const Slot *slot = m_index.slot(i);
+		if (slot->hash && slot->length) {
+			live.append(*slot);
+		}
+	}
+	qSort(live.begin(), live.end(), isOlder);
+
+	quint32 capacity = MIN_RESULT_INDEX_CAPACITY;
+	while (live.size() * 2ULL > capacity) {
+		capacity *= 2;
+	}
+	QList<quint32> oldSegments = segmentNumbers();
+	quint32 firstSegment = lastSegment() + 1;
+	QString tmpFileName = m_indexFileName + ".tmp";
+	MappedTable<Slot> table(RESULT_INDEX_MAGIC, RESULT_INDEX_VERSION);
+	if (!table.create(tmpFileName, capacity)) {
+		return;
+	}
+	table.header()->extra[0] = firstSegment;
+	QFile file;
+	foreach (const Slot &slot, live) {
+		const uchar *data = mapSegment(slot.segment, slot.offset + slot.length);
+		if (!data) {
+			continue;
+		}
+		QByteArray record = QByteArray::fromRawData(reinterpret_cast<const char *>(data + slot.offset), slot.length);
+		if (!append(&table, &file, record)) {
+			file.close();
+			quint32 segment = quint32(table.header()->extra[0]);
+			table.close();
+			QFile::remove(tmpFileName);
+			for (quint32 i = firstSegment; i <= segment; i++) {
+				QFile::remove(segmentFileName(i));
+			}
+			return;
+		}
+	}
+	file.close();
+	quint32 lastNewSegment = quint32(table.header()->extra[0]);
+	table.close();
+
+	close();
+	if (!replaceFile(tmpFileName, m_indexFileName)) {
+		// Carry on with the old index and segments
+		qWarning() << "Couldn't replace result cache index" << m_indexFileName;
+		QFile::remove(tmpFileName);
+		for (quint32 i = firstSegment; i <= lastNewSegment; i++) {
+			QFile::remove(segmentFileName(i));
+		}
+		m_index.open(m_indexFileName);
+		return;
+	}
+	foreach (quint32 segment, oldSegments) {
+		QFile::remove(segmentFileName(segment));
+	}
+	m_index.open(m_indexFileName);
+}
+
+quint64 ResultCache::pathHash(quint32 file) const
+{
+	QByteArray path = PathStore::instance()->utf8Path(file);
+	return hashBytes(path.constData(), path.size());
+}
+
+AnalyzeResult *ResultCache::find(quint32 file, const FileState &state)
+{
+	if (!state.isValid()) {
+		return 0;
+	}
+	quint64 path = pathHash(file);
+
+	QMutexLocker locker(&m_mutex);
+	if (!m_opened) {
+		open();
+	}
+	if (!m_index.isOpen()) {
+		return 0;
+	}
+	const Slot *slot = findSlot(&m_index, keyHash(state.device, state.inode, path), state.device, state.inode, path);
+	if (!slot || !slot->length || slot->size != state.size || slot->mtime != state.mtime) {
+		return 0;
+	}
+	const uchar *data = mapSegment(slot->segment, slot->offset + slot->length);
+	if (!data) {
+		return 0;
+	}
+	// Double check the key, in case the index doesn't match the segments
+	const RecordHeader *header = reinterpret_cast<const RecordHeader *>(data + slot->offset);
+	if (header->magic != RESULT_RECORD_MAGIC || recordSize(header->length) != slot->length ||
+	    header->device != slot->device || header->inode != slot->inode ||
+	    header->size != slot->size || header->mtime != slot->mtime) {
+		return 0;
+	}
+	AnalyzeResult *result = deserializeResult(data + slot->offset);
+	if (result) {
+		result->file = file;
+		result->fileState = state;
+	}
+	return result;
+}
+
+void ResultCache::insert(const AnalyzeResult *result)
+{
+	const FileState &state = result->fileState;
+	if (result->error || !state.isValid()) {
+		return;
+	}
+	quint64 path = pathHash(result->file);
+
+	QMutexLocker locker(&m_mutex);
+	if (!m_opened) {
+		open();
+	}
+	if (!m_index.isOpen()) {
+		return;
+	}
+	// Results that came from the cache are already there, the path doesn't
+	// matter for files that were only moved
+	const Slot *slot = findSlot(&m_index, keyHash(state.device, state.inode, path), state.device, state.inode, path);
+	if (slot && slot->length && slot->size == state.size && slot->mtime == state.mtime) {
+		return;
+	}
+	append(&m_index, &m_appendFile, serializeResult(result, path));
+}
+
+void ResultCache::remove(quint32 file, const FileState &state)
+{
+	if (!state.isValid()) {
+		return;
+	}
+	quint64 path = pathHash(file);
+
+	QMutexLocker locker(&m_mutex);
+	if (!m_opened) {
+		open();
+	}
+	if (!m_index.isOpen()) {
+		return;
+	}
+	// The record stays in its segment until the next compaction. If the
+	// index has to be rebuilt, it will come back, but by then the file state
+	// cache keeps the file from being analyzed again anyway.
+	Slot *slot = findSlot(&m_index, keyHash(state.device, state.inode, path), state.device, state.inode, path);
+	if (slot) {
+		slot->length = 0;
+	}
+}
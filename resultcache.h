@@ -0,0 +1,88 @@
+#ifndef FPSUBMIT_RESULTCACHE_H_
+#define FPSUBMIT_RESULTCACHE_H_
+
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include "mappedtable.h"
+#include "filestatecache.h"
+
+struct AnalyzeResult;
+
+// Analysis results that haven't been submitted yet, so that a run that
+// stops early, e.g. because of a network error, doesn't have to decode the
+// same files again next time. Records are appended to segment files
+// results.N.seg in the cache directory and never modified in place, and
+// results.idx holds a memory-mapped hash table keyed by device and inode
+// number, pointing to the latest record of each file. A record is only used
+// while the size and mtime of the file match. Submitted files are dropped
+// from the index, and when most of the segment data is dead, the records
+// that are still live are copied to new segments and the old ones deleted.
+class ResultCache
+{
+public:
+	// The default is the cache directory.
+	explicit ResultCache(const QString &directory = QString());
+	~ResultCache();
+
+	static ResultCache *instance();
+
+	// Returns a new copy of the cached result for this version of the file,
+	// or 0 if there is none.
+	AnalyzeResult *find(quint32 file, const FileState &state);
+	// Stores a successful result, unless it's already there.
+	void insert(const AnalyzeResult *result);
+	void remove(quint32 file, const FileState &state);
+
+private:
+	struct Slot
+	{
+		quint64 hash;
+		quint64 device;
+		quint64 inode;
+		qint64 size;
+		qint64 mtime;
+		quint64 pathHash;
+		quint64 offset;
+		quint32 segment;
+		// Size of the record including its header, zero once it's removed
+		quint32 length;
+	};
+
+	struct Segment
+	{
+		Segment() : data(0), mappedSize(0) {}
+		~Segment() { if (data) file.unmap(data); }
+
+		QFile file;
+		uchar *data;
+		qint64 mappedSize;
+	};
+
+	bool open();
+	void close();
+	QString segmentFileName(quint32 segment) const;
+	QList<quint32> segmentNumbers() const;
+	const uchar *mapSegment(quint32 segment, qint64 end);
+	void indexSegment(quint32 segment, qint64 start, bool last);
+	Slot *findSlot(MappedTable<Slot> *table, quint64 hash, quint64 device, quint64 inode, quint64 pathHash);
+	Slot *updateSlot(MappedTable<Slot> *table, const uchar *record, quint32 segment, quint64 offset);
+	bool append(MappedTable<Slot> *table, QFile *file, const QByteArray &record);
+	void compact();
+	static bool isOlder(const Slot &a, const Slot &b);
+	quint64 pathHash(quint32 file) const;
+
+	quint32 lastSegment() const { return quint32(m_index.header()->extra[0]); }
+	quint64 lastSegmentSize() const { return m_index.header()->extra[1]; }
+
+	QMutex m_mutex;
+	QString m_directory;
+	QString m_indexFileName;
+	MappedTable<Slot> m_index;
+	QHash<quint32, Segment *> m_segments;
+	QFile m_appendFile;
+	bool m_opened;
+};
+
+#endif
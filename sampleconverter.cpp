@@ -0,0 +1,337 @@
+#include <math.h>
+#include "simd.h"
+#include "sampleconverter.h"
+
+static inline int16_t convertSample(uint8_t value)
+{
+	return int16_t((int(value) - 128) << 8);
+}
+
+static inline int16_t convertSample(int16_t value)
+{
+	return value;
+}
+
+static inline int16_t convertSample(int32_t value)
+{
+	return int16_t(value >> 16);
+}
+
+// The comparisons are written the same way as minps/maxps work, so that
+// NaNs end up at the same value as in the vector code
+static inline int16_t convertSample(float value)
+{
+	value *= 32768.0f;
+	value = value < 32767.0f ? value : 32767.0f;
+	value = value > -32768.0f ? value : -32768.0f;
+	return int16_t(lrintf(value));
+}
+
+static inline int16_t convertSample(double value)
+{
+	value *= 32768.0;
+	value = value < 32767.0 ? value : 32767.0;
+	value = value > -32768.0 ? value : -32768.0;
+	return int16_t(lrint(value));
+}
+
+template <typename T>
+static void convertInterleaved(const uint8_t *const *planes, int channels, int samples, int16_t *output)
+{
+	const T *input = reinterpret_cast<const T *>(planes[0]);
+	int count = samples * channels;
+	for (int i = 0; i < count; i++) {
+		output[i] = convertSample(input[i]);
+	}
+}
+
+template <typename T>
+static void convertPlanar(const uint8_t *const *planes, int channels, int samples, int16_t *output)
+{
+	for (int c = 0; c < channels; c++) {
+		const T *input = reinterpret_cast<const T *>(planes[c]);
+		int16_t *ptr = output + c;
+		for (int i = 0; i < samples; i++) {
+			*ptr = convertSample(input[i]);
+			ptr += channels;
+		}
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Each of these loads 8 (SSE2) or 16 (AVX2) samples and returns them
+// converted to 16-bit, in their original order
+struct FloatSamples
+{
+	typedef float Type;
+
+	TARGET_SSE2 static inline __m128i load8(const float *input)
+	{
+		const __m128 scale = _mm_set1_ps(32768.0f);
+		const __m128 max = _mm_set1_ps(32767.0f);
+		const __m128 min = _mm_set1_ps(-32768.0f);
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(input), scale);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(input + 4), scale);
+		a = _mm_max_ps(_mm_min_ps(a, max), min);
+		b = _mm_max_ps(_mm_min_ps(b, max), min);
+		return _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+	}
+
+	TARGET_AVX2 static inline __m256i load16(const float *input)
+	{
+		const __m256 scale = _mm256_set1_ps(32768.0f);
+		const __m256 max = _mm256_set1_ps(32767.0f);
+		const __m256 min = _mm256_set1_ps(-32768.0f);
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(input), scale);
+		__m256 b = _mm256_mul_ps(_mm256_loadu_ps(input + 8), scale);
+		a = _mm256_max_ps(_mm256_min_ps(a, max), min);
+		b = _mm256_max_ps(_mm256_min_ps(b, max), min);
+		// Packing works within 128-bit lanes, put the quarters back in order
+		__m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+		return _mm256_permute4x64_epi64(packed, 0xD8);
+	}
+};
+
+struct S32Samples
+{
+	typedef int32_t Type;
+
+	TARGET_SSE2 static inline __m128i load8(const int32_t *input)
+	{
+		__m128i a = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(input)), 16);
+		__m128i b = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(input + 4)), 16);
+		return _mm_packs_epi32(a, b);
+	}
+
+	TARGET_AVX2 static inline __m256i load16(const int32_t *input)
+	{
+		__m256i a = _mm256_srai_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(input)), 16);
+		__m256i b = _mm256_srai_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + 8)), 16);
+		return _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+	}
+};
+
+struct S16Samples
+{
+	typedef int16_t Type;
+
+	TARGET_SSE2 static inline __m128i load8(const int16_t *input)
+	{
+		return _mm_loadu_si128(reinterpret_cast<const __m128i *>(input));
+	}
+
+	TARGET_AVX2 static inline __m256i load16(const int16_t *input)
+	{
+		return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input));
+	}
+};
+
+template <typename Samples>
+TARGET_SSE2 static void convertInterleavedSSE2(const uint8_t *const *planes, int channels, int samples, int16_t *output)
+{
+	const typename Samples::Type *input = reinterpret_cast<const typename Samples::Type *>(planes[0]);
+	int count = samples * channels;
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(output + i), Samples::load8(input + i));
+	}
+	for (; i < count; i++) {
+		output[i] = convertSample(input[i]);
+	}
+}
+
+template <typename Samples>
+TARGET_SSE2 static void convertStereoSSE2(const uint8_t *const *planes, int, int samples, int16_t *output)
+{
+	const typename Samples::Type *left = reinterpret_cast<const typename Samples::Type *>(planes[0]);
+	const typename Samples::Type *right = reinterpret_cast<const typename Samples::Type *>(planes[1]);
+	int i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		__m128i l = Samples::load8(left + i);
+		__m128i r = Samples::load8(right + i);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(output + 2 * i), _mm_unpacklo_epi16(l, r));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(output + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+	}
+	for (; i < samples; i++) {
+		output[2 * i] = convertSample(left[i]);
+		output[2 * i + 1] = convertSample(right[i]);
+	}
+}
+
+template <typename Samples>
+TARGET_AVX2 static void convertInterleavedAVX2(const uint8_t *const *planes, int channels, int samples, int16_t *output)
+{
+	const typename Samples::Type *input = reinterpret_cast<const typename Samples::Type *>(planes[0]);
+	int count = samples * channels;
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(output + i), Samples::load16(input + i));
+	}
+	for (; i < count; i++) {
+		output[i] = convertSample(input[i]);
+	}
+}
+
+template <typename Samples>
+TARGET_AVX2 static void convertStereoAVX2(const uint8_t *const *planes, int, int samples, int16_t *output)
+{
+	const typename Samples::Type *left = reinterpret_cast<const typename Samples::Type *>(planes[0]);
+	const typename Samples::Type *right = reinterpret_cast<const typename Samples::Type *>(planes[1]);
+	int i = 0;
+	for (; i + 16 <= samples; i += 16) {
+		__m256i l = Samples::load16(left + i);
+		__m256i r = Samples::load16(right + i);
+		// Unpacking works within 128-bit lanes too, the low halves of both
+		// results hold samples 0-7 and the high halves samples 8-15
+		__m256i lo = _mm256_unpacklo_epi16(l, r);
+		__m256i hi = _mm256_unpackhi_epi16(l, r);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(output + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(output + 2 * i + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	for (; i < samples; i++) {
+		output[2 * i] = convertSample(left[i]);
+		output[2 * i + 1] = convertSample(right[i]);
+	}
+}
+
+template <typename Samples>
+static SampleConverter::ConvertFunc findVectorKernel(bool planar, int channels, SampleConverter::Kernel kernel)
+{
+	if (!planar || channels == 1) {
+		return kernel == SampleConverter::AVX2 ? &convertInterleavedAVX2<Samples> : &convertInterleavedSSE2<Samples>;
+	}
+	if (channels == 2) {
+		return kernel == SampleConverter::AVX2 ? &convertStereoAVX2<Samples> : &convertStereoSSE2<Samples>;
+	}
+	return 0;
+}
+
+#endif
+
+SampleConverter::SampleConverter()
+	: m_convert(0), m_kernel(Scalar), m_channels(0), m_passthrough(false), m_allocations(0)
+{
+}
+
+const char *SampleConverter::kernelName(Kernel kernel)
+{
+	switch (kernel) {
+	case SSE2:
+		return "sse2";
+	case AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+SampleConverter::Kernel SampleConverter::bestKernel()
+{
+	static int result = -1;
+	if (result == -1) {
+		Kernel kernel = Scalar;
+#if defined(HAVE_X86_KERNELS) && defined(__GNUC__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			kernel = AVX2;
+		}
+		else if (__builtin_cpu_supports("sse2")) {
+			kernel = SSE2;
+		}
+#elif defined(HAVE_X86_KERNELS) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		int maxLeaf = info[0];
+		__cpuid(info, 1);
+		bool sse2 = (info[3] & (1 << 26)) != 0;
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5)) {
+				kernel = AVX2;
+			}
+		}
+		if (kernel == Scalar && sse2) {
+			kernel = SSE2;
+		}
+#endif
+		result = kernel;
+	}
+	return Kernel(result);
+}
+
+SampleConverter::ConvertFunc SampleConverter::findKernel(Format format, bool planar, int channels, Kernel kernel)
+{
+#ifdef HAVE_X86_KERNELS
+	if (kernel != Scalar) {
+		switch (format) {
+		case Float:
+			return findVectorKernel<FloatSamples>(planar, channels, kernel);
+		case S32:
+			return findVectorKernel<S32Samples>(planar, channels, kernel);
+		case S16:
+			return findVectorKernel<S16Samples>(planar, channels, kernel);
+		default:
+			return 0;
+		}
+	}
+#endif
+	switch (format) {
+	case U8:
+		return planar ? &convertPlanar<uint8_t> : &convertInterleaved<uint8_t>;
+	case S16:
+		return planar ? &convertPlanar<int16_t> : &convertInterleaved<int16_t>;
+	case S32:
+		return planar ? &convertPlanar<int32_t> : &convertInterleaved<int32_t>;
+	case Float:
+		return planar ? &convertPlanar<float> : &convertInterleaved<float>;
+	case Double:
+		return planar ? &convertPlanar<double> : &convertInterleaved<double>;
+	}
+	return 0;
+}
+
+bool SampleConverter::setFormat(Format format, bool planar, int channels, Kernel maxKernel)
+{
+	m_channels = channels;
+	m_convert = 0;
+	m_kernel = Scalar;
+	// Interleaved 16-bit samples can be used as they are
+	m_passthrough = format == S16 && (!planar || channels == 1);
+	if (m_passthrough) {
+		return true;
+	}
+	Kernel kernel = qMin(bestKernel(), maxKernel);
+	if (kernel != Scalar) {
+		m_convert = findKernel(format, planar, channels, kernel);
+		if (m_convert) {
+			m_kernel = kernel;
+			return true;
+		}
+	}
+	m_convert = findKernel(format, planar, channels, Scalar);
+	return m_convert != 0;
+}
+
+const int16_t *SampleConverter::convert(const uint8_t *const *planes, int samples)
+{
+	if (m_passthrough) {
+		return reinterpret_cast<const int16_t *>(planes[0]);
+	}
+	if (m_buffer.size() < samples * m_channels) {
+		m_buffer.resize(samples * m_channels);
+		m_allocations++;
+	}
+	m_convert(planes, m_channels, samples, m_buffer.data());
+	return m_buffer.constData();
+}
+
+void SampleConverter::convertReference(Format format, bool planar, const uint8_t *const *planes, int channels, int samples, int16_t *output)
+{
+	ConvertFunc convert = findKernel(format, planar, channels, Scalar);
+	if (convert) {
+		convert(planes, channels, samples, output);
+	}
+}
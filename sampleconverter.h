@@ -0,0 +1,63 @@
+#ifndef FPSUBMIT_SAMPLECONVERTER_H_
+#define FPSUBMIT_SAMPLECONVERTER_H_
+
+#include <QVector>
+#include <stdint.h>
+
+// Converts decoded audio in any of the common sample formats, planar or
+// interleaved, into the interleaved signed 16-bit samples chromaprint takes.
+// The kernel is picked once per stream in setFormat(), using SSE2 or AVX2
+// if the CPU has them. All kernels produce exactly the same output as the
+// scalar reference, floats are scaled by 32768, saturated and rounded to the
+// nearest even integer, wider integers keep their top 16 bits.
+class SampleConverter
+{
+public:
+	enum Format
+	{
+		U8,
+		S16,
+		S32,
+		Float,
+		Double
+	};
+
+	enum Kernel
+	{
+		Scalar,
+		SSE2,
+		AVX2
+	};
+
+	typedef void (*ConvertFunc)(const uint8_t *const *planes, int channels, int samples, int16_t *output);
+
+	SampleConverter();
+
+	// Returns false if the format isn't supported.
+	bool setFormat(Format format, bool planar, int channels, Kernel maxKernel = AVX2);
+
+	// Converts the given number of samples per channel. The result is valid
+	// until the next call, for interleaved S16 it's the input itself.
+	const int16_t *convert(const uint8_t *const *planes, int samples);
+
+	Kernel kernel() const { return m_kernel; }
+	// Number of times the output buffer had to grow, it's never shrunk.
+	int allocations() const { return m_allocations; }
+	static const char *kernelName(Kernel kernel);
+	static Kernel bestKernel();
+
+	// The scalar code path, for comparing the optimized kernels against.
+	static void convertReference(Format format, bool planar, const uint8_t *const *planes, int channels, int samples, int16_t *output);
+
+private:
+	static ConvertFunc findKernel(Format format, bool planar, int channels, Kernel kernel);
+
+	ConvertFunc m_convert;
+	Kernel m_kernel;
+	int m_channels;
+	bool m_passthrough;
+	QVector<int16_t> m_buffer;
+	int m_allocations;
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef FPSUBMIT_SIMD_H_
+#define FPSUBMIT_SIMD_H_
+
+// Vector code is compiled for specific instruction sets function by
+// function, and only called after checking the CPU at runtime.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define HAVE_X86_KERNELS 1
+#define TARGET_SSE2
+#define TARGET_AVX2
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef FPSUBMIT_SPSCRING_H_
+#define FPSUBMIT_SPSCRING_H_
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QTime>
+#include <QVector>
+
+// Bounded queue between exactly one producer thread and one consumer thread.
+// Each side only writes its own index and publishes it with a release store,
+// so as long as neither side has to wait no locks are taken. A side that
+// finds the queue full or empty sleeps on a wait condition until the other
+// one makes progress, and the number and length of those stalls is recorded
+// together with how full the queue was, which shows which side is the
+// bottleneck.
+template <typename T>
+class SpscRing
+{
+public:
+	struct Stats
+	{
+		Stats() : pushes(0), occupancy(0), maxOccupancy(0), producerStalls(0), producerWait(0), consumerStalls(0), consumerWait(0) {}
+
+		qint64 pushes;
+		// Sum of the queue sizes right after each push
+		qint64 occupancy;
+		int maxOccupancy;
+		// Times the producer found the queue full and the milliseconds it waited
+		int producerStalls;
+		qint64 producerWait;
+		// Times the consumer found the queue empty and the milliseconds it waited
+		int consumerStalls;
+		qint64 consumerWait;
+	};
+
+	// The capacity is rounded up to a power of two.
+	explicit SpscRing(int capacity)
+		: m_head(0), m_tail(0), m_producerWaiting(0), m_consumerWaiting(0), m_consumerStalls(0), m_consumerWait(0)
+	{
+		int size = 1;
+		while (size < capacity) {
+			size *= 2;
+		}
+		m_items.resize(size);
+		m_mask = size - 1;
+	}
+
+	int capacity() const
+	{
+		return m_mask + 1;
+	}
+
+	int size() const
+	{
+		return load(m_tail) - load(m_head);
+	}
+
+	// Blocks while the queue is full. Must only be called from the producer thread.
+	void push(const T &item)
+	{
+		int tail = m_tail;
+		if (tail - load(m_head) > m_mask) {
+			QTime time;
+			time.start();
+			QMutexLocker locker(&m_mutex);
+			m_producerWaiting.fetchAndStoreOrdered(1);
+			while (tail - load(m_head) > m_mask) {
+				m_notFull.wait(&m_mutex, 10);
+			}
+			m_producerWaiting.fetchAndStoreOrdered(0);
+			m_stats.producerStalls++;
+			m_stats.producerWait += time.elapsed();
+		}
+		m_items[tail & m_mask] = item;
+		m_tail.fetchAndStoreOrdered(tail + 1);
+
+		int occupancy = tail + 1 - load(m_head);
+		m_stats.pushes++;
+		m_stats.occupancy += occupancy;
+		m_stats.maxOccupancy = qMax(m_stats.maxOccupancy, occupancy);
+
+		if (load(m_consumerWaiting)) {
+			QMutexLocker locker(&m_mutex);
+			m_notEmpty.wakeOne();
+		}
+	}
+
+	// Blocks while the queue is empty. Must only be called from the consumer thread.
+	T pop()
+	{
+		int head = m_head;
+		if (load(m_tail) == head) {
+			QTime time;
+			time.start();
+			QMutexLocker locker(&m_mutex);
+			m_consumerWaiting.fetchAndStoreOrdered(1);
+			while (load(m_tail) == head) {
+				m_notEmpty.wait(&m_mutex, 10);
+			}
+			m_consumerWaiting.fetchAndStoreOrdered(0);
+			m_consumerStalls++;
+			m_consumerWait += time.elapsed();
+		}
+		T item = m_items[head & m_mask];
+		m_items[head & m_mask] = T();
+		m_head.fetchAndStoreOrdered(head + 1);
+
+		if (load(m_producerWaiting)) {
+			QMutexLocker locker(&m_mutex);
+			m_notFull.wakeOne();
+		}
+		return item;
+	}
+
+	// The counters are updated without synchronization, so the numbers
+	// are only approximate while both sides are running.
+	Stats stats() const
+	{
+		Stats stats = m_stats;
+		stats.consumerStalls = m_consumerStalls;
+		stats.consumerWait = m_consumerWait;
+		return stats;
+	}
+
+private:
+	static int load(const QAtomicInt &value)
+	{
+		return const_cast<QAtomicInt &>(value).fetchAndAddOrdered(0);
+	}
+
+	QVector<T> m_items;
+	int m_mask;
+	QAtomicInt m_head;
+	QAtomicInt m_tail;
+	QAtomicInt m_producerWaiting;
+	QAtomicInt m_consumerWaiting;
+	QMutex m_mutex;
+	QWaitCondition m_notFull;
+	QWaitCondition m_notEmpty;
+	// Written by the producer
+	Stats m_stats;
+	// Written by the consumer
+	int m_consumerStalls;
+	qint64 m_consumerWait;
+};
+
+#endif
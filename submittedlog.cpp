@@ -0,0 +1,334 @@
+#include <QDir>
+#include <QSet>
+#include <QDebug>
+#ifdef Q_OS_WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "utils.h"
+#include "pathstore.h"
+#include "submittedlog.h"
+
+static const char *SUBMITTED_INDEX_MAGIC = "AIDSUBIX";
+static const quint32 SUBMITTED_INDEX_VERSION = 1;
+static const quint32 MIN_INDEX_CAPACITY = 1 << 16;
+
+Q_GLOBAL_STATIC(SubmittedLog, globalSubmittedLog)
+
+SubmittedLog *SubmittedLog::instance()
+{
+	return globalSubmittedLog();
+}
+
+SubmittedLog::SubmittedLog()
+	: m_logFileName(cacheFileName()), m_indexFileName(QDir::cleanPath(cacheFileName() + "/../submitted.idx")),
+	  m_logData(0), m_logDataSize(0), m_index(SUBMITTED_INDEX_MAGIC, SUBMITTED_INDEX_VERSION), m_opened(false)
+{
+}
+
+SubmittedLog::~SubmittedLog()
+{
+	close();
+}
+
+bool SubmittedLog::open()
+{
+	m_opened = true;
+	QDir().mkpath(QDir::cleanPath(m_logFileName + "/.."));
+
+	m_logFile.setFileName(m_logFileName);
+	if (!m_logFile.exists()) {
+		QFile file(m_logFileName);
+		file.open(QIODevice::WriteOnly);
+	}
+	truncateTornTail();
+	if (!m_logFile.open(QIODevice::ReadOnly)) {
+		qWarning() << "Couldn't open cache file" << m_logFileName << "for reading";
+		return false;
+	}
+	mapLog();
+
+	// The index is thrown away if it describes more data than the log has,
+	// which means the log was replaced or truncated behind our back
+	if (!m_index.open(m_indexFileName) || logSize() > quint64(m_logFile.size())) {
+		qDebug() << "Creating new index" << m_indexFileName;
+		if (!m_index.create(m_indexFileName, MIN_INDEX_CAPACITY)) {
+			return false;
+		}
+	}
+	indexLog();
+
+	// Only logs written by older versions have duplicates, append() skips
+	// the paths that are already in the index
+	quint64 duplicates = lineCount() - m_index.count();
+	if (duplicates > m_index.count() / 4 + 1024) {
+		compact();
+	}
+	return true;
+}
+
+void SubmittedLog::truncateTornTail()
+{
+	// A crash in the middle of a write can leave a partial line at the end
+	// of the log, which would get merged with the next path we append
+	QFile file(m_logFileName);
+	if (!file.open(QIODevice::ReadWrite) || file.size() == 0) {
+		return;
+	}
+	qint64 size = file.size();
+	qint64 end = size;
+	char buffer[4096];
+	while (end > 0) {
+		qint64 start = qMax(qint64(0), end - qint64(sizeof(buffer)));
+		if (!file.seek(start) || file.read(buffer, end - start) != end - start) {
+			return;
+		}
+		int i = int(end - start);
+		while (i > 0 && buffer[i - 1] != '\n') {
+			i--;
+		}
+		if (i > 0) {
+			end = start + i;
+			break;
+		}
+		end = start;
+	}
+	if (end != size) {
+		qWarning() << "Truncating torn tail of" << m_logFileName << "from" << size << "to" << end << "bytes";
+		file.resize(end);
+	}
+}
+
+void SubmittedLog::close()
+{
+	m_appendFile.close();
+	m_index.close();
+	if (m_logData) {
+		m_logFile.unmap(m_logData);
+		m_logData = 0;
+		m_logDataSize = 0;
+	}
+	m_logFile.close();
+}
+
+bool SubmittedLog::mapLog()
+{
+	if (m_logData) {
+		m_logFile.unmap(m_logData);
+		m_logData = 0;
+		m_logDataSize = 0;
+	}
+	qint64 size = m_logFile.size();
+	if (size > 0) {
+		m_logData = m_logFile.map(0, size);
+		if (!m_logData) {
+			qWarning() << "Couldn't map cache file" << m_logFileName;
+			return false;
+		}
+		m_logDataSize = size;
+	}
+	return true;
+}
+
+bool SubmittedLog::lookup(quint64 hash, const QByteArray &line, qint64 *offset)
+{
+	for (quint32 i = m_index.firstSlot(hash); m_index.slot(i)->hash; i = m_index.nextSlot(i)) {
+		const Slot *slot = m_index.slot(i);
+		if (slot->hash != hash) {
+			continue;
+		}
+		// Verify the line to rule out hash collisions, if the log couldn't
+		// be mapped we have to trust the 64-bit hash
+		if (m_logData) {
+			qint64 end = qint64(slot->offset) + line.size();
+			if (end >= m_logDataSize || m_logData[end] != '\n' ||
+			    memcmp(m_logData + slot->offset, line.constData(), line.size()) != 0) {
+				continue;
+			}
+		}
+		if (offset) {
+			*offset = slot->offset;
+		}
+		return true;
+	}
+	return false;
+}
+
+void SubmittedLog::indexLog()
+{
+	if (!m_logData || logSize() >= quint64(m_logDataSize)) {
+		return;
+	}
+	qint64 start = logSize();
+	quint64 lines = 0;
+	const char *data = reinterpret_cast<const char *>(m_logData);
+	while (start < m_logDataSize) {
+		const char *newline = static_cast<const char *>(memchr(data + start, '\n', m_logDataSize - start));
+		if (!newline) {
+			break;
+		}
+		qint64 end = newline - data;
+		if (end > start) {
+			QByteArray line = QByteArray::fromRawData(data + start, end - start);
+			quint64 hash = hashBytes(line.constData(), line.size());
+			if (!lookup(hash, line)) {
+				Slot *slot = m_index.insert(hash);
+				if (!slot) {
+					return;
+				}
+				slot->offset = start;
+			}
+			m_index.header()->extra[1]++;
+			lines++;
+		}
+		start = end + 1;
+		m_index.header()->extra[0] = start;
+	}
+	if (lines) {
+		qDebug() << "Indexed" << lines << "lines from" << m_logFileName;
+	}
+}
+
+void SubmittedLog::compact()
+{
+	qDebug() << "Compacting" << m_logFileName;
+
+	// Keep only the first occurrence of each path, that's the line the index points to
+	QString tmpFileName = m_logFileName + ".tmp";
+	QFile file(tmpFileName);
+	if (!m_logData || !file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		return;
+	}
+	const char *data = reinterpret_cast<const char *>(m_logData);
+	qint64 start = 0, size = logSize();
+	while (start < size) {
+		const char *newline = static_cast<const char *>(memchr(data + start, '\n', size - start));
+		if (!newline) {
+			break;
+		}
+		qint64 end = newline - data, offset = -1;
+		QByteArray line = QByteArray::fromRawData(data + start, end - start);
+		if (!line.isEmpty() && lookup(hashBytes(line.constData(), line.size()), line, &offset) && offset == start) {
+			file.write(data + start, end - start + 1);
+		}
+		start = end + 1;
+	}
+	// The copy has to be on the disk before it replaces the log
+	file.flush();
+#ifdef Q_OS_WIN32
+	_commit(file.handle());
+#else
+	fsync(file.handle());
+#endif
+	file.close();
+
+	quint32 capacity = MIN_INDEX_CAPACITY;
+	while (m_index.count() * 2ULL > capacity) {
+		capacity *= 2;
+	}
+	// The index goes first, a crash before the log is replaced then only
+	// means the old log gets indexed again
+	close();
+	QFile::remove(m_indexFileName);
+	if (!replaceFile(tmpFileName, m_logFileName)) {
+		qWarning() << "Couldn't replace cache file" << m_logFileName;
+		QFile::remove(tmpFileName);
+	}
+	if (!m_logFile.open(QIODevice::ReadOnly) || !mapLog()) {
+		return;
+	}
+	if (m_index.create(m_indexFileName, capacity)) {
+		indexLog();
+	}
+}
+
+bool SubmittedLog::contains(const QString &path)
+{
+	return containsLine(path.toUtf8());
+}
+
+bool SubmittedLog::contains(quint32 file)
+{
+	return containsLine(PathStore::instance()->utf8Path(file));
+}
+
+bool SubmittedLog::containsLine(const QByteArray &line)
+{
+	m_lock.lockForRead();
+	if (!m_opened) {
+		m_lock.unlock();
+		m_lock.lockForWrite();
+		if (!m_opened) {
+			open();
+		}
+	}
+	bool result = m_index.isOpen() && lookup(hashBytes(line.constData(), line.size()), line);
+	m_lock.unlock();
+	return result;
+}
+
+int SubmittedLog::size()
+{
+	QWriteLocker locker(&m_lock);
+	if (!m_opened) {
+		open();
+	}
+	return m_index.isOpen() ? m_index.count() : 0;
+}
+
+void SubmittedLog::append(const QStringList &paths)
+{
+	QWriteLocker locker(&m_lock);
+	if (!m_opened) {
+		open();
+	}
+
+	QByteArray data;
+	QSet<QByteArray> added;
+	foreach (const QString &path, paths) {
+		QByteArray line = path.toUtf8();
+		if (line.isEmpty() || added.contains(line)) {
+			continue;
+		}
+		if (m_index.isOpen() && lookup(hashBytes(line.constData(), line.size()), line)) {
+			continue;
+		}
+		added.insert(line);
+		data += line;
+		data += '\n';
+	}
+	if (data.isEmpty()) {
+		return;
+	}
+
+	if (!m_appendFile.isOpen()) {
+		m_appendFile.setFileName(m_logFileName);
+		if (!m_appendFile.open(QIODevice::Append)) {
+			qCritical() << "Couldn't open cache file" << m_logFileName << "for writing";
+			return;
+		}
+	}
+	if (m_appendFile.write(data) != data.size() || !m_appendFile.flush()) {
+		qCritical() << "Couldn't write to cache file" << m_logFileName;
+		return;
+	}
+
+	if (m_logFile.isOpen() && mapLog() && m_index.isOpen()) {
+		indexLog();
+	}
+}
+
+bool SubmittedLog::sync()
+{
+	// Appending needs the write lock, so the file can't change under us
+	QReadLocker locker(&m_lock);
+	if (!m_appendFile.isOpen()) {
+		return true;
+	}
+#ifdef Q_OS_WIN32
+	return _commit(m_appendFile.handle()) == 0;
+#else
+	return fsync(m_appendFile.handle()) == 0;
+#endif
+}
@@ -0,0 +1,65 @@
+#ifndef FPSUBMIT_SUBMITTEDLOG_H_
+#define FPSUBMIT_SUBMITTEDLOG_H_
+
+#include <QFile>
+#include <QReadWriteLock>
+#include <QStringList>
+#include "mappedtable.h"
+
+// List of files that have already been submitted. The paths are stored one
+// per line in the UTF-8 text file submitted.log, same as in older versions,
+// and submitted.idx holds a memory-mapped hash table of 64-bit path hashes
+// pointing to the lines, so lookups don't need to load the log into memory.
+// The index is brought up to date with the log when it's opened, which also
+// takes care of migrating logs written without an index. Older versions
+// appended paths that were already in the log, if there are many of those
+// the log is compacted once after the migration. New duplicates are never
+// appended, so that's the only compaction there is. Paths of files that
+// were deleted or moved stay in the log, they might be on a drive that
+// just isn't mounted at the moment.
+class SubmittedLog
+{
+public:
+	SubmittedLog();
+	~SubmittedLog();
+
+	static SubmittedLog *instance();
+
+	bool contains(const QString &path);
+	bool contains(quint32 file);
+	void append(const QStringList &paths);
+	// Flushes appended paths to the disk.
+	bool sync();
+	int size();
+
+private:
+	struct Slot
+	{
+		quint64 hash;
+		quint64 offset;
+	};
+
+	bool open();
+	void close();
+	void truncateTornTail();
+	bool mapLog();
+	bool lookup(quint64 hash, const QByteArray &line, qint64 *offset = 0);
+	bool containsLine(const QByteArray &line);
+	void indexLog();
+	void compact();
+
+	quint64 logSize() const { return m_index.header()->extra[0]; }
+	quint64 lineCount() const { return m_index.header()->extra[1]; }
+
+	QReadWriteLock m_lock;
+	QString m_logFileName;
+	QString m_indexFileName;
+	QFile m_logFile;
+	QFile m_appendFile;
+	uchar *m_logData;
+	qint64 m_logDataSize;
+	MappedTable<Slot> m_index;
+	bool m_opened;
+};
+
+#endif
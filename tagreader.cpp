@@ -1,4 +1,5 @@
 #include <QFile>
+#include <taglib.h>
 #include <fileref.h>
 #include <xiphcomment.h>
 #include <apetag.h>
@@ -18,8 +19,99 @@
 #include <id3v2tag.h>
 #include <textidentificationframe.h>
 #include <uniquefileidentifierframe.h>
+#include "inputfile.h"
 #include "tagreader.h"
 
+#if TAGLIB_MAJOR_VERSION > 1 || (TAGLIB_MAJOR_VERSION == 1 && TAGLIB_MINOR_VERSION >= 11)
+#define TAGLIB_HAS_STREAM_FILEREF
+#include <tiostream.h>
+
+#if TAGLIB_MAJOR_VERSION > 1
+typedef TagLib::offset_t StreamOffset;
+typedef TagLib::offset_t StreamStart;
+typedef size_t StreamSize;
+#else
+typedef long StreamOffset;
+typedef unsigned long StreamStart;
+typedef unsigned long StreamSize;
+#endif
+
+// Lets TagLib read the tags through the InputFile the decoder is going to
+// read the audio from, so the file is opened only once and the headers
+// TagLib reads are already buffered when the decoder needs them.
+class InputFileStream : public TagLib::IOStream
+{
+public:
+	InputFileStream(InputFile *input, const QString &fileName)
+		: m_input(input), m_fileName(fileName), m_encodedFileName(QFile::encodeName(fileName))
+	{
+	}
+
+	TagLib::FileName name() const
+	{
+#ifdef Q_OS_WIN32
+		return TagLib::FileName(reinterpret_cast<const wchar_t *>(m_fileName.utf16()));
+#else
+		return m_encodedFileName.constData();
+#endif
+	}
+
+	TagLib::ByteVector readBlock(StreamSize length)
+	{
+		TagLib::ByteVector data(static_cast<unsigned int>(length), 0);
+		qint64 size = m_input->read(data.data(), length);
+		data.resize(size > 0 ? static_cast<unsigned int>(size) : 0);
+		return data;
+	}
+
+	void seek(StreamOffset offset, Position position = Beginning)
+	{
+		switch (position) {
+		case Beginning:
+			break;
+		case Current:
+			offset += m_input->position();
+			break;
+		case End:
+			offset += m_input->size();
+			break;
+		}
+		m_input->seek(offset);
+	}
+
+	StreamOffset tell() const
+	{
+		return m_input->position();
+	}
+
+	StreamOffset length()
+	{
+		return m_input->size();
+	}
+
+	bool readOnly() const
+	{
+		return true;
+	}
+
+	bool isOpen() const
+	{
+		return m_input->isOpen();
+	}
+
+	// Nothing is ever written to the file
+	void writeBlock(const TagLib::ByteVector &) {}
+	void insert(const TagLib::ByteVector &, StreamStart = 0, StreamSize = 0) {}
+	void removeBlock(StreamStart = 0, StreamSize = 0) {}
+	void truncate(StreamOffset) {}
+
+private:
+	InputFile *m_input;
+	QString m_fileName;
+	QByteArray m_encodedFileName;
+};
+#endif
+
 QMutex TagReader::m_mutex;
 
 TagReader::TagReader(const QString &fileName)
@@ -219,17 +311,32 @@ void extractMeta(TagReader *tr, TagLib::File *file)
 	DISPATCH_TAGLIB_FILE(tr, TagLib::MPEG::File, file);
 }
 
-bool TagReader::read()
+bool TagReader::read(InputFile *input)
 {
     // TagLib functions are not reentrant
     QMutexLocker locker(&m_mutex);
 
+#ifdef TAGLIB_HAS_STREAM_FILEREF
+    if (input && input->isOpen()) {
+        InputFileStream stream(input, m_fileName);
+        TagLib::FileRef file(&stream, true);
+        return readTags(file);
+    }
+#else
+    Q_UNUSED(input);
+#endif
+
 #ifdef Q_OS_WIN32
     TagLib::FileRef file(reinterpret_cast<const wchar_t *>(m_fileName.utf16()), true);
 #else
     QByteArray encodedFileName = QFile::encodeName(m_fileName);
 	TagLib::FileRef file(encodedFileName.constData(), true);
 #endif
+	return readTags(file);
+}
+
+bool TagReader::readTags(TagLib::FileRef &file)
+{
 	if (file.isNull()) {
 		return false;
     }
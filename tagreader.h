@@ -24,13 +24,22 @@
 #include <QMutex>
 #include <QString>
 
+class InputFile;
+
+namespace TagLib {
+class FileRef;
+}
+
 class TagReader
 {
 public:
     TagReader(const QString &fileName);
 	~TagReader();
 
-    bool read();
+    // Reads the tags through the given file if it's open and the TagLib
+    // version supports reading from streams, otherwise opens the file by
+    // its name.
+    bool read(InputFile *input = 0);
 
     QString mbid() const
     {
@@ -70,6 +79,9 @@ public:
     int m_bitrate;
     int m_length;
     static QMutex m_mutex;
+
+private:
+    bool readTags(TagLib::FileRef &file);
 };
 
 #endif
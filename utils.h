@@ -2,7 +2,13 @@
 #define FPSUBMIT_UTILS_H_
 
 #include <QString>
+#include <QFile>
 #include <QDesktopServices>
+#ifdef Q_OS_WIN32
+#include <qt_windows.h>
+#else
+#include <stdio.h>
+#endif
 
 inline QString userAgentString()
 {
@@ -14,6 +20,18 @@ inline QString cacheFileName()
 	return QDesktopServices::storageLocation(QDesktopServices::CacheLocation) + "/submitted.log";
 }
 
+// Replaces one file with another in a single step, so that a crash leaves
+// either the old or the new file behind, never neither of them.
+inline bool replaceFile(const QString &from, const QString &to)
+{
+#ifdef Q_OS_WIN32
+	return MoveFileExW(reinterpret_cast<const wchar_t *>(from.utf16()), reinterpret_cast<const wchar_t *>(to.utf16()),
+	                   MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return ::rename(QFile::encodeName(from).constData(), QFile::encodeName(to).constData()) == 0;
+#endif
+}
+
 inline QString extractExtension(const QString &fileName)
 {
 	int pos = fileName.lastIndexOf('.');
@@ -0,0 +1,157 @@
+#include <string.h>
+#include "inputfile.h"
+#include "wavdecoder.h"
+
+// Frames decoded per block
+static const int WAV_BLOCK_FRAMES = 4096;
+
+static const int WAVE_FORMAT_PCM = 0x0001;
+static const int WAVE_FORMAT_IEEE_FLOAT = 0x0003;
+static const int WAVE_FORMAT_EXTENSIBLE = 0xfffe;
+
+static inline quint32 readLE16(const uint8_t *data)
+{
+	return data[0] | (data[1] << 8);
+}
+
+static inline quint32 readLE32(const uint8_t *data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | (quint32(data[3]) << 24);
+}
+
+WavDecoder::WavDecoder()
+	: m_input(0), m_bitsPerSample(0), m_blockAlign(0), m_dataEnd(0), m_allocations(0)
+{
+}
+
+bool WavDecoder::readFormat(const uint8_t *data, int size)
+{
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+	// The samples are converted in place as native integers and floats
+	return false;
+#endif
+	if (size < 16) {
+		return false;
+	}
+	int tag = readLE16(data);
+	m_channels = readLE16(data + 2);
+	m_sampleRate = readLE32(data + 4);
+	m_blockAlign = readLE16(data + 12);
+	m_bitsPerSample = readLE16(data + 14);
+	if (tag == WAVE_FORMAT_EXTENSIBLE) {
+		if (size < 40 || readLE16(data + 16) < 22) {
+			return false;
+		}
+		// Padded samples would need masking, which FFmpeg doesn't do either
+		int validBits = readLE16(data + 18);
+		if (validBits != 0 && validBits != m_bitsPerSample) {
+			return false;
+		}
+		// The format tag is in the first two bytes of the subformat GUID
+		tag = readLE16(data + 24);
+	}
+	if (m_channels <= 0 || m_sampleRate <= 0 || m_blockAlign != m_channels * m_bitsPerSample / 8) {
+		return false;
+	}
+	if (tag == WAVE_FORMAT_PCM) {
+		switch (m_bitsPerSample) {
+		case 8:
+			return m_converter.setFormat(SampleConverter::U8, false, m_channels);
+		case 16:
+			return m_converter.setFormat(SampleConverter::S16, false, m_channels);
+		case 24:
+			// Converted here, SampleConverter doesn't have packed 24-bit samples
+			return true;
+		case 32:
+			return m_converter.setFormat(SampleConverter::S32, false, m_channels);
+		}
+	}
+	else if (tag == WAVE_FORMAT_IEEE_FLOAT) {
+		switch (m_bitsPerSample) {
+		case 32:
+			return m_converter.setFormat(SampleConverter::Float, false, m_channels);
+		case 64:
+			return m_converter.setFormat(SampleConverter::Double, false, m_channels);
+		}
+	}
+	return false;
+}
+
+bool WavDecoder::open(InputFile *input)
+{
+	m_input = input;
+	m_channels = 0;
+	if (!m_input->seek(0)) {
+		return false;
+	}
+	uint8_t header[40];
+	if (m_input->read(reinterpret_cast<char *>(header), 12) != 12 ||
+	    memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+		return false;
+	}
+	bool haveFormat = false;
+	while (true) {
+		if (m_input->read(reinterpret_cast<char *>(header), 8) != 8) {
+			return false;
+		}
+		quint32 size = readLE32(header + 4);
+		qint64 start = m_input->position();
+		if (memcmp(header, "data", 4) == 0) {
+			if (!haveFormat) {
+				return false;
+			}
+			// Streamed files often leave the size of the data chunk unset
+			m_dataEnd = size == 0 || size == 0xffffffff ? m_input->size() : qMin(start + size, m_input->size());
+			return true;
+		}
+		if (memcmp(header, "fmt ", 4) == 0) {
+			int length = qMin(size, quint32(sizeof(header)));
+			if (m_input->read(reinterpret_cast<char *>(header), length) != length || !readFormat(header, length)) {
+				return false;
+			}
+			haveFormat = true;
+		}
+		// Chunks are padded to an even size
+		if (!m_input->seek(start + size + (size & 1))) {
+			return false;
+		}
+	}
+}
+
+int WavDecoder::decode(const int16_t **samples)
+{
+	qint64 available = (m_dataEnd - m_input->position()) / m_blockAlign;
+	int frames = int(qMin(qint64(WAV_BLOCK_FRAMES), available));
+	if (frames <= 0) {
+		return 0;
+	}
+	int size = frames * m_blockAlign;
+	if (m_data.size() < size) {
+		m_data.resize(size);
+		m_allocations++;
+	}
+	qint64 result = m_input->read(reinterpret_cast<char *>(m_data.data()), size);
+	if (result <= 0) {
+		return 0;
+	}
+	frames = int(result / m_blockAlign);
+	const uint8_t *data = m_data.constData();
+	if (m_bitsPerSample == 24) {
+		// The top 16 bits of each sample, like the S32 output of FFmpeg's
+		// 24-bit decoder after conversion
+		int count = frames * m_channels;
+		if (m_output.size() < count) {
+			m_output.resize(count);
+			m_allocations++;
+		}
+		int16_t *output = m_output.data();
+		for (int i = 0; i < count; i++) {
+			output[i] = int16_t(data[3 * i + 1] | (data[3 * i + 2] << 8));
+		}
+		*samples = output;
+	}
+	else {
+		*samples = m_converter.convert(&data, frames);
+	}
+	return frames;
+}
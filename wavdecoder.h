@@ -0,0 +1,33 @@
+#ifndef FPSUBMIT_WAVDECODER_H_
+#define FPSUBMIT_WAVDECODER_H_
+
+#include <QVector>
+#include "sampleconverter.h"
+#include "nativedecoder.h"
+
+// Integer and floating point PCM in RIFF WAVE files, including
+// WAVE_FORMAT_EXTENSIBLE. The samples are converted the same way FFmpeg's
+// PCM decoders and SampleConverter would do it.
+class WavDecoder : public NativeDecoder
+{
+public:
+	WavDecoder();
+
+	bool open(InputFile *input);
+	int decode(const int16_t **samples);
+	int allocations() const { return m_allocations + m_converter.allocations(); }
+
+private:
+	bool readFormat(const uint8_t *data, int size);
+
+	InputFile *m_input;
+	SampleConverter m_converter;
+	int m_bitsPerSample;
+	int m_blockAlign;
+	qint64 m_dataEnd;
+	QVector<uint8_t> m_data;
+	QVector<int16_t> m_output;
+	int m_allocations;
+};
+
+#endif